@@ -0,0 +1,79 @@
+/* Bump allocation for the events of a trace, released all at once */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * States, Links, Comms and their strings all live from the time they are read
+ * until compensation is done with the whole trace, so instead of being
+ * allocated (and freed) one by one, they are carved out of large blocks with
+ * a pointer bump, with no per object header, and the blocks are freed
+ * together by arena_release.
+ *
+ * An arena is not thread safe: every thread that creates events has its own,
+ * and arena_merge hands the blocks of one over to another once the thread is
+ * done, so that a single arena owns the whole trace.
+ */
+
+/* Size of the blocks (objects over a quarter of it get a block of their own) */
+#define ARENA_BLOCK ((size_t)1 << 20)
+
+/* Whatever needs the strictest alignment, which arena_alloc aligns to */
+union Arena_align {
+  long double ld;
+  double d;
+  uint64_t u;
+  void *p;
+};
+
+#define ARENA_ALIGN sizeof(union Arena_align)
+
+struct Arena_block;
+
+/* Zero is an empty arena */
+struct Arena {
+  /* The one being bumped into first */
+  struct Arena_block *blocks;
+  char *pos,
+       *end;
+};
+
+/* Slow path of arena_alloc */
+void *
+arena_grow(struct Arena *arena, size_t size);
+
+/*
+ * Returns size bytes (uninitialized) aligned for any object, valid until
+ * arena_release. Aborts on failure.
+ */
+static inline void *
+arena_alloc(struct Arena *arena, size_t size)
+{
+  size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+  if (!arena->pos || (size_t)(arena->end - arena->pos) < size)
+    return arena_grow(arena, size);
+  void *ans = arena->pos;
+  arena->pos += size;
+  return ans;
+}
+
+/* Copy len bytes of str (and a null terminator). Aborts on failure. */
+char *
+arena_strndup(struct Arena *arena, char const *str, size_t len);
+
+/* Copy str. Aborts on failure. */
+char *
+arena_strdup(struct Arena *arena, char const *str);
+
+/* Move every block of src to dst, leaving src empty */
+void
+arena_merge(struct Arena *dst, struct Arena *src);
+
+/* Forget everything allocated, keeping the current block for reuse */
+void
+arena_clear(struct Arena *arena);
+
+/* Free every block, leaving the arena empty */
+void
+arena_release(struct Arena *arena);
@@ -1,16 +1,26 @@
 /* Argument parsing */
 #pragma once
 
+#include "reorder.h"
 #include <argp.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
-static char doc[] = "Outputs a trace compensating for Aky's intrusion";
-static char args_doc[] = "ORIGINAL-TRACE COPYTIME-DATA OVERHEAD SYNC-BYTES";
+static char doc[] = "Outputs a trace compensating for Aky's intrusion\v"
+  "Several ORIGINAL-TRACEs are taken as shards of the same trace (e.g. one per "
+  "rank), each sorted by start time, and merged by start time as they are "
+  "read.";
+static char args_doc[] = "ORIGINAL-TRACE... COPYTIME-DATA OVERHEAD SYNC-BYTES";
 static struct argp_option options[] = {
   {"lower", 'l', 0, OPTION_ARG_OPTIONAL, "Use a lower instead of upper bound for approximated communication times", 0},
+  {"binary", 'b', 0, 0, "Write a binary columnar trace (see binout.h) instead of text", 0},
+  {"sort", 's', "N", OPTION_ARG_OPTIONAL, "Sort the output by compensated start time, with a reorder buffer of N (default 4096) events per rank, spilling to a temporary file if need be", 0},
+  {"paje", 'p', 0, 0, "Write a Pajé trace, sorted as with --sort, instead of pj_dump text", 0},
+  {"split", 'o', "PREFIX", 0, "Write the events of each rank N to its own file, PREFIX.N, other lines still going to stdout", 0},
+  {"jobs", 'j', "N", 0, "Parse the trace and format the output with N threads (defaults to the number of online processors)", 0},
   {"version", 'v', 0, OPTION_ARG_OPTIONAL, "Print version", 0},
   { 0 }
 };
@@ -18,8 +28,20 @@ static struct argp_option options[] = {
 #define NUM_ARGS 4
 
 struct arguments {
+  /* input[0] is the first trace */
   char *input[NUM_ARGS];
-  bool lower;
+  /* Every trace, room for argc pointers is expected */
+  char **traces;
+  size_t ntraces;
+  bool lower,
+       binary,
+       paje;
+  /* Reorder buffer size (see reorder.h), 0 means unsorted */
+  size_t sort;
+  /* Of the per rank files (see split.h), NULL for stdout */
+  char *split;
+  /* 0 means unset */
+  unsigned jobs;
 };
 
 /* state should be zerod and errno should be zero */
@@ -31,19 +53,59 @@ parse_options(int key, char *arg, struct argp_state *state)
     case 'l':
       args->lower = true;
       break;
+    case 'b':
+      args->binary = true;
+      break;
+    case 's': {
+      if (!arg) {
+        args->sort = REORDER_BUFFER;
+        break;
+      }
+      char *endptr = NULL;
+      unsigned long long size = strtoull(arg, &endptr, 10);
+      if (errno || endptr == arg || *endptr || !size || size > UINT_MAX)
+        argp_error(state, "Invalid reorder buffer size: %s", arg);
+      args->sort = (size_t)size;
+      break;
+    }
+    case 'p':
+      args->paje = true;
+      break;
+    case 'o':
+      args->split = arg;
+      break;
+    case 'j': {
+      char *endptr = NULL;
+      unsigned long jobs = strtoul(arg, &endptr, 10);
+      if (errno || endptr == arg || *endptr || !jobs || jobs > UINT_MAX)
+        argp_error(state, "Invalid number of jobs: %s", arg);
+      args->jobs = (unsigned)jobs;
+      break;
+    }
     case 'v':
       printf("%s\n", VERSION);
       exit(EXIT_SUCCESS);
     case ARGP_KEY_ARG:
-      /* Too many arguments. */
-      if (state->arg_num == NUM_ARGS)
-        argp_usage(state);
-      args->input[state->arg_num] = arg;
+      /* (sorted out at the end, only the last NUM_ARGS - 1 are not traces) */
+      args->traces[args->ntraces++] = arg;
       break;
     case ARGP_KEY_END:
       /* Not enough arguments. */
       if (state->arg_num < NUM_ARGS)
         argp_usage(state);
+      if (args->binary && args->sort)
+        argp_error(state, "--sort only applies to the text output");
+      if (args->binary && args->split)
+        argp_error(state, "--split only applies to the text output");
+      if (args->paje && (args->binary || args->split))
+        argp_error(state, "--paje can't be combined with --binary nor --split");
+      /* (Pajé events have to be in time order) */
+      if (args->paje && !args->sort)
+        args->sort = REORDER_BUFFER;
+      args->ntraces -= NUM_ARGS - 1;
+      args->input[0] = args->traces[0];
+      for (size_t i = 1; i < NUM_ARGS; i++)
+        args->input[i] = args->traces[args->ntraces + i - 1];
       break;
     default:
       return ARGP_ERR_UNKNOWN;
@@ -0,0 +1,164 @@
+/* Binary columnar output format for compensated traces */
+#pragma once
+
+#include "events.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Layout (native byte order, every section 8 byte aligned), written as a
+ * stream to stdout (see output.h):
+ *
+ * [ header ][ block ][ block ] ... [ strings ][ passthrough ][ index ][ trailer ]
+ *
+ * block       - A struct Binout_block followed by the columns of up to
+ *               BINOUT_BLOCK compensated States (or Links) of one rank, see
+ *               struct Binout_states/links. Blocks of a rank are in output
+ *               order, blocks of different ranks are interleaved.
+ * strings     - uint64 offsets[strings + 1], then the null terminated strings
+ *               (routine names and link containers are ids into this,
+ *               BINOUT_NULL standing for a NULL string)
+ * passthrough - The lines that are neither States nor Links, verbatim
+ * index       - One struct Binout_index per block, in file order
+ * trailer     - struct Binout_trailer, at the very end of the file, locating
+ *               everything else
+ *
+ * Every event has its original start and end next to the compensated ones.
+ * For Links those are the original start of the send and end of the recv.
+ * Links belong to the rank of the recv.
+ */
+
+#define BINOUT_MAGIC "PJCOUT\0"
+#define BINOUT_VERSION 1
+#define BINOUT_BYTE_ORDER 0x01020304
+#define BINOUT_BLOCK 4096
+#define BINOUT_NULL UINT32_MAX
+
+enum Binout_kind {
+  BINOUT_STATES,
+  BINOUT_LINKS
+};
+
+struct Binout_header {
+  char magic[8];
+  uint32_t version,
+           byte_order;
+};
+
+struct Binout_block {
+  /* enum Binout_kind */
+  uint32_t kind;
+  int32_t rank;
+  uint64_t count;
+};
+
+struct Binout_index {
+  /* Of the struct Binout_block */
+  uint64_t offset,
+           count;
+  int32_t rank;
+  uint32_t kind;
+};
+
+struct Binout_trailer {
+  uint64_t blocks,
+           strings,
+           passthrough_len,
+           index_off,
+           strings_off,
+           passthrough_off;
+  char magic[8];
+};
+
+/* Columns of a block of States (n = Binout_block::count) */
+struct Binout_states {
+  double const *ostart,
+               *oend,
+               *start,
+               *end;
+  uint64_t const *mark;
+  /* enum Routine */
+  uint32_t const *code,
+                 *routine;
+  int32_t const *imbrication;
+};
+
+/* Columns of a block of Links (n = Binout_block::count) */
+struct Binout_links {
+  double const *ostart,
+               *oend,
+               *start,
+               *end;
+  uint64_t const *mark,
+               *bytes;
+  int32_t const *from;
+  uint32_t const *container;
+};
+
+/* Read-only view of a (mapped) compensated binary trace */
+struct Binout {
+  char const *base;
+  struct Binout_trailer const *trailer;
+  struct Binout_index const *index;
+  uint64_t const *string_offs;
+  char const *string_blob,
+             *passthrough;
+};
+
+/*
+ * Set bo up as a view of the size bytes at map, checking that every section
+ * lies within bounds. Returns 0 on success, -1 on failure, in which case it
+ * also reports what is wrong.
+ */
+int
+binout_open(struct Binout *bo, void const *map, size_t size);
+
+/* Column pointers of the States block with the given index entry */
+void
+binout_states(struct Binout const *bo, size_t block,
+    struct Binout_states *cols);
+
+/* Column pointers of the Links block with the given index entry */
+void
+binout_links(struct Binout const *bo, size_t block, struct Binout_links *cols);
+
+/* String with the given id, NULL for BINOUT_NULL */
+static inline char const *
+binout_string(struct Binout const *bo, uint32_t id)
+{
+  return id == BINOUT_NULL ? NULL : bo->string_blob + bo->string_offs[id];
+}
+
+/*
+ * Writing, a singleton as stdout is. Once started, the compensated events go
+ * to binout_state/link instead of state_print and state_print_c_recv.
+ */
+
+/* Start writing a binary trace to stdout. Aborts on failure. */
+void
+binout_start(void);
+
+/* Whether binout_start was called */
+bool
+binout_active(void);
+
+/* Append a compensated state. Aborts on failure. */
+void
+binout_state(struct State const *state, double ostart, double oend);
+
+/*
+ * Append the link of a compensated recv, see state_print_c_recv. Aborts on
+ * failure.
+ */
+void
+binout_link(struct State const *recv, struct State const *match, double ostart,
+    double oend);
+
+/* Append a line that is neither a State nor a Link. Aborts on failure. */
+void
+binout_passthrough(char const *line, size_t len);
+
+/* Write the remaining blocks and the footer. Aborts on failure. */
+void
+binout_finish(void);
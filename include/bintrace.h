@@ -0,0 +1,173 @@
+/* Binary columnar trace format, a pre-parsed pj_dump trace */
+#pragma once
+
+#include "events.h"
+#include "uthash.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Layout (native byte order, every section 8 byte aligned):
+ *
+ * [ header ][ rank table ][ order ][ strings ][ passthrough ][ rank blocks ]
+ *
+ * rank table  - One struct Bintrace_rank per rank
+ * order       - uint32 rank of every State, in file order (the loader walks
+ *               this to rebuild the global state queue)
+ * strings     - uint64 offsets[strings + 1], then the null terminated strings
+ *               (routine names and link containers are ids into this)
+ * passthrough - The lines that are neither States nor Links, verbatim
+ * rank blocks - Per rank, the columns of its States and of the Links that end
+ *               in it (both in file order), see struct Bintrace_states/links
+ *
+ * Link types are stored as their enum Link_type value.
+ */
+
+#define BINTRACE_MAGIC "PJCBIN\0"
+#define BINTRACE_VERSION 1
+#define BINTRACE_BYTE_ORDER 0x01020304
+
+struct Bintrace_header {
+  char magic[8];
+  uint32_t version,
+           byte_order;
+  uint64_t ranks,
+           states,
+           links,
+           strings,
+           passthrough_len,
+           order_off,
+           strings_off,
+           passthrough_off;
+};
+
+struct Bintrace_rank {
+  uint64_t states,
+           links,
+           states_off,
+           links_off;
+};
+
+/* Columns of the States of one rank (n = Bintrace_rank::states) */
+struct Bintrace_states {
+  double const *start,
+               *end;
+  uint64_t const *mark;
+  uint32_t const *routine;
+  int32_t const *imbrication;
+};
+
+/* Columns of the Links ending in one rank (n = Bintrace_rank::links) */
+struct Bintrace_links {
+  double const *start,
+               *end;
+  uint64_t const *mark,
+               *bytes;
+  int32_t const *from;
+  uint32_t const *type,
+                 *container;
+};
+
+/* Read-only view of a (mapped) binary trace */
+struct Bintrace {
+  struct Bintrace_header const *header;
+  struct Bintrace_rank const *ranks;
+  uint32_t const *order;
+  uint64_t const *string_offs;
+  char const *string_blob,
+             *passthrough;
+};
+
+/* Returns true if the size bytes at map look like a binary trace */
+bool
+bintrace_is(void const *map, size_t size);
+
+/*
+ * Returns true if the len bytes at head, the start of an input, begin with the
+ * magic of a binary trace
+ */
+static inline bool
+bintrace_magic(void const *head, size_t len)
+{
+  return len >= sizeof(BINTRACE_MAGIC) &&
+    !memcmp(head, BINTRACE_MAGIC, sizeof(BINTRACE_MAGIC));
+}
+
+/*
+ * Set bt up as a view of the size bytes at map, checking that every section
+ * lies within bounds. Returns 0 on success, -1 on failure, in which case it
+ * also reports what is wrong.
+ */
+int
+bintrace_open(struct Bintrace *bt, void const *map, size_t size);
+
+/* Column pointers of the States of rank */
+void
+bintrace_states(struct Bintrace const *bt, size_t rank,
+    struct Bintrace_states *cols);
+
+/* Column pointers of the Links ending in rank */
+void
+bintrace_links(struct Bintrace const *bt, size_t rank,
+    struct Bintrace_links *cols);
+
+/* String with the given id (ids are checked by bintrace_open) */
+static inline char const *
+bintrace_string(struct Bintrace const *bt, uint32_t id)
+{
+  return bt->string_blob + bt->string_offs[id];
+}
+
+/*
+ * Accumulates a trace in memory to write it out as a binary trace. Strings are
+ * interned as they come.
+ */
+struct Bintrace_string {
+  char *str;
+  uint32_t id;
+  UT_hash_handle hh;
+};
+
+struct Bintrace_builder {
+  size_t ranks;
+  struct Bintrace_column_set *cols;
+  uint32_t *order;
+  size_t states,
+         order_cap,
+         links;
+  char *passthrough;
+  size_t passthrough_len,
+         passthrough_cap;
+  struct Bintrace_string *strings;
+  uint32_t nstrings;
+};
+
+/* Aborts on failure */
+void
+bintrace_builder_init(struct Bintrace_builder *b);
+
+/* Append a state (its rank must be >= 0). Aborts on failure. */
+void
+bintrace_builder_state(struct Bintrace_builder *b, struct State const *state);
+
+/* Append a link (its destination rank must be >= 0). Aborts on failure. */
+void
+bintrace_builder_link(struct Bintrace_builder *b, struct Link const *link);
+
+/* Append a line that is neither a State nor a Link. Aborts on failure. */
+void
+bintrace_builder_other(struct Bintrace_builder *b, char const *line,
+    size_t len);
+
+/*
+ * Write everything appended so far to filename. Returns 0 on success, -1 on
+ * failure, in which case it also sets errno.
+ */
+int
+bintrace_builder_write(struct Bintrace_builder const *b,
+    char const *filename);
+
+void
+bintrace_builder_del(struct Bintrace_builder *b);
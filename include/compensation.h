@@ -28,15 +28,17 @@ struct Data {
    * is > 4096.
    */
   size_t sync_bytes;
+  /* The States being compensated, see store.h */
+  struct Store *store;
 };
 
 /*
- * Compensates a local event. Alters state and data timestamp information with
- * the compensated timestamp. Assumes both state and data have been properly
- * initialized.
+ * Compensates a local event, the State of data->store with handle state.
+ * Alters it and data timestamp information with the compensated timestamp.
+ * Assumes both state and data have been properly initialized.
  */
 void
-compensate_local(struct State *state, struct Data *data);
+compensate_local(struct Handle state, struct Data *data);
 
 /*
  * Compensates a non-local recv event. Alters state and data timestamp
@@ -44,15 +46,15 @@ compensate_local(struct State *state, struct Data *data);
  * been properly initialized. Use an lower bound? If not, use an upper one.
  */
 void
-compensate_recv(struct State *recv, struct Data *data, bool lower);
+compensate_recv(struct Handle recv, struct Data *data, bool lower);
 
 /* Same as compensate_recv, but for a gather recv */
 void
-compensate_grecv(struct State *recv, size_t i, struct Data *data, bool lower);
+compensate_grecv(struct Handle recv, size_t i, struct Data *data, bool lower);
 
 /* Generic compensation routine for recv, see the wrappers above. */
 void
-compensate_recv_(struct State *recv, struct State *c_send, double send_start,
+compensate_recv_(struct Handle recv, struct Handle c_send, double send_start,
     double send_end, struct Data *data, bool lower);
 
 /*
@@ -61,15 +63,15 @@ compensate_recv_(struct State *recv, struct State *c_send, double send_start,
  * data have been properly initialized.
  */
 void
-compensate_ssend(struct State *recv, struct Data *data);
+compensate_ssend(struct Handle recv, struct Data *data);
 
 /* Same as compensate_ssend, but for a gather ssend */
 void
-compensate_gssend(struct State *grecv, size_t i, struct Data *data);
+compensate_gssend(struct Handle grecv, size_t i, struct Data *data);
 
 /* Generic compensation function for recv, see the wrappers above. */
 void
-compensate_ssend_(struct State *recv, struct State *c_send, double send_start,
+compensate_ssend_(struct Handle recv, struct Handle c_send, double send_start,
     double send_end, struct Data *data);
 
 /*
@@ -78,4 +80,4 @@ compensate_ssend_(struct State *recv, struct State *c_send, double send_start,
  * been properly initialized.
  */
 void
-compensate_wait(struct State *wait, struct Data *data);
+compensate_wait(struct Handle wait, struct Data *data);
@@ -0,0 +1,140 @@
+/* Exact fixed-format decimal to double conversion, for timestamp columns */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <float.h>
+
+/*
+ * pj_dump writes timestamps as %.15f, i.e. [-]digits.digits with no exponent.
+ * For those we accumulate the digits into a single integer w (8 digits at a
+ * time, SWAR style) and divide by the exact power of ten given by the number
+ * of fractional digits. This is only correctly rounded (thus bit-identical to
+ * strtod) in some situations, which decimal_to_double checks for, returning
+ * false otherwise so the caller can fall back to strtod:
+ *
+ * - w <= 2^53: both operands are exact doubles, the single IEEE division is
+ *   correctly rounded (Clinger's fast path).
+ * - w < 2^64 and long double is x87 extended: the division is correctly
+ *   rounded to 64 bits, and rounding that to 53 bits is the same as rounding
+ *   the exact value unless the 11 discarded bits lie at the halfway point.
+ */
+
+/* w < 10^19 < 2^64 */
+#define DECIMAL_MAX_DIGITS 19
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define DECIMAL_SWAR 1
+#endif
+
+#if LDBL_MANT_DIG == 64 && (defined(__x86_64__) || defined(__i386__))
+#define DECIMAL_X87 1
+#endif
+
+static double const decimal_pow10[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13,
+  1e14, 1e15, 1e16, 1e17, 1e18, 1e19
+};
+
+#ifdef DECIMAL_SWAR
+/* True if all 8 bytes of chunk are ASCII digits */
+static inline bool
+decimal_is_eight_digits(uint64_t chunk)
+{
+  return (((chunk & 0xF0F0F0F0F0F0F0F0) |
+        (((chunk + 0x0606060606060606) & 0xF0F0F0F0F0F0F0F0) >> 4)) ==
+      0x3333333333333333);
+}
+
+/* Value of 8 ASCII digits loaded (little-endian) into chunk */
+static inline uint64_t
+decimal_eight_digits(uint64_t chunk)
+{
+  uint64_t const mask = 0x000000FF000000FF,
+                 mul1 = 0x000F424000000064, /* 100 + (1000000 << 32) */
+                 mul2 = 0x0000271000000001; /* 1 + (10000 << 32) */
+  chunk -= 0x3030303030303030;
+  chunk = (chunk * 10) + (chunk >> 8);
+  return (((chunk & mask) * mul1) + (((chunk >> 16) & mask) * mul2)) >> 32;
+}
+#endif
+
+/*
+ * Accumulate the run of digits at *it (up to end) into w. Returns false if the
+ * number has more than DECIMAL_MAX_DIGITS digits.
+ */
+static inline bool
+decimal_run(char const **it, char const *end, uint64_t *w, unsigned *digits)
+{
+  char const *p = *it;
+#ifdef DECIMAL_SWAR
+  while (end - p >= 8 && *digits + 8 <= DECIMAL_MAX_DIGITS) {
+    uint64_t chunk;
+    memcpy(&chunk, p, sizeof(chunk));
+    if (!decimal_is_eight_digits(chunk))
+      break;
+    *w = *w * 100000000 + decimal_eight_digits(chunk);
+    *digits += 8;
+    p += 8;
+  }
+#endif
+  while (p < end && (unsigned)(*p - '0') <= 9) {
+    if (*digits == DECIMAL_MAX_DIGITS)
+      return false;
+    *w = *w * 10 + (uint64_t)(*p - '0');
+    (*digits)++;
+    p++;
+  }
+  *it = p;
+  return true;
+}
+
+/*
+ * Convert the len bytes at str, which must be entirely [-]digits[.digits], to
+ * the same double strtod would give. Returns false (leaving ans untouched) if
+ * the input is in some other format or can't be converted exactly.
+ */
+static inline bool
+decimal_to_double(char const *str, size_t len, double *ans)
+{
+  char const *it = str,
+             *end = str + len;
+  bool neg = (it < end && *it == '-');
+  if (neg)
+    it++;
+  uint64_t w = 0;
+  unsigned digits = 0;
+  if (!decimal_run(&it, end, &w, &digits))
+    return false;
+  unsigned frac = 0;
+  if (it < end && *it == '.') {
+    it++;
+    unsigned int_digits = digits;
+    if (!decimal_run(&it, end, &w, &digits))
+      return false;
+    frac = digits - int_digits;
+  }
+  if (it != end || !digits)
+    return false;
+  double val;
+  if (w <= ((uint64_t)1 << 53)) {
+    val = (double)w / decimal_pow10[frac];
+  } else {
+#ifdef DECIMAL_X87
+    long double q = (long double)w / (long double)decimal_pow10[frac];
+    uint64_t mantissa;
+    memcpy(&mantissa, &q, sizeof(mantissa));
+    /* 11 bits below the double's mantissa, too close to the halfway point */
+    uint64_t rest = mantissa & 0x7FF;
+    if (rest >= 0x3FF && rest <= 0x401)
+      return false;
+    val = (double)q;
+#else
+    return false;
+#endif
+  }
+  *ans = neg ? -val : val;
+  return true;
+}
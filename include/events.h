@@ -1,67 +1,103 @@
-/* Ref counted event structs (States and Links) and associated routines */
+/* Arena allocated event structs (States and Links) and associated routines */
 #pragma once
 
-#include "ref.h"
+#include "output.h"
+#include "arena.h"
+#include "intern.h"
+#include <assert.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stddef.h>
 
 /*
- * Note on copying of dynamically allocated values:
+ * Note on memory:
  *
- * Reference counted structs are not copied (no new structure is created), the
- * struct's ref count is simply increased.
- *
- * Strings are copied with strdup. There are no pointer to other non ref
- * counted dynamically allocated values.
+ * Events and their Comms are allocated from an arena (see arena.h) given to
+ * their constructor, and are never freed one by one: they all go at once when
+ * the arena is released, once compensation is done with the trace. Structs
+ * point to each other freely, with no ownership. Their strings are interned
+ * (see intern.h), never copied.
  */
 
+/* Link types, classified once when the link is read */
+enum Link_type {
+  LINK_OTHER,
+  LINK_PTP,
+  LINK_1TN,
+  LINK_NT1
+};
+
 /* A link, as read from a pj_dump trace */
 struct Link {
-  struct ref ref;
   uint64_t mark;
   double start,
          end;
   size_t bytes;
   int from,
       to;
-  char *type,
-       *container;
+  enum Link_type type;
+  /* Interned, see intern.h */
+  char const *container;
 };
 
 /*
- * Create a link from a line of a pj_dump trace. Returns NULL if the line is
- * not describing a link. Reports other failures, possibly aborting.
+ * Create a link in arena from its fields, container being interned (see
+ * intern.h). Aborts on failure.
  */
 struct Link *
-link_from_line(char *line);
+link_new(struct Arena *arena, int from, int to, double start, double end,
+    enum Link_type type, char const *container, uint64_t mark, size_t bytes);
 
 /* Returns true if the link is PTP, false otherwise. Aborts on failure */
-bool
-link_is_ptp(struct Link const *link);
+static inline bool
+link_is_ptp(struct Link const *link)
+{
+  assert(link);
+  return link->type == LINK_PTP;
+}
 
 /* Returns true if the link is 1TN, false otherwise. Aborts on failure */
-bool
-link_is_1tn(struct Link const *link);
+static inline bool
+link_is_1tn(struct Link const *link)
+{
+  assert(link);
+  return link->type == LINK_1TN;
+}
 
 /* Returns true if the link is NT1, false otherwise. Aborts on failure */
-bool
-link_is_nt1(struct Link const *link);
+static inline bool
+link_is_nt1(struct Link const *link)
+{
+  assert(link);
+  return link->type == LINK_NT1;
+}
 
 struct State;
+struct Store;
+
+/*
+ * A State in the store of the trace (see store.h), by its rank and its index
+ * in the rank
+ */
+struct Handle {
+  int rank;
+  uint32_t index;
+};
+
+/* No State, an index that is never given out */
+#define STORE_NONE UINT32_MAX
 
 /* Represents a communication to avoid Link queues for such task */
 struct Comm {
-  struct ref ref;
   /*
-   * Points to the matching communications event (not a copy, ts info will
-   * change once it gets compensates)
+   * The matching communications event (not a copy, ts info will change once
+   * it gets compensates), its index being STORE_NONE if there is none
    */
-  struct State *match;
+  struct Handle match;
   double ostart,
          oend;
   // TODO this can probably be removed from here
-  char *container;
+  char const *container;
   /*
    * This information is obtained from the trace file, beware that different
    * traces might have different semantics for collective communictions. This
@@ -70,47 +106,99 @@ struct Comm {
   size_t bytes;
 };
 
-/* Creates a new comm struct, aborts on failure. */
+/*
+ * Creates a new comm struct in arena, matching the State of store match
+ * points to (none if NULL), container being interned (see intern.h). Aborts
+ * on failure.
+ */
 struct Comm *
-comm_new(struct State *match, char const *container, size_t bytes);
+comm_new(struct Arena *arena, struct Store const *store, struct Handle const
+    *match, char const *container, size_t bytes);
 
 /*
  * Returns true if event in comm has been compensated, false otherwise. Aborts
  * on failure.
  */
 bool
-comm_compensated(struct Comm const *comm);
+comm_compensated(struct Store const *store, struct Comm const *comm);
 
 /* The following are the same as comm_*, but for the gather event */
 struct Gcomm {
-  struct ref ref;
-  struct State **match;
+  struct Handle *match;
   double *ostart,
          *oend;
-  char *container;
+  char const *container;
   size_t bytes,
          ranks;
 };
 
+/* match has ranks elements and has to live as long (e.g. be from arena) */
 struct Gcomm *
-gcomm_new(struct State **match, char const *container, size_t bytes,
-    size_t ranks);
+gcomm_new(struct Arena *arena, struct Store const *store, struct Handle
+    *match, char const *container, size_t bytes, size_t ranks);
 
 bool
-gcomm_compensated(struct Gcomm const *comm, size_t i);
+gcomm_compensated(struct Store const *store, struct Gcomm const *comm, size_t
+    i);
 
 /* Generic "compensated?" function, same effect as the above */
 bool
-compensated(struct State const *state, double ostart, double oend);
+compensated(struct Store const *store, struct Handle state, double ostart,
+    double oend);
+
+/*
+ * Routines we know about, classified once when the state is read. Anything
+ * else is ROUTINE_OTHER, which points to its interned name for output.
+ */
+enum Routine {
+  ROUTINE_OTHER,
+  ROUTINE_RECV,
+  ROUTINE_WAIT,
+  /* All routines that generate a PTP link by akypuera */
+  ROUTINE_SEND,
+  ROUTINE_SSEND,
+  ROUTINE_ISEND,
+  ROUTINE_BSEND,
+  ROUTINE_IBSEND,
+  ROUTINE_IRSEND,
+  ROUTINE_ISSEND,
+  ROUTINE_SCATTER,
+  ROUTINE_GATHER,
+  ROUTINE_COUNT
+};
+
+/* Properties of each routine, see routine_flags */
+#define ROUTINE_IS_RECV    0x01
+#define ROUTINE_IS_WAIT    0x02
+#define ROUTINE_IS_SEND    0x04
+/* Immediate or buffered send (assumes there are enough resources for B) */
+#define ROUTINE_IS_ASYNC   0x08
+#define ROUTINE_IS_1TN     0x10
+#define ROUTINE_IS_NT1     0x20
 
-/* A state, as read from a pj_dump trace  */
+/* ROUTINE_IS_* flags, indexed by enum Routine */
+extern unsigned char const routine_flags[ROUTINE_COUNT];
+
+/* Routine code of a routine name, ROUTINE_OTHER if unknown */
+enum Routine
+routine_from_name(char const *name);
+
+/* Link type of a link type name (case insensitive), LINK_OTHER if unknown */
+enum Link_type
+link_type_from_name(char const *name);
+
+/*
+ * A state, as read from a pj_dump trace and as printed. The store keeps the
+ * fields of the States of a trace in columns instead (see store.h).
+ */
 struct State {
-  struct ref ref;
   double start,
          end;
   int imbrication,
       rank;
-  char *routine;
+  enum Routine code;
+  /* Points to a static table, interned (see intern.h) for ROUTINE_OTHER */
+  char const *routine;
   /* Used by comm routines only */
   union comm {
     struct Comm *c;
@@ -120,18 +208,49 @@ struct State {
   uint64_t mark;
 };
 
+/* The pj_dump records we care about */
+enum Record {
+  RECORD_OTHER,
+  RECORD_STATE,
+  RECORD_LINK
+};
+
 /*
- * Create a state from a line from a pj_dump trace. Returns NULL if the line is
- * not describing a state. Reports other failures, possibly aborting.
+ * Parse a line of a pj_dump trace (len bytes, not necessarily null terminated,
+ * possibly ending in a newline). The line is classified from its first field
+ * and split in a single pass, without being modified. Returns the record type,
+ * storing the new State in *state or the new Link in *link accordingly (the
+ * other is left untouched, as is everything for RECORD_OTHER), allocated from
+ * arena. Reports other failures, possibly aborting.
  */
-struct State *
-state_from_line(char *line);
+enum Record
+event_from_line(struct Arena *arena, char const *line, size_t len,
+    struct State **state, struct Link **link);
 
-/* Copy a state struct, aborts on failure. */
+/*
+ * Classify a line like event_from_line, but only reading what sizing the per
+ * rank arrays and ordering the Links take: the rank of a State (and whether it
+ * is a send, in *send, with its mark in *mark) or the receiver of a Link, in
+ * *rank (with its end in *end). Allocates nothing and never fails, a line
+ * whose rank can't be read being RECORD_OTHER (for the actual parse to
+ * report). A mark that can't be told fast is UINT64_MAX, an end that can't be
+ * read -DBL_MAX.
+ */
+enum Record
+event_scan_line(char const *line, size_t len, int *rank, bool *send,
+    uint64_t *mark, double *end);
+
+/*
+ * Create a state from its fields, where code is the routine_from_name of
+ * routine (which has to be interned for ROUTINE_OTHER, see intern.h) and mark
+ * is NULL if the trace has none for this state, in arena. Aborts on failure.
+ */
 struct State *
-state_cpy(struct State const *state);
+state_new(struct Arena *arena, int rank, double start, double end,
+    int imbrication, enum Routine code, char const *routine,
+    uint64_t const *mark);
 
-/* Prints a state to stdout pj_dump style. Aborts on failure. */
+/* Prints a state to stdout (see output.h) pj_dump style. Aborts on failure. */
 void
 state_print(struct State const *state);
 
@@ -142,17 +261,58 @@ state_print(struct State const *state);
 void
 state_print_c_recv(struct State const *recv, struct State const *match);
 
+/*
+ * The link state_print_c_recv prints, its container pointing to the one of
+ * the match's Comm (not copied)
+ */
+void
+state_c_recv_link(struct State const *recv, struct State const *match,
+    struct Link *link);
+
+/* Print a link from state_c_recv_link, as state_print_c_recv does */
+void
+link_print(struct Link const *link);
+
+/* Longest State/Link line, besides its strings (routine, container) */
+#define EVENT_LINE_MAX_FIXED (64 + 5 * OUTPUT_NUMBER_MAX)
+
+/*
+ * Format the line state_print would print at dst, which must have room for
+ * EVENT_LINE_MAX_FIXED bytes plus the routine. Returns the end of the line.
+ */
+char *
+state_format(char *dst, struct State const *state);
+
+/*
+ * Same as state_format, for the line state_print_c_recv prints of a link from
+ * state_c_recv_link (always PTP, whatever its type)
+ */
+char *
+link_format(char *dst, struct Link const *link);
+
 /* Returns true if state is MPI_Wait, false otherwise. Aborts on failure. */
-bool
-state_is_wait(struct State const *state);
+static inline bool
+state_is_wait(struct State const *state)
+{
+  assert(state);
+  return routine_flags[state->code] & ROUTINE_IS_WAIT;
+}
 
 /* Returns true if state is a P2P recv, false otherwise. Aborts on failure. */
-bool
-state_is_recv(struct State const *state);
+static inline bool
+state_is_recv(struct State const *state)
+{
+  assert(state);
+  return routine_flags[state->code] & ROUTINE_IS_RECV;
+}
 
 /* Returns true if state is a P2P send, false otherwise. Aborts on failure. */
-bool
-state_is_send(struct State const *state);
+static inline bool
+state_is_send(struct State const *state)
+{
+  assert(state);
+  return routine_flags[state->code] & ROUTINE_IS_SEND;
+}
 
 /* Returns true if comm synchronous, false otherwise. Aborts on failure. */
 #define comm_is_sync(comm, sync_size)\
@@ -166,15 +326,23 @@ state_is_local(struct State const *state, size_t sync_size);
  * Retunrs true if the state is a collective 1-to-n communication, false
  * otherwise. Aborts on failure.
  */
-bool
-state_is_1tn(struct State const *state);
+static inline bool
+state_is_1tn(struct State const *state)
+{
+  assert(state);
+  return routine_flags[state->code] & ROUTINE_IS_1TN;
+}
 
 /*
  * Retunrs true if the state is a collective n-to-1 communication, false
  * otherwise. Aborts on failure.
  */
-bool
-state_is_nt1(struct State const *state);
+static inline bool
+state_is_nt1(struct State const *state)
+{
+  assert(state);
+  return routine_flags[state->code] & ROUTINE_IS_NT1;
+}
 
 /*
  * Returns true if the state is a 1-to-n send, false otherwise. Aborts on
@@ -0,0 +1,100 @@
+/* Line oriented trace input, zero-copy via mmap when possible */
+#pragma once
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Regular files are mapped read-only and lines are handed out as pointers into
+ * the mapping, so reading a line costs neither an allocation nor a copy. Pages
+ * that were already consumed are periodically released back to the kernel so
+ * that the resident set does not grow with the trace size.
+ *
+ * Anything that can't be mapped (pipes, empty files, mmap failure) falls back
+ * to getline on a single buffer that is reused for every line.
+ *
+ * gzip and zstd compressed traces (told apart by their magic number) are
+ * decompressed as a stream by a gzip/zstd -dc child process, concurrently with
+ * the parsing, and read from its output. When the compressed trace is itself a
+ * stream (stdin, a FIFO) a feeder thread copies it into the child.
+ */
+struct Input {
+  /* mmap mode (map != NULL) */
+  char const *map;
+  size_t size,
+         /* Offset of the next line */
+         pos,
+         /* Everything before this offset was already given back */
+         released;
+  /* Stream mode (map == NULL) */
+  FILE *f;
+  char *buff;
+  size_t cap;
+  /* Length of the last line, see input_unget */
+  size_t last;
+  bool unget;
+  /* Decompression (child == 0 if the input isn't compressed) */
+  pid_t child;
+  char const *prog;
+  /* Feeder thread, copying src into sink, if feeding */
+  pthread_t feeder;
+  bool feeding;
+  FILE *src;
+  int sink;
+};
+
+/*
+ * Open filename ("-" for stdin) for reading. Returns 0 on success, -1 on failure, in which
+ * case it also sets errno.
+ */
+int
+input_open(struct Input *in, char const *filename);
+
+/*
+ * Returns the next line, including its trailing newline (if any), and stores
+ * its length in len. The line is NOT null terminated and is only valid until
+ * the next call. Returns NULL on EOF. Aborts on failure (including the
+ * decompressor failing).
+ */
+char const *
+input_next(struct Input *in, size_t *len);
+
+/*
+ * Have the next input_next return the last line again. Can't be called twice
+ * in a row.
+ */
+void
+input_unget(struct Input *in);
+
+/*
+ * Mapped inputs only, for callers that read in->map directly: mark everything
+ * before the offset pos as consumed, giving its pages back to the kernel.
+ */
+void
+input_consume(struct Input *in, size_t pos);
+
+/*
+ * Mapped inputs only, for callers that read in->map twice: give the pages that
+ * lie entirely within [begin, end) back to the kernel without consuming them.
+ * Reading them again faults them back in (from the page cache, usually).
+ * Thread safe.
+ */
+void
+input_drop(struct Input const *in, size_t begin, size_t end);
+
+/* Release everything associated with in */
+void
+input_close(struct Input *in);
+
+/*
+ * Returns true if line, the first line of a trace, starts a Pajé trace (its
+ * header or a comment) rather than a pj_dump one
+ */
+static inline bool
+input_is_paje(char const *line, size_t len)
+{
+  return len && (line[0] == '%' || line[0] == '#');
+}
@@ -0,0 +1,30 @@
+/* Interned routine names and containers, shared by the whole program */
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * There are only so many distinct routine names and containers in a trace,
+ * however many events there are, so each is stored once, when first seen, and
+ * events point to that copy. Interned strings are the same pointer if and only
+ * if they are equal, and live until intern_release, so whatever keeps events
+ * around (for the output, say) needs no copy of their strings.
+ *
+ * A singleton, safe to use from several threads: each thread remembers the
+ * strings it looked up lately, and only takes the lock for the others.
+ */
+
+/* Returns the interned copy of the len bytes of str. Aborts on failure. */
+char const *
+intern_str(char const *str, size_t len);
+
+/* Returns the interned copy of str, NULL for NULL. Aborts on failure. */
+char const *
+intern_cstr(char const *str);
+
+/*
+ * Free every interned string, invalidating them all. No other thread may be
+ * interning meanwhile.
+ */
+void
+intern_release(void);
@@ -0,0 +1,96 @@
+/* Buffered stdout for the output trace, with specialized number formatting */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Everything written to stdout goes through a single large buffer, drained
+ * with write(2) when full, instead of stdio. Lines are formatted straight into
+ * the buffer: output_reserve hands out room for a line, the output_fmt_*
+ * routines write fields into it and output_commit marks where the line ended.
+ *
+ * With output_async, full buffers are handed to a writer thread instead,
+ * through a ring of OUTPUT_BUFFERS buffers, so whoever produces the output
+ * only waits on the device when all of them are in flight.
+ *
+ * output_fmt_fixed15 prints exactly what printf's %.15f would (the output is
+ * byte-identical), but with integer arithmetic instead of printf's big number
+ * conversion.
+ */
+
+/* Enough for any output_fmt_* number */
+#define OUTPUT_NUMBER_MAX 330
+
+/*
+ * Returns room for at least len bytes of output, valid until output_commit.
+ * Aborts on failure.
+ */
+char *
+output_reserve(size_t len);
+
+/*
+ * Mark everything in the reserved room before end as written. Room that is
+ * never committed is simply reused by the next output_reserve.
+ */
+void
+output_commit(char const *end);
+
+/*
+ * Write len bytes of data. Large writes bypass the buffer (after flushing it).
+ * Aborts on failure.
+ */
+void
+output_write(void const *data, size_t len);
+
+/*
+ * Write out everything buffered so far (in async mode, hand it to the writer
+ * thread). Aborts on failure.
+ */
+void
+output_flush(void);
+
+/*
+ * Start a writer thread that takes over writing to stdout. Only the thread
+ * that calls this may write output from then on. Aborts on failure.
+ */
+void
+output_async(void);
+
+/*
+ * Write out everything, waiting for the writer thread (if any) to finish, after
+ * which output is synchronous again. Registered with atexit. Aborts on
+ * failure.
+ */
+void
+output_close(void);
+
+/* The output_fmt_* routines write at dst and return the end of what they wrote */
+
+/* printf("%.15f", x) */
+char *
+output_fmt_fixed15(char *dst, double x);
+
+/* printf("%d", x) */
+char *
+output_fmt_int(char *dst, int x);
+
+/* printf("%"PRIu64, x) */
+char *
+output_fmt_u64(char *dst, uint64_t x);
+
+/* printf("%s", str), NULL being printed as "(null)" as glibc does */
+static inline char *
+output_fmt_str(char *dst, char const *str)
+{
+  if (!str)
+    str = "(null)";
+  size_t len = strlen(str);
+  memcpy(dst, str, len);
+  return dst + len;
+}
+
+/* For string literals only */
+#define OUTPUT_FMT_LIT(dst, lit)\
+  (memcpy((dst), (lit), sizeof(lit) - 1), (dst) + sizeof(lit) - 1)
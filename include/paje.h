@@ -0,0 +1,78 @@
+/* Direct reader and writer of Pajé trace files, skipping pj_dump conversions */
+#pragma once
+
+#include "events.h"
+#include "input.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * The %EventDef header is parsed once into a table, indexed by event id, with
+ * the position of every field we care about, so each event line is split and
+ * decoded in a single pass with no lookups by name. States are rebuilt from
+ * Push/Pop/Set/ResetState events (per container stacks) and Links from
+ * matching Start/EndLink keys, giving the same State/Link structs (and
+ * values) as parsing the pj_dump -u -n -l 15 output would.
+ *
+ * The Mark field of the extended Akypuera events (PushState with a Mark,
+ * StartLink with Size and Mark) becomes the State/Link mark and the Size the
+ * Link byte count, as the pj_dump user fields would.
+ */
+
+/*
+ * Read a whole Pajé trace from in. Stores the States in *states and the Links
+ * in *links (caller frees the arrays, the events are allocated from arena),
+ * both sorted by start time as pj_dump would list them. Containers are written
+ * to stdout (see output.h) as pj_dump Container lines once destroyed. When
+ * writing a Pajé trace, the header is copied to stdout as it is read and the
+ * containers go to paje_out_passthrough. Aborts on failure.
+ */
+void
+paje_read(struct Input *in, struct Arena *arena, struct State ***states,
+    size_t *nstates, struct Link ***links, size_t *nlinks);
+
+/*
+ * Once started, the compensated events go to paje_out_state/link and the
+ * output is a Pajé trace, which viewers open as is. Its header is that of the
+ * input if it is a Pajé trace (copied along with the definitions, events with
+ * no time), Akypuera's otherwise, with the container types of the pj_dump
+ * Container lines. Containers are created as the Container lines say (and
+ * made up for ranks that have none), States become PushState and PopState
+ * events in their container (with the mark for comm routines) and Links
+ * StartLink and EndLink events in the container of the link (the root if
+ * none), keyed FROM_TO_N.
+ *
+ * The events have to come in start time order (see reorder.h): ends are held
+ * back until the trace gets to their time, and containers are only destroyed
+ * by paje_out_finish, as compensated events may end after their container
+ * did. Times never go back, an event out of order being written as late as
+ * the last one written. Input lines that are neither containers nor
+ * definitions are left out, with a warning. A singleton, as stdout is.
+ */
+
+/* Start writing a Pajé trace to stdout. Aborts on failure. */
+void
+paje_out_start(void);
+
+/* Whether paje_out_start was called (and paje_out_finish was not) */
+bool
+paje_out_active(void);
+
+/*
+ * A line of the input that is neither a State nor a Link, of which only
+ * Container lines are kept. Must come before any event. Aborts on failure.
+ */
+void
+paje_out_passthrough(char const *line, size_t len);
+
+/* Write a compensated state, see state_print. Aborts on failure. */
+void
+paje_out_state(struct State const *state);
+
+/* Write a compensated link, see link_print. Aborts on failure. */
+void
+paje_out_link(struct Link const *link);
+
+/* Write whatever is pending, then stop. Aborts on failure. */
+void
+paje_out_finish(void);
@@ -4,68 +4,139 @@
 #include "events.h"
 #include <stddef.h>
 #include <stdbool.h>
+#include <stdint.h>
 
-/* Implemented as a linked list via utlist.h */
+/*
+ * FIFO queues of events, each a ring buffer over a single array whose capacity
+ * (a power of two) doubles when full, so pushing and popping allocate nothing
+ * but the occasional growth. A zeroed queue is empty. The queues don't own the
+ * events, their arena or store does (see events.h and store.h), so emptying a
+ * queue only frees the array.
+ *
+ * States are queued by the index of their handle (see store.h), the rank
+ * being the one of the queue.
+ */
 struct State_q {
-  struct State *state;
-  struct State_q *prev, *next;
+  uint32_t *ring;
+  /* Elements [head, head + len) of the ring, wrapping around cap */
+  size_t head,
+         len,
+         cap;
 };
 
-/* Push a reference to state to the queue, increasing state's ref ct */
+/* Push the index of a state to the back of the queue. Aborts on failure. */
 void
-state_q_push_ref(struct State_q **head, struct State *state);
+state_q_push(struct State_q *q, uint32_t index);
 
 /* (these inline functions are just for readability) */
 
-/* Return the first state in queue, don't increase ref ct */
-static inline struct State *
-state_q_front(struct State_q const *head)
+/* Return the index of the first state in queue, STORE_NONE if empty */
+static inline uint32_t
+state_q_front(struct State_q const *q)
 {
-  if (head)
-    return head->state;
-  return NULL;
+  if (q->len)
+    return q->ring[q->head];
+  return STORE_NONE;
 }
 
 static inline bool
-state_q_is_empty(struct State_q const *head)
+state_q_is_empty(struct State_q const *q)
 {
-  return (head == NULL);
+  return !q->len;
 }
 
-/* Push a shallow copy of state to the queue */
+/* Pop the first state from the non-empty queue */
+static inline void
+state_q_pop(struct State_q *q)
+{
+  q->head = (q->head + 1) & (q->cap - 1);
+  q->len--;
+}
+
+/* Empty the queue (pop all states) and free its array */
 void
-state_q_push_cpy(struct State_q **head, struct State *state);
+state_q_empty(struct State_q *q);
+
+/*
+ * These are the same as the state functions, but for links
+ */
+
+struct Link_q {
+  struct Link **ring;
+  size_t head,
+         len,
+         cap;
+};
 
-/* Pop the first state from the queue, decreasing its ref ct */
 void
-state_q_pop(struct State_q **head);
+link_q_push_ref(struct Link_q *q, struct Link *link);
+
+static inline struct Link *
+link_q_front(struct Link_q const *q)
+{
+  if (q->len)
+    return q->ring[q->head];
+  return NULL;
+}
+
+static inline bool
+link_q_is_empty(struct Link_q const *q)
+{
+  return !q->len;
+}
+
+static inline void
+link_q_pop(struct Link_q *q)
+{
+  q->head = (q->head + 1) & (q->cap - 1);
+  q->len--;
+}
 
-/* Empty the queue (pop all states) */
 void
-state_q_empty(struct State_q **q);
+link_q_empty(struct Link_q *q);
 
-/* Delete an arbitrary element from the queue, decreasing its ref ct */
+/*
+ * Stable sort of each of the n queues qs by end time (a radix sort of its
+ * bits, see queue.c), with up to jobs threads. Aborts on failure.
+ */
 void
-state_q_delete(struct State_q **q, struct State_q *ele);
+link_qs_sort_e(struct Link_q *qs, size_t n, unsigned jobs);
 
 /*
- * These are the same as the state functions, but for links
+ * Min-heap of links by end time, ties in push order (the order link_qs_sort_e
+ * gives), holding copies of the links rather than references, so that a link
+ * takes no room once popped. A zeroed heap is empty.
  */
+struct Link_h_node {
+  struct Link link;
+  /* Pushes before this one */
+  uint64_t seq;
+};
 
-struct Link_q {
-  struct Link *link;
-  struct Link_q *prev, *next;
+struct Link_h {
+  struct Link_h_node *nodes;
+  size_t len,
+         cap;
+  uint64_t seq;
 };
 
+/* Push a copy of link. Aborts on failure. */
 void
-link_q_push_ref(struct Link_q **head, struct Link *link);
+link_h_push(struct Link_h *h, struct Link const *link);
 
-void
-link_q_pop(struct Link_q **head);
+/* Return the first link by end time, NULL if empty */
+static inline struct Link const *
+link_h_top(struct Link_h const *h)
+{
+  if (h->len)
+    return &(h->nodes[0].link);
+  return NULL;
+}
 
+/* Pop the first link from the non-empty heap */
 void
-link_q_empty(struct Link_q **q);
+link_h_pop(struct Link_h *h);
 
-/* (by end time) */
-int
-link_q_sort_e(struct Link_q const *a, struct Link_q const *b);
+/* Empty the heap and free its array */
+void
+link_h_empty(struct Link_h *h);
@@ -0,0 +1,55 @@
+/* Text output of the compensated events sorted by compensated start time */
+#pragma once
+
+#include "events.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Events are compensated in whatever order the lock queues allow, so the
+ * output is only roughly sorted: blocked events come out late. Once started,
+ * compensated events go to reorder_state/link instead of state_print and
+ * link_print, and are written in start time order (ties in the order they
+ * were compensated) by reorder_finish.
+ *
+ * Each rank (the one of a State, the sender of a Link, whose start it is)
+ * has a bounded reorder buffer, a min-heap of its pending events. When it is
+ * full, its earliest event is taken out and appended to a sorted run of that
+ * rank, in chunks of REORDER_CHUNK events. Chunks are kept in memory up to a
+ * fixed budget and spilled to a temporary file past it. An event earlier than
+ * what was already taken out of its buffer can only go to the next run of the
+ * rank, so the more out of order the events of a rank, the more runs it takes.
+ * When done, what is left in the buffers is sorted in memory and every run is
+ * merged with a min-heap.
+ *
+ * Events keep pointing to their routine names and containers, which are
+ * interned (see intern.h) and so outlive them. The buffer size, the runs and
+ * how much was spilled are reported (as a warning if anything was spilled). A
+ * singleton, as stdout is.
+ */
+
+#define REORDER_BUFFER 4096
+#define REORDER_CHUNK 4096
+
+/* Start buffering with size events per rank. Aborts on failure. */
+void
+reorder_start(size_t size);
+
+/* Whether reorder_start was called (and reorder_finish was not) */
+bool
+reorder_active(void);
+
+/* Append a compensated state, see state_print. Aborts on failure. */
+void
+reorder_state(struct State const *state);
+
+/* Append a compensated link, see link_print. Aborts on failure. */
+void
+reorder_link(struct Link const *link);
+
+/*
+ * Write everything appended so far, sorted, through paje_out, split or textout
+ * if active (see paje.h, split.h, textout.h), then stop. Aborts on failure.
+ */
+void
+reorder_finish(void);
@@ -0,0 +1,80 @@
+/* Per rank index of the Sends of a trace by mark, for linking them to Recvs */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Links (and Waits) name their Send by rank and mark, so every Send is indexed
+ * by its mark, mapping it to its handle in the store (see store.h). Tracers
+ * number the Sends of each rank 0, 1, 2..., so an index starts dense: the
+ * handle of the Send with mark base + i at i, looked up without hashing. The
+ * first Send whose mark breaks the sequence (global or sparse marks) turns the
+ * index into an open addressing hash table of mark/handle slots, kept at most
+ * half full, so memory stays proportional to the number of Sends either way.
+ *
+ * A mark may be indexed more than once: lookups find the first Send with it
+ * that wasn't consumed yet (its handle set to STORE_NONE), in push order. As
+ * long as none is (Sends::dups is 0), sends_take can consume the Sends of an
+ * index from several threads at once.
+ */
+
+struct Sends_slot {
+  uint64_t mark;
+  uint32_t handle,
+           used;
+};
+
+/* Zero is an empty index */
+struct Sends {
+  /* Sends indexed so far */
+  size_t len;
+  /* Dense (slots == NULL): the handle of mark base + i at dense[i] */
+  uint32_t *dense;
+  uint64_t base;
+  /* The room in dense, or the number of slots (a power of two) */
+  size_t cap;
+  struct Sends_slot *slots;
+  /* Sends pushed with a mark that was already indexed */
+  size_t dups;
+};
+
+/* Make room for n Sends in all, when known beforehand. Aborts on failure. */
+void
+sends_reserve(struct Sends *s, size_t n);
+
+/* Index the Send with mark by its handle. Aborts on failure. */
+void
+sends_push(struct Sends *s, uint64_t mark, uint32_t handle);
+
+/*
+ * The handle of the first Send with mark that wasn't consumed, to be set to
+ * STORE_NONE once it is, NULL if there is none
+ */
+uint32_t *
+sends_find(struct Sends *s, uint64_t mark);
+
+/*
+ * Consume the first Send with mark that wasn't consumed, returning its handle,
+ * STORE_NONE if there is none. Thread safe when dups is 0, the first caller
+ * taking the Send and any other getting STORE_NONE.
+ */
+uint32_t
+sends_take(struct Sends *s, uint64_t mark);
+
+/*
+ * Call linked on the handle of every Send that wasn't consumed, in no
+ * particular order, consuming those it returns true for
+ */
+void
+sends_sweep(struct Sends *s, bool (*linked)(void *arg, uint32_t handle), void
+    *arg);
+
+/* The number of Sends indexed that weren't consumed */
+size_t
+sends_pending(struct Sends const *s);
+
+/* Free the index, leaving it empty */
+void
+sends_empty(struct Sends *s);
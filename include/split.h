@@ -0,0 +1,51 @@
+/* Text output of the compensated events split into one file per rank */
+#pragma once
+
+#include "events.h"
+#include <stdbool.h>
+
+/*
+ * Once started, compensated events go to split_state/link instead of
+ * state_print and link_print, and are written to a file per rank, PREFIX.N
+ * for rank N (Links belonging to the rank of the recv). The lines are the
+ * same, in the same order as they would be on stdout. Everything else (the
+ * lines that are neither States nor Links) still goes to stdout.
+ *
+ * Every rank has a buffer of SPLIT_BUFFER bytes, formatted into as events come
+ * in. Full buffers are handed to a pool of writer threads through a queue of
+ * at most SPLIT_QUEUE buffers (the producer waits for room past that), each
+ * buffer being written with pwrite at its own offset in the file, so writes to
+ * the same file need no ordering between writers.
+ *
+ * A singleton, used by a single thread. Raises the limit on open files to what
+ * is allowed, as a file stays open per rank.
+ */
+
+#define SPLIT_BUFFER ((size_t)64 << 10)
+#define SPLIT_QUEUE 64
+
+/*
+ * Start writing to PREFIX.N files, truncated as they are opened, with writers
+ * threads. Aborts on failure.
+ */
+void
+split_start(char const *prefix, unsigned writers);
+
+/* Whether split_start was called (and split_finish was not) */
+bool
+split_active(void);
+
+/* Append a compensated state, see state_print. Aborts on failure. */
+void
+split_state(struct State const *state);
+
+/* Append a compensated link, see link_print. Aborts on failure. */
+void
+split_link(struct Link const *link);
+
+/*
+ * Write out every buffer, wait for the writers and close the files. Aborts on
+ * failure.
+ */
+void
+split_finish(void);
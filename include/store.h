@@ -0,0 +1,92 @@
+/* Per rank columns of the States of a trace, addressed by compact handles */
+#pragma once
+
+#include "events.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The States of each rank are kept in file order in parallel columns, one
+ * array per field, so that compensating a rank walks each of them in memory
+ * order, reading only the fields it needs, instead of jumping around the
+ * interleaved events of every rank. A State is addressed by its handle (see
+ * events.h), its rank and its index in the rank, the queues of a rank keeping
+ * only the index, half the size of a pointer. A whole State (struct State) is
+ * only put together to be printed.
+ *
+ * The columns of a rank are sized once when the number of its States is known
+ * beforehand, those of every such rank being carved out of a single slab, and
+ * doubled as they fill otherwise, so they may move on every store_push:
+ * States are never kept by address, only by handle.
+ *
+ * The order the States were read in, across ranks, is kept as the rank of
+ * every State, which is all compensate_loop needs to go through them in that
+ * order.
+ */
+
+/* The columns of a rank, the States [0, len) of it */
+struct Store_rank {
+  double *start,
+         *end;
+  uint64_t *mark;
+  union comm *comm;
+  /* See State::routine */
+  char const **routine;
+  int *imbrication;
+  /* (enum Routine) */
+  unsigned char *code;
+  uint32_t len,
+           cap;
+  /* Are the columns allocated on their own? (not from the slab) */
+  bool own;
+};
+
+/* Zero is an empty store */
+struct Store {
+  struct Store_rank *ranks;
+  size_t nranks;
+  /* Where the columns reserved at once are carved out of */
+  char *slab;
+  /* The rank of every State, in the order they were stored */
+  int *order;
+  size_t len,
+         cap;
+};
+
+/* The column field of the State of store with handle h, as an lvalue */
+#define STORE_AT(store, h, field)\
+  ((store)->ranks[(h).rank].field[(h).index])
+
+/*
+ * Make room for ranks ranks at once, when their number is known beforehand,
+ * and for states[i] States of rank i unless states is NULL. Aborts on failure.
+ */
+void
+store_reserve(struct Store *store, size_t ranks, uint64_t const *states);
+
+/*
+ * Copy the fields of state to the end of its rank. Returns the index of the
+ * stored State. Aborts on failure.
+ */
+uint32_t
+store_push(struct Store *store, struct State const *state);
+
+/* Put the State of store with handle h together in *state */
+static inline void
+store_get(struct Store const *store, struct Handle h, struct State *state)
+{
+  struct Store_rank const *r = store->ranks + h.rank;
+  state->start = r->start[h.index];
+  state->end = r->end[h.index];
+  state->imbrication = r->imbrication[h.index];
+  state->rank = h.rank;
+  state->code = (enum Routine)(r->code[h.index]);
+  state->routine = r->routine[h.index];
+  state->comm = r->comm[h.index];
+  state->mark = r->mark[h.index];
+}
+
+/* Free every column, leaving the store empty */
+void
+store_release(struct Store *store);
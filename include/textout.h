@@ -0,0 +1,42 @@
+/* Text output of the compensated events, formatted by a pool of threads */
+#pragma once
+
+#include "events.h"
+#include <stdbool.h>
+
+/*
+ * Once started, compensated events go to textout_state/link instead of
+ * state_print and state_print_c_recv. They are copied (not their strings, which
+ * are static or interned and outlive them) into blocks of TEXTOUT_BLOCK
+ * events. Each full block is handed to a pool of worker threads, started once
+ * by textout_start, and formatted while the next ones are filled. Blocks are
+ * written to stdout (see output.h) strictly in the order they were filled, the
+ * output being byte-identical to the one of state_print and state_print_c_recv.
+ *
+ * A singleton, as stdout is. Only the thread that started it may use it.
+ */
+
+#define TEXTOUT_BLOCK 16384
+
+/* Start jobs formatting threads. Aborts on failure. */
+void
+textout_start(unsigned jobs);
+
+/* Whether textout_start was called (and textout_finish was not) */
+bool
+textout_active(void);
+
+/* Append a compensated state, see state_print. Aborts on failure. */
+void
+textout_state(struct State const *state);
+
+/*
+ * Append the link of a compensated recv (see state_c_recv_link), see
+ * link_print. Aborts on failure.
+ */
+void
+textout_link(struct Link const *link);
+
+/* Format and write everything appended so far, then stop. Aborts on failure. */
+void
+textout_finish(void);
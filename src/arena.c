@@ -0,0 +1,100 @@
+/* See the header file for contracts and more docs */
+/* logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "arena.h"
+#include "logging.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+struct Arena_block {
+  struct Arena_block *next;
+  size_t cap;
+  /* Where allocations start */
+  union Arena_align data[];
+};
+
+void *
+arena_grow(struct Arena *arena, size_t size)
+{
+  bool large = size > ARENA_BLOCK / 4;
+  size_t cap = large ? size : ARENA_BLOCK;
+  struct Arena_block *block = malloc(sizeof(*block) + cap);
+  if (!block)
+    REPORT_AND_EXIT;
+  block->cap = cap;
+  char *data = (char *)(block->data);
+  if (large && arena->blocks) {
+    /* (the current block keeps being bumped into) */
+    block->next = arena->blocks->next;
+    arena->blocks->next = block;
+    return data;
+  }
+  block->next = arena->blocks;
+  arena->blocks = block;
+  arena->pos = data + size;
+  arena->end = data + cap;
+  return data;
+}
+
+char *
+arena_strndup(struct Arena *arena, char const *str, size_t len)
+{
+  char *ans = arena_alloc(arena, len + 1);
+  memcpy(ans, str, len);
+  ans[len] = 0;
+  return ans;
+}
+
+char *
+arena_strdup(struct Arena *arena, char const *str)
+{
+  return arena_strndup(arena, str, strlen(str));
+}
+
+void
+arena_merge(struct Arena *dst, struct Arena *src)
+{
+  if (!src->blocks)
+    return;
+  if (!dst->blocks) {
+    *dst = *src;
+  } else {
+    /* (dst keeps bumping into its own block, those of src go after it) */
+    struct Arena_block *last = src->blocks;
+    while (last->next)
+      last = last->next;
+    last->next = dst->blocks->next;
+    dst->blocks->next = src->blocks;
+  }
+  memset(src, 0, sizeof(*src));
+}
+
+void
+arena_clear(struct Arena *arena)
+{
+  if (!arena->blocks)
+    return;
+  struct Arena_block *first = arena->blocks,
+                     *block = first->next;
+  while (block) {
+    struct Arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  first->next = NULL;
+  arena->pos = (char *)(first->data);
+  arena->end = arena->pos + first->cap;
+}
+
+void
+arena_release(struct Arena *arena)
+{
+  struct Arena_block *block = arena->blocks;
+  while (block) {
+    struct Arena_block *next = block->next;
+    free(block);
+    block = next;
+  }
+  memset(arena, 0, sizeof(*arena));
+}
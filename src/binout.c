@@ -0,0 +1,494 @@
+/* See the header file for contracts and more docs */
+/* strdup, logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "binout.h"
+#include "events.h"
+#include "output.h"
+#include "logging.h"
+#include "uthash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+
+static inline uint64_t
+pad8(uint64_t size)
+{
+  return (size + 7) & ~(uint64_t)7;
+}
+
+/* Bytes taken by the columns of a block of n states (links) */
+static inline uint64_t
+states_size(uint64_t n)
+{
+  return 5 * 8 * n + 3 * pad8(4 * n);
+}
+
+static inline uint64_t
+links_size(uint64_t n)
+{
+  return 6 * 8 * n + 2 * pad8(4 * n);
+}
+
+/*
+ * Reading
+ */
+
+/* (off + len) <= size, without overflowing */
+static inline bool
+in_bounds(uint64_t off, uint64_t len, size_t size)
+{
+  return off <= size && len <= size - off;
+}
+
+#define CORRUPT_BINOUT(...)\
+  do {\
+    LOG_ERROR("Corrupt compensated binary trace: " __VA_ARGS__);\
+    return -1;\
+  } while(0)
+
+int
+binout_open(struct Binout *bo, void const *map, size_t size)
+{
+  assert(bo && map);
+  char const *base = map;
+  struct Binout_header const *h = map;
+  if (size < sizeof(*h) + sizeof(struct Binout_trailer) ||
+      memcmp(h->magic, BINOUT_MAGIC, sizeof(BINOUT_MAGIC)))
+    CORRUPT_BINOUT("bad magic\n");
+  if (h->byte_order != BINOUT_BYTE_ORDER)
+    CORRUPT_BINOUT("written with a different byte order\n");
+  if (h->version != BINOUT_VERSION)
+    CORRUPT_BINOUT("version %u, expected %u\n", (unsigned)h->version,
+        (unsigned)BINOUT_VERSION);
+  struct Binout_trailer const *t = (struct Binout_trailer const *)(base +
+      size - sizeof(*t));
+  if (memcmp(t->magic, BINOUT_MAGIC, sizeof(BINOUT_MAGIC)))
+    CORRUPT_BINOUT("bad trailer, was the trace truncated?\n");
+  if (t->blocks > size / sizeof(struct Binout_index) ||
+      !in_bounds(t->index_off, t->blocks * sizeof(struct Binout_index),
+        size) || t->strings >= size / 8 ||
+      !in_bounds(t->strings_off, 8 * (t->strings + 1), size) ||
+      !in_bounds(t->passthrough_off, t->passthrough_len, size) ||
+      t->index_off % 8 || t->strings_off % 8)
+    CORRUPT_BINOUT("trailer out of bounds\n");
+  bo->base = base;
+  bo->trailer = t;
+  bo->index = (struct Binout_index const *)(base + t->index_off);
+  bo->string_offs = (uint64_t const *)(base + t->strings_off);
+  bo->string_blob = base + t->strings_off + 8 * (t->strings + 1);
+  bo->passthrough = base + t->passthrough_off;
+  /* The last offset is the size of the blob */
+  uint64_t blob_len = bo->string_offs[t->strings];
+  if (!in_bounds((uint64_t)(bo->string_blob - base), blob_len, size) ||
+      (blob_len && bo->string_blob[blob_len - 1]))
+    CORRUPT_BINOUT("string table out of bounds\n");
+  for (uint64_t i = 0; i < t->strings; i++)
+    if (bo->string_offs[i] >= blob_len)
+      CORRUPT_BINOUT("string %" PRIu64 " out of bounds\n", i);
+  for (uint64_t i = 0; i < t->blocks; i++) {
+    struct Binout_index const *e = bo->index + i;
+    if (e->count > BINOUT_BLOCK || e->offset % 8 ||
+        !in_bounds(e->offset, sizeof(struct Binout_block) + (e->kind ==
+            BINOUT_STATES ? states_size(e->count) : links_size(e->count)),
+          size))
+      CORRUPT_BINOUT("block %" PRIu64 " out of bounds\n", i);
+    struct Binout_block const *b = (struct Binout_block const *)(base +
+        e->offset);
+    if (b->kind != e->kind || b->rank != e->rank || b->count != e->count ||
+        (e->kind != BINOUT_STATES && e->kind != BINOUT_LINKS))
+      CORRUPT_BINOUT("block %" PRIu64 " doesn't match the index\n", i);
+    if (e->kind == BINOUT_STATES) {
+      struct Binout_states s;
+      binout_states(bo, i, &s);
+      for (uint64_t j = 0; j < e->count; j++)
+        if (s.routine[j] >= t->strings)
+          CORRUPT_BINOUT("bad routine in block %" PRIu64 "\n", i);
+    } else {
+      struct Binout_links l;
+      binout_links(bo, i, &l);
+      for (uint64_t j = 0; j < e->count; j++)
+        if (l.container[j] >= t->strings && l.container[j] != BINOUT_NULL)
+          CORRUPT_BINOUT("bad container in block %" PRIu64 "\n", i);
+    }
+  }
+  return 0;
+}
+
+void
+binout_states(struct Binout const *bo, size_t block,
+    struct Binout_states *cols)
+{
+  uint64_t n = bo->index[block].count;
+  char const *it = bo->base + bo->index[block].offset +
+    sizeof(struct Binout_block);
+  cols->ostart = (double const *)it;
+  it += 8 * n;
+  cols->oend = (double const *)it;
+  it += 8 * n;
+  cols->start = (double const *)it;
+  it += 8 * n;
+  cols->end = (double const *)it;
+  it += 8 * n;
+  cols->mark = (uint64_t const *)it;
+  it += 8 * n;
+  cols->code = (uint32_t const *)it;
+  it += pad8(4 * n);
+  cols->routine = (uint32_t const *)it;
+  it += pad8(4 * n);
+  cols->imbrication = (int32_t const *)it;
+}
+
+void
+binout_links(struct Binout const *bo, size_t block, struct Binout_links *cols)
+{
+  uint64_t n = bo->index[block].count;
+  char const *it = bo->base + bo->index[block].offset +
+    sizeof(struct Binout_block);
+  cols->ostart = (double const *)it;
+  it += 8 * n;
+  cols->oend = (double const *)it;
+  it += 8 * n;
+  cols->start = (double const *)it;
+  it += 8 * n;
+  cols->end = (double const *)it;
+  it += 8 * n;
+  cols->mark = (uint64_t const *)it;
+  it += 8 * n;
+  cols->bytes = (uint64_t const *)it;
+  it += 8 * n;
+  cols->from = (int32_t const *)it;
+  it += pad8(4 * n);
+  cols->container = (uint32_t const *)it;
+}
+
+/*
+ * Writing
+ */
+
+/* The block being filled for one rank, columns grow up to BINOUT_BLOCK */
+struct Binout_columns {
+  double *s_ostart,
+         *s_oend,
+         *s_start,
+         *s_end;
+  uint64_t *s_mark;
+  uint32_t *s_code,
+           *s_routine;
+  int32_t *s_imbrication;
+  size_t states,
+         states_cap;
+  double *l_ostart,
+         *l_oend,
+         *l_start,
+         *l_end;
+  uint64_t *l_mark,
+           *l_bytes;
+  int32_t *l_from;
+  uint32_t *l_container;
+  size_t links,
+         links_cap;
+};
+
+struct Binout_string {
+  char *str;
+  uint32_t id;
+  UT_hash_handle hh;
+};
+
+static struct Binout_writer {
+  bool active;
+  /* Bytes written so far */
+  uint64_t off;
+  struct Binout_columns *ranks;
+  size_t nranks;
+  struct Binout_index *index;
+  size_t blocks,
+         index_cap;
+  struct Binout_string *strings;
+  uint32_t nstrings;
+  char *passthrough;
+  size_t passthrough_len,
+         passthrough_cap;
+} w;
+
+static inline size_t
+next_cap(size_t cap)
+{
+  return cap ? cap * 2 : 64;
+}
+
+/* Resize arr to cap elements of size bytes. Aborts on failure. */
+static void *
+grow(void *arr, size_t cap, size_t size)
+{
+  arr = realloc(arr, cap * size);
+  if (!arr)
+    REPORT_AND_EXIT;
+  return arr;
+}
+
+#define GROW(arr, cap) ((arr) = grow((arr), (cap), sizeof(*(arr))))
+
+static void
+emit(void const *data, uint64_t len)
+{
+  if (len)
+    output_write(data, (size_t)len);
+  w.off += len;
+}
+
+/* Pad a section of len bytes to 8 bytes */
+static void
+emit_pad(uint64_t len)
+{
+  static char const zeros[8] = { 0 };
+  emit(zeros, pad8(len) - len);
+}
+
+static void
+emit_padded(void const *data, uint64_t len)
+{
+  emit(data, len);
+  emit_pad(len);
+}
+
+static uint32_t
+intern(char const *str)
+{
+  if (!str)
+    return BINOUT_NULL;
+  struct Binout_string *e = NULL;
+  HASH_FIND_STR(w.strings, str, e);
+  if (e)
+    return e->id;
+  e = malloc(sizeof(*e));
+  if (!e)
+    REPORT_AND_EXIT;
+  e->str = strdup(str);
+  if (!e->str)
+    REPORT_AND_EXIT;
+  e->id = w.nstrings++;
+  HASH_ADD_KEYPTR(hh, w.strings, e->str, strlen(e->str), e);
+  return e->id;
+}
+
+static struct Binout_columns *
+writer_rank(int rank)
+{
+  if (rank < 0)
+    LOG_AND_EXIT("Negative rank %d can't be written\n", rank);
+  if ((size_t)rank >= w.nranks) {
+    size_t new_ranks = (size_t)rank + 1;
+    w.ranks = realloc(w.ranks, new_ranks * sizeof(*(w.ranks)));
+    if (!w.ranks)
+      REPORT_AND_EXIT;
+    memset(w.ranks + w.nranks, 0, (new_ranks - w.nranks) * sizeof(*(w.ranks)));
+    w.nranks = new_ranks;
+  }
+  return w.ranks + rank;
+}
+
+/* Write the header of a block and add it to the index */
+static void
+emit_block(enum Binout_kind kind, int rank, size_t count)
+{
+  if (w.blocks == w.index_cap) {
+    w.index_cap = next_cap(w.index_cap);
+    GROW(w.index, w.index_cap);
+  }
+  struct Binout_index *e = w.index + w.blocks++;
+  e->offset = w.off;
+  e->count = count;
+  e->rank = rank;
+  e->kind = (uint32_t)kind;
+  struct Binout_block b = { (uint32_t)kind, rank, count };
+  emit(&b, sizeof(b));
+}
+
+static void
+flush_states(int rank, struct Binout_columns *c)
+{
+  if (!c->states)
+    return;
+  uint64_t n = c->states;
+  emit_block(BINOUT_STATES, rank, c->states);
+  emit(c->s_ostart, 8 * n);
+  emit(c->s_oend, 8 * n);
+  emit(c->s_start, 8 * n);
+  emit(c->s_end, 8 * n);
+  emit(c->s_mark, 8 * n);
+  emit_padded(c->s_code, 4 * n);
+  emit_padded(c->s_routine, 4 * n);
+  emit_padded(c->s_imbrication, 4 * n);
+  c->states = 0;
+}
+
+static void
+flush_links(int rank, struct Binout_columns *c)
+{
+  if (!c->links)
+    return;
+  uint64_t n = c->links;
+  emit_block(BINOUT_LINKS, rank, c->links);
+  emit(c->l_ostart, 8 * n);
+  emit(c->l_oend, 8 * n);
+  emit(c->l_start, 8 * n);
+  emit(c->l_end, 8 * n);
+  emit(c->l_mark, 8 * n);
+  emit(c->l_bytes, 8 * n);
+  emit_padded(c->l_from, 4 * n);
+  emit_padded(c->l_container, 4 * n);
+  c->links = 0;
+}
+
+void
+binout_start(void)
+{
+  assert(!w.active);
+  w.active = true;
+  struct Binout_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BINOUT_MAGIC, sizeof(h.magic));
+  h.version = BINOUT_VERSION;
+  h.byte_order = BINOUT_BYTE_ORDER;
+  emit(&h, sizeof(h));
+}
+
+bool
+binout_active(void)
+{
+  return w.active;
+}
+
+void
+binout_state(struct State const *state, double ostart, double oend)
+{
+  assert(w.active && state);
+  struct Binout_columns *c = writer_rank(state->rank);
+  if (c->states == c->states_cap) {
+    c->states_cap = next_cap(c->states_cap);
+    GROW(c->s_ostart, c->states_cap);
+    GROW(c->s_oend, c->states_cap);
+    GROW(c->s_start, c->states_cap);
+    GROW(c->s_end, c->states_cap);
+    GROW(c->s_mark, c->states_cap);
+    GROW(c->s_code, c->states_cap);
+    GROW(c->s_routine, c->states_cap);
+    GROW(c->s_imbrication, c->states_cap);
+  }
+  size_t i = c->states++;
+  c->s_ostart[i] = ostart;
+  c->s_oend[i] = oend;
+  c->s_start[i] = state->start;
+  c->s_end[i] = state->end;
+  c->s_mark[i] = state->mark;
+  c->s_code[i] = (uint32_t)state->code;
+  c->s_routine[i] = intern(state->routine);
+  c->s_imbrication[i] = state->imbrication;
+  if (c->states == BINOUT_BLOCK)
+    flush_states(state->rank, c);
+}
+
+void
+binout_link(struct State const *recv, struct State const *match, double ostart,
+    double oend)
+{
+  assert(w.active && recv && match && match->comm.c);
+  struct Binout_columns *c = writer_rank(recv->rank);
+  if (c->links == c->links_cap) {
+    c->links_cap = next_cap(c->links_cap);
+    GROW(c->l_ostart, c->links_cap);
+    GROW(c->l_oend, c->links_cap);
+    GROW(c->l_start, c->links_cap);
+    GROW(c->l_end, c->links_cap);
+    GROW(c->l_mark, c->links_cap);
+    GROW(c->l_bytes, c->links_cap);
+    GROW(c->l_from, c->links_cap);
+    GROW(c->l_container, c->links_cap);
+  }
+  size_t i = c->links++;
+  c->l_ostart[i] = ostart;
+  c->l_oend[i] = oend;
+  c->l_start[i] = match->start;
+  c->l_end[i] = recv->end;
+  c->l_mark[i] = match->mark;
+  c->l_bytes[i] = match->comm.c->bytes;
+  c->l_from[i] = match->rank;
+  c->l_container[i] = intern(match->comm.c->container);
+  if (c->links == BINOUT_BLOCK)
+    flush_links(recv->rank, c);
+}
+
+void
+binout_passthrough(char const *line, size_t len)
+{
+  assert(w.active && line);
+  if (w.passthrough_len + len > w.passthrough_cap) {
+    w.passthrough_cap = (w.passthrough_len + len) * 2;
+    GROW(w.passthrough, w.passthrough_cap);
+  }
+  memcpy(w.passthrough + w.passthrough_len, line, len);
+  w.passthrough_len += len;
+}
+
+void
+binout_finish(void)
+{
+  assert(w.active);
+  for (size_t i = 0; i < w.nranks; i++) {
+    struct Binout_columns *c = w.ranks + i;
+    flush_states((int)i, c);
+    flush_links((int)i, c);
+    free(c->s_ostart);
+    free(c->s_oend);
+    free(c->s_start);
+    free(c->s_end);
+    free(c->s_mark);
+    free(c->s_code);
+    free(c->s_routine);
+    free(c->s_imbrication);
+    free(c->l_ostart);
+    free(c->l_oend);
+    free(c->l_start);
+    free(c->l_end);
+    free(c->l_mark);
+    free(c->l_bytes);
+    free(c->l_from);
+    free(c->l_container);
+  }
+  struct Binout_trailer t;
+  memset(&t, 0, sizeof(t));
+  memcpy(t.magic, BINOUT_MAGIC, sizeof(t.magic));
+  t.blocks = w.blocks;
+  t.strings = w.nstrings;
+  t.passthrough_len = w.passthrough_len;
+  /* (insertion order is id order) */
+  t.strings_off = w.off;
+  uint64_t str_off = 0;
+  struct Binout_string *s = NULL,
+                       *tmp = NULL;
+  HASH_ITER(hh, w.strings, s, tmp) {
+    emit(&str_off, sizeof(str_off));
+    str_off += strlen(s->str) + 1;
+  }
+  emit(&str_off, sizeof(str_off));
+  HASH_ITER(hh, w.strings, s, tmp) {
+    emit(s->str, strlen(s->str) + 1);
+    HASH_DEL(w.strings, s);
+    free(s->str);
+    free(s);
+  }
+  emit_pad(str_off);
+  t.passthrough_off = w.off;
+  emit_padded(w.passthrough, w.passthrough_len);
+  t.index_off = w.off;
+  emit(w.index, w.blocks * sizeof(*(w.index)));
+  emit(&t, sizeof(t));
+  free(w.ranks);
+  free(w.index);
+  free(w.passthrough);
+  memset(&w, 0, sizeof(w));
+}
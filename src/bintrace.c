@@ -0,0 +1,445 @@
+/* See the header file for contracts and more docs */
+/* strdup, logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "bintrace.h"
+#include "events.h"
+#include "logging.h"
+#include "uthash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+
+/* Growable columns of one rank, see the format description in the header */
+struct Bintrace_column_set {
+  double *s_start,
+         *s_end;
+  uint64_t *s_mark;
+  uint32_t *s_routine;
+  int32_t *s_imbrication;
+  size_t states,
+         states_cap;
+  double *l_start,
+         *l_end;
+  uint64_t *l_mark,
+           *l_bytes;
+  int32_t *l_from;
+  uint32_t *l_type,
+           *l_container;
+  size_t links,
+         links_cap;
+};
+
+static inline uint64_t
+pad8(uint64_t size)
+{
+  return (size + 7) & ~(uint64_t)7;
+}
+
+/* Bytes taken by the state (link) columns of n states (links) */
+static inline uint64_t
+states_size(uint64_t n)
+{
+  return 3 * 8 * n + 2 * pad8(4 * n);
+}
+
+static inline uint64_t
+links_size(uint64_t n)
+{
+  return 4 * 8 * n + 3 * pad8(4 * n);
+}
+
+/*
+ * Reading
+ */
+
+bool
+bintrace_is(void const *map, size_t size)
+{
+  return size >= sizeof(struct Bintrace_header) && bintrace_magic(map, size);
+}
+
+/* (off + len) <= size, without overflowing */
+static inline bool
+in_bounds(uint64_t off, uint64_t len, size_t size)
+{
+  return off <= size && len <= size - off;
+}
+
+#define CORRUPT_BINTRACE(...)\
+  do {\
+    LOG_ERROR("Corrupt binary trace: " __VA_ARGS__);\
+    return -1;\
+  } while(0)
+
+int
+bintrace_open(struct Bintrace *bt, void const *map, size_t size)
+{
+  assert(bt && map);
+  char const *base = map;
+  if (!bintrace_is(map, size))
+    CORRUPT_BINTRACE("bad magic\n");
+  struct Bintrace_header const *h = map;
+  if (h->byte_order != BINTRACE_BYTE_ORDER)
+    CORRUPT_BINTRACE("written with a different byte order\n");
+  if (h->version != BINTRACE_VERSION)
+    CORRUPT_BINTRACE("version %u, expected %u\n", (unsigned)h->version,
+        (unsigned)BINTRACE_VERSION);
+  if (h->ranks > size / sizeof(struct Bintrace_rank) ||
+      !in_bounds(sizeof(*h), h->ranks * sizeof(struct Bintrace_rank), size) ||
+      h->states > size / 4 || !in_bounds(h->order_off, 4 * h->states, size) ||
+      h->strings >= size / 8 ||
+      !in_bounds(h->strings_off, 8 * (h->strings + 1), size) ||
+      !in_bounds(h->passthrough_off, h->passthrough_len, size) ||
+      h->order_off % 8 || h->strings_off % 8)
+    CORRUPT_BINTRACE("header out of bounds\n");
+  bt->header = h;
+  bt->ranks = (struct Bintrace_rank const *)(base + sizeof(*h));
+  bt->order = (uint32_t const *)(base + h->order_off);
+  bt->string_offs = (uint64_t const *)(base + h->strings_off);
+  bt->string_blob = base + h->strings_off + 8 * (h->strings + 1);
+  bt->passthrough = base + h->passthrough_off;
+  /* The last offset is the size of the blob */
+  uint64_t blob_len = bt->string_offs[h->strings];
+  if (!in_bounds((uint64_t)(bt->string_blob - base), blob_len, size) ||
+      (blob_len && bt->string_blob[blob_len - 1]))
+    CORRUPT_BINTRACE("string table out of bounds\n");
+  for (uint64_t i = 0; i < h->strings; i++)
+    if (bt->string_offs[i] >= blob_len)
+      CORRUPT_BINTRACE("string %" PRIu64 " out of bounds\n", i);
+  uint64_t states = 0,
+           links = 0;
+  for (uint64_t i = 0; i < h->ranks; i++) {
+    struct Bintrace_rank const *r = bt->ranks + i;
+    if (r->states > size / 8 || r->links > size / 8 ||
+        !in_bounds(r->states_off, states_size(r->states), size) ||
+        !in_bounds(r->links_off, links_size(r->links), size) ||
+        r->states_off % 8 || r->links_off % 8)
+      CORRUPT_BINTRACE("rank %" PRIu64 " out of bounds\n", i);
+    states += r->states;
+    links += r->links;
+    struct Bintrace_states s;
+    bintrace_states(bt, i, &s);
+    for (uint64_t j = 0; j < r->states; j++)
+      if (s.routine[j] >= h->strings)
+        CORRUPT_BINTRACE("bad routine at rank %" PRIu64 "\n", i);
+    struct Bintrace_links l;
+    bintrace_links(bt, i, &l);
+    for (uint64_t j = 0; j < r->links; j++)
+      if (l.container[j] >= h->strings)
+        CORRUPT_BINTRACE("bad container at rank %" PRIu64 "\n", i);
+  }
+  if (states != h->states || links != h->links)
+    CORRUPT_BINTRACE("event counts don't add up\n");
+  for (uint64_t i = 0; i < h->states; i++)
+    if (bt->order[i] >= h->ranks)
+      CORRUPT_BINTRACE("bad rank in the order column\n");
+  return 0;
+}
+
+void
+bintrace_states(struct Bintrace const *bt, size_t rank,
+    struct Bintrace_states *cols)
+{
+  uint64_t n = bt->ranks[rank].states;
+  char const *it = (char const *)(bt->header) + bt->ranks[rank].states_off;
+  cols->start = (double const *)it;
+  it += 8 * n;
+  cols->end = (double const *)it;
+  it += 8 * n;
+  cols->mark = (uint64_t const *)it;
+  it += 8 * n;
+  cols->routine = (uint32_t const *)it;
+  it += pad8(4 * n);
+  cols->imbrication = (int32_t const *)it;
+}
+
+void
+bintrace_links(struct Bintrace const *bt, size_t rank,
+    struct Bintrace_links *cols)
+{
+  uint64_t n = bt->ranks[rank].links;
+  char const *it = (char const *)(bt->header) + bt->ranks[rank].links_off;
+  cols->start = (double const *)it;
+  it += 8 * n;
+  cols->end = (double const *)it;
+  it += 8 * n;
+  cols->mark = (uint64_t const *)it;
+  it += 8 * n;
+  cols->bytes = (uint64_t const *)it;
+  it += 8 * n;
+  cols->from = (int32_t const *)it;
+  it += pad8(4 * n);
+  cols->type = (uint32_t const *)it;
+  it += pad8(4 * n);
+  cols->container = (uint32_t const *)it;
+}
+
+/*
+ * Writing
+ */
+
+/* Next capacity of a column that is full */
+static inline size_t
+next_cap(size_t cap)
+{
+  return cap ? cap * 2 : 64;
+}
+
+/* Resize arr to cap elements of size bytes. Aborts on failure. */
+static void *
+grow(void *arr, size_t cap, size_t size)
+{
+  arr = realloc(arr, cap * size);
+  if (!arr)
+    REPORT_AND_EXIT;
+  return arr;
+}
+
+#define GROW(arr, cap) ((arr) = grow((arr), (cap), sizeof(*(arr))))
+
+void
+bintrace_builder_init(struct Bintrace_builder *b)
+{
+  memset(b, 0, sizeof(*b));
+}
+
+static uint32_t
+intern(struct Bintrace_builder *b, char const *str)
+{
+  struct Bintrace_string *e = NULL;
+  HASH_FIND_STR(b->strings, str, e);
+  if (e)
+    return e->id;
+  e = malloc(sizeof(*e));
+  if (!e)
+    REPORT_AND_EXIT;
+  e->str = strdup(str);
+  if (!e->str)
+    REPORT_AND_EXIT;
+  e->id = b->nstrings++;
+  HASH_ADD_KEYPTR(hh, b->strings, e->str, strlen(e->str), e);
+  return e->id;
+}
+
+static struct Bintrace_column_set *
+builder_rank(struct Bintrace_builder *b, int rank)
+{
+  if (rank < 0)
+    LOG_AND_EXIT("Negative rank %d can't be packed\n", rank);
+  if ((size_t)rank >= b->ranks) {
+    size_t new_ranks = (size_t)rank + 1;
+    b->cols = realloc(b->cols, new_ranks * sizeof(*(b->cols)));
+    if (!b->cols)
+      REPORT_AND_EXIT;
+    memset(b->cols + b->ranks, 0, (new_ranks - b->ranks) *
+        sizeof(*(b->cols)));
+    b->ranks = new_ranks;
+  }
+  return b->cols + rank;
+}
+
+void
+bintrace_builder_state(struct Bintrace_builder *b, struct State const *state)
+{
+  assert(b && state);
+  struct Bintrace_column_set *c = builder_rank(b, state->rank);
+  if (c->states == c->states_cap) {
+    c->states_cap = next_cap(c->states_cap);
+    GROW(c->s_start, c->states_cap);
+    GROW(c->s_end, c->states_cap);
+    GROW(c->s_mark, c->states_cap);
+    GROW(c->s_routine, c->states_cap);
+    GROW(c->s_imbrication, c->states_cap);
+  }
+  c->s_start[c->states] = state->start;
+  c->s_end[c->states] = state->end;
+  c->s_mark[c->states] = state->mark;
+  c->s_routine[c->states] = intern(b, state->routine);
+  c->s_imbrication[c->states] = state->imbrication;
+  c->states++;
+  if (b->states == b->order_cap) {
+    b->order_cap = next_cap(b->order_cap);
+    GROW(b->order, b->order_cap);
+  }
+  b->order[b->states++] = (uint32_t)state->rank;
+}
+
+void
+bintrace_builder_link(struct Bintrace_builder *b, struct Link const *link)
+{
+  assert(b && link);
+  struct Bintrace_column_set *c = builder_rank(b, link->to);
+  if (c->links == c->links_cap) {
+    c->links_cap = next_cap(c->links_cap);
+    GROW(c->l_start, c->links_cap);
+    GROW(c->l_end, c->links_cap);
+    GROW(c->l_mark, c->links_cap);
+    GROW(c->l_bytes, c->links_cap);
+    GROW(c->l_from, c->links_cap);
+    GROW(c->l_type, c->links_cap);
+    GROW(c->l_container, c->links_cap);
+  }
+  c->l_start[c->links] = link->start;
+  c->l_end[c->links] = link->end;
+  c->l_mark[c->links] = link->mark;
+  c->l_bytes[c->links] = link->bytes;
+  c->l_from[c->links] = link->from;
+  c->l_type[c->links] = (uint32_t)link->type;
+  c->l_container[c->links] = intern(b, link->container ? link->container :
+      "");
+  c->links++;
+  b->links++;
+}
+
+void
+bintrace_builder_other(struct Bintrace_builder *b, char const *line,
+    size_t len)
+{
+  assert(b && line);
+  if (b->passthrough_len + len > b->passthrough_cap) {
+    b->passthrough_cap = (b->passthrough_len + len) * 2;
+    GROW(b->passthrough, b->passthrough_cap);
+  }
+  memcpy(b->passthrough + b->passthrough_len, line, len);
+  b->passthrough_len += len;
+}
+
+/* Pad a section of len bytes to 8 bytes */
+static int
+write_pad(FILE *f, uint64_t len)
+{
+  static char const zeros[8] = { 0 };
+  uint64_t pad = pad8(len) - len;
+  if (pad && fwrite(zeros, 1, (size_t)pad, f) != pad)
+    return -1;
+  return 0;
+}
+
+/* fwrite len bytes of buff (may be NULL if len is 0) padded to 8 bytes */
+static int
+write_padded(FILE *f, void const *buff, uint64_t len)
+{
+  if (len && fwrite(buff, 1, (size_t)len, f) != len)
+    return -1;
+  return write_pad(f, len);
+}
+
+int
+bintrace_builder_write(struct Bintrace_builder const *b, char const *filename)
+{
+  assert(b && filename);
+  /* Layout */
+  struct Bintrace_header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, BINTRACE_MAGIC, sizeof(h.magic));
+  h.version = BINTRACE_VERSION;
+  h.byte_order = BINTRACE_BYTE_ORDER;
+  h.ranks = b->ranks;
+  h.states = b->states;
+  h.links = b->links;
+  h.strings = b->nstrings;
+  h.passthrough_len = b->passthrough_len;
+  uint64_t blob_len = 0;
+  struct Bintrace_string *s = NULL,
+                         *tmp = NULL;
+  HASH_ITER(hh, b->strings, s, tmp)
+    blob_len += strlen(s->str) + 1;
+  h.order_off = sizeof(h) + b->ranks * sizeof(struct Bintrace_rank);
+  h.strings_off = h.order_off + pad8(4 * h.states);
+  h.passthrough_off = h.strings_off + 8 * (h.strings + 1) + pad8(blob_len);
+  uint64_t off = h.passthrough_off + pad8(h.passthrough_len);
+  struct Bintrace_rank *ranks = calloc(b->ranks ? b->ranks : 1,
+      sizeof(*ranks));
+  if (!ranks)
+    return -1;
+  for (size_t i = 0; i < b->ranks; i++) {
+    ranks[i].states = b->cols[i].states;
+    ranks[i].links = b->cols[i].links;
+    ranks[i].states_off = off;
+    off += states_size(ranks[i].states);
+    ranks[i].links_off = off;
+    off += links_size(ranks[i].links);
+  }
+  /* Contents */
+  int ans = -1;
+  FILE *f = fopen(filename, "wb");
+  if (!f)
+    goto write_ranks;
+  if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+      (b->ranks && fwrite(ranks, sizeof(*ranks), b->ranks, f) != b->ranks) ||
+      write_padded(f, b->order, 4 * h.states))
+    goto write_fopen;
+  /* (insertion order is id order) */
+  uint64_t str_off = 0;
+  HASH_ITER(hh, b->strings, s, tmp) {
+    if (fwrite(&str_off, sizeof(str_off), 1, f) != 1)
+      goto write_fopen;
+    str_off += strlen(s->str) + 1;
+  }
+  if (fwrite(&str_off, sizeof(str_off), 1, f) != 1)
+    goto write_fopen;
+  HASH_ITER(hh, b->strings, s, tmp)
+    if (fwrite(s->str, 1, strlen(s->str) + 1, f) != strlen(s->str) + 1)
+      goto write_fopen;
+  if (write_pad(f, blob_len))
+    goto write_fopen;
+  if (write_padded(f, b->passthrough, h.passthrough_len))
+    goto write_fopen;
+  for (size_t i = 0; i < b->ranks; i++) {
+    struct Bintrace_column_set const *c = b->cols + i;
+    if (write_padded(f, c->s_start, 8 * c->states) ||
+        write_padded(f, c->s_end, 8 * c->states) ||
+        write_padded(f, c->s_mark, 8 * c->states) ||
+        write_padded(f, c->s_routine, 4 * c->states) ||
+        write_padded(f, c->s_imbrication, 4 * c->states) ||
+        write_padded(f, c->l_start, 8 * c->links) ||
+        write_padded(f, c->l_end, 8 * c->links) ||
+        write_padded(f, c->l_mark, 8 * c->links) ||
+        write_padded(f, c->l_bytes, 8 * c->links) ||
+        write_padded(f, c->l_from, 4 * c->links) ||
+        write_padded(f, c->l_type, 4 * c->links) ||
+        write_padded(f, c->l_container, 4 * c->links))
+      goto write_fopen;
+  }
+  ans = 0;
+write_fopen:
+  if (fclose(f))
+    ans = -1;
+write_ranks:
+  free(ranks);
+  return ans;
+}
+
+void
+bintrace_builder_del(struct Bintrace_builder *b)
+{
+  for (size_t i = 0; i < b->ranks; i++) {
+    struct Bintrace_column_set *c = b->cols + i;
+    free(c->s_start);
+    free(c->s_end);
+    free(c->s_mark);
+    free(c->s_routine);
+    free(c->s_imbrication);
+    free(c->l_start);
+    free(c->l_end);
+    free(c->l_mark);
+    free(c->l_bytes);
+    free(c->l_from);
+    free(c->l_type);
+    free(c->l_container);
+  }
+  free(b->cols);
+  free(b->order);
+  free(b->passthrough);
+  struct Bintrace_string *s = NULL,
+                         *tmp = NULL;
+  HASH_ITER(hh, b->strings, s, tmp) {
+    HASH_DEL(b->strings, s);
+    free(s->str);
+    free(s);
+  }
+  memset(b, 0, sizeof(*b));
+}
@@ -4,6 +4,11 @@
 #include "compensation.h"
 #include "copytime.h"
 #include "events.h"
+#include "store.h"
+#include "binout.h"
+#include "textout.h"
+#include "reorder.h"
+#include "split.h"
 #include <assert.h>
 #include "logging.h"
 #include <stdbool.h>
@@ -21,57 +26,115 @@ copytime(struct Data const *data, int bytes)
 }
 
 /*
- * Return the compensated timestamp for the local event 'state', without
- * altering it or the timestamp register (data struct). Assumes both have
- * been properly initialized.
+ * Return the compensated timestamp for the local event with handle 'state',
+ * without altering it or the timestamp register (data struct). Assumes both
+ * have been properly initialized.
  */
 static inline double
-compensate_const(struct State const *state, struct Data const *data)
+compensate_const(struct Handle state, struct Data const *data)
 {
-  return data->timestamps.c_last[state->rank] + (state->start -
-      data->timestamps.last[state->rank]) - data->overhead;
+  return data->timestamps.c_last[state.rank] + (STORE_AT(data->store, state,
+        start) - data->timestamps.last[state.rank]) - data->overhead;
 }
 
+/* Output a compensated state, ostart and oend being its original times */
+static inline void
+print_state(struct Data const *data, struct Handle h, double ostart,
+    double oend)
+{
+  struct State state;
+  store_get(data->store, h, &state);
+  if (binout_active())
+    binout_state(&state, ostart, oend);
+  else if (reorder_active())
+    reorder_state(&state);
+  else if (split_active())
+    split_state(&state);
+  else if (textout_active())
+    textout_state(&state);
+  else
+    state_print(&state);
+}
+
+/*
+ * Output the link of a compensated recv, ostart being the original start of
+ * the send and oend the original end of the recv
+ */
+static inline void
+print_link(struct Data const *data, struct Handle recv_h, struct Handle
+    match_h, double ostart, double oend)
+{
+  struct State recv,
+               match;
+  store_get(data->store, recv_h, &recv);
+  store_get(data->store, match_h, &match);
+  if (binout_active()) {
+    binout_link(&recv, &match, ostart, oend);
+    return;
+  }
+  struct Link link;
+  state_c_recv_link(&recv, &match, &link);
+  if (reorder_active())
+    reorder_link(&link);
+  else if (split_active())
+    split_link(&link);
+  else if (textout_active())
+    textout_link(&link);
+  else
+    link_print(&link);
+}
+
+/* Report an overcompensated state */
+#define LOG_OVERCOMPENSATION(data_, state_)\
+  LOG_ERROR("Overcompensation detected at rank %d, %s. Perhaps the overhead "\
+      "estimator is incorrect (incorrect frequency?).\n", (state_).rank,\
+      STORE_AT((data_)->store, (state_), routine))
+
 /* Updates state and data timestamps */
-#define UPDATE_STATE_TS(state_, start_, end_, timestamps_)\
+#define UPDATE_STATE_TS(store_, state_, start_, end_, timestamps_)\
   do{\
-    (timestamps_).last[(state_)->rank] = (state_)->end;\
-    (timestamps_).c_last[(state_)->rank] = (end_);\
-    (state_)->start = (start_);\
-    (state_)->end = (end_);\
+    (timestamps_).last[(state_).rank] = STORE_AT(store_, state_, end);\
+    (timestamps_).c_last[(state_).rank] = (end_);\
+    STORE_AT(store_, state_, start) = (start_);\
+    STORE_AT(store_, state_, end) = (end_);\
   }while(0)
 
 void
-compensate_local(struct State *state, struct Data *data)
+compensate_local(struct Handle state, struct Data *data)
 {
-  assert(state);
-  double c_start = compensate_const(state, data),
-         c_end   = c_start + (state->end - state->start) - data->overhead;
+  struct Store *store = data->store;
+  double start = STORE_AT(store, state, start),
+         end = STORE_AT(store, state, end),
+         c_start = compensate_const(state, data),
+         c_end   = c_start + (end - start) - data->overhead;
   /* Compensate link overhead */
-  if (state_is_send(state))
+  if (routine_flags[STORE_AT(store, state, code)] & ROUTINE_IS_SEND)
     c_end -= data->overhead;
   if (c_end <= c_start)
-    LOG_ERROR("Overcompensation detected at rank %d, %s. Perhaps the overhead "
-        "estimator is incorrect (incorrect frequency?).\n", state->rank,
-        state->routine);
-  UPDATE_STATE_TS(state, c_start, c_end, data->timestamps);
-  state_print(state);
+    LOG_OVERCOMPENSATION(data, state);
+  UPDATE_STATE_TS(store, state, c_start, c_end, data->timestamps);
+  print_state(data, state, start, end);
 }
 
 void
-compensate_recv_(struct State *recv, struct State *c_send, double send_start,
+compensate_recv_(struct Handle recv, struct Handle c_send, double send_start,
     double send_end, struct Data *data, bool lower)
 {
-  /* Assumes assert(recv && c_send && c_send->comm.c); */
-  double c_recv_start = compensate_const(recv, data),
+  /* Assumes the comm of c_send was asserted */
+  struct Store *store = data->store;
+  double recv_start   = STORE_AT(store, recv, start),
+         recv_end     = STORE_AT(store, recv, end),
+         c_send_start = STORE_AT(store, c_send, start),
+         c_recv_start = compensate_const(recv, data),
          c_recv_end,  /* Value being calculated */
-         cpytime      = copytime(data, (int)(c_send->comm.c->bytes)),
-         comm         = recv->end - send_start;
+         cpytime      = copytime(data, (int)(STORE_AT(store, c_send,
+                 comm).c->bytes)),
+         comm         = recv_end - send_start;
   /* Communication time can be measured */
-  if (recv->start < send_end) {
+  if (recv_start < send_end) {
     /* The recv in the comp. trace had to wait data to be transfered to it */
-    if (c_send->start + comm > c_recv_start)
-      c_recv_end = c_send->start + comm;
+    if (c_send_start + comm > c_recv_start)
+      c_recv_end = c_send_start + comm;
     /* All the recv in the c. trace had to do was copy data between buffers */
     else
       c_recv_end = c_recv_start + cpytime;
@@ -79,56 +142,56 @@ compensate_recv_(struct State *recv, struct State *c_send, double send_start,
   } else {
     double comm_upper   = comm,
            comm_lower   = 2 * cpytime,
-           comm_min     = (c_recv_start - c_send->start) + cpytime,
+           comm_min     = (c_recv_start - c_send_start) + cpytime,
            comm_a_lower = comm_min > comm_lower ? comm_min : comm_lower,
            comm_a_upper = comm_min > comm_upper ? comm_min : comm_upper;
     if (lower)
-      c_recv_end = c_send->start + comm_a_lower;
+      c_recv_end = c_send_start + comm_a_lower;
     else
-      c_recv_end = c_send->start + comm_a_upper;
+      c_recv_end = c_send_start + comm_a_upper;
   }
   // TODO can we keep the tool tracer-independent?
   /* Compensate link creation overhead (Akypuera only) */
   c_recv_end -= data->overhead;
   if (c_recv_end <= c_recv_start)
-    LOG_ERROR("Overcompensation detected at rank %d, %s. Perhaps the overhead "
-        "estimator is incorrect (incorrect frequency?).\n", recv->rank,
-        recv->routine);
-  UPDATE_STATE_TS(recv, c_recv_start, c_recv_end, data->timestamps);
-  state_print(recv);
-  state_print_c_recv(recv, c_send);
+    LOG_OVERCOMPENSATION(data, recv);
+  UPDATE_STATE_TS(store, recv, c_recv_start, c_recv_end, data->timestamps);
+  print_state(data, recv, recv_start, recv_end);
+  print_link(data, recv, c_send, send_start, recv_end);
 }
 
 void
-compensate_recv(struct State *recv, struct Data *data, bool lower)
+compensate_recv(struct Handle recv, struct Data *data, bool lower)
 {
-  assert(recv && recv->comm.c->match && recv->comm.c->match->comm.c);
-  compensate_recv_(recv, recv->comm.c->match, recv->comm.c->ostart,
-      recv->comm.c->oend, data, lower);
+  struct Comm const *c = STORE_AT(data->store, recv, comm).c;
+  assert(c && c->match.index != STORE_NONE &&
+      STORE_AT(data->store, c->match, comm).c);
+  compensate_recv_(recv, c->match, c->ostart, c->oend, data, lower);
 }
 
 void
-compensate_grecv(struct State *grecv, size_t i, struct Data *data, bool lower)
+compensate_grecv(struct Handle grecv, size_t i, struct Data *data, bool lower)
 {
-  assert(grecv && grecv->comm.g && grecv->comm.g->match &&
-      grecv->comm.g->match[i] &&
-      grecv->comm.g->match[i]->comm.g);
-  compensate_recv_(grecv, grecv->comm.g->match[i],
-      grecv->comm.g->ostart[i], grecv->comm.g->oend[i],
-      data, lower);
+  struct Gcomm const *g = STORE_AT(data->store, grecv, comm).g;
+  assert(g && g->match && g->match[i].index != STORE_NONE &&
+      STORE_AT(data->store, g->match[i], comm).g);
+  compensate_recv_(grecv, g->match[i], g->ostart[i], g->oend[i], data,
+      lower);
 }
 
 void
-compensate_ssend_(struct State *recv, struct State *c_send, double send_start,
+compensate_ssend_(struct Handle recv, struct Handle c_send, double send_start,
     double send_end, struct Data *data)
 {
-  /* Assumes assert(recv && c_send); */
-  double c_recv_start = compensate_const(recv, data),
+  struct Store *store = data->store;
+  double recv_start = STORE_AT(store, recv, start),
+         recv_end = STORE_AT(store, recv, end),
+         c_recv_start = compensate_const(recv, data),
          c_send_start = compensate_const(c_send, data);
   /* (link overhead) */
   c_send_start -= data->overhead;
   /* Data only starts being sent once the recv is posted */
-  double comm = send_end - (recv->start > send_start ? recv->start :
+  double comm = send_end - (recv_start > send_start ? recv_start :
       send_start);
   double c_send_end; /* Value being calculated */
   /* The send in the c. trace had to wait the recv */
@@ -139,54 +202,54 @@ compensate_ssend_(struct State *recv, struct State *c_send, double send_start,
     c_send_end = c_send_start + comm;
   // FIXME Link overhead on the recv after completion
   if (c_send_end <= c_recv_start)
-    LOG_ERROR("Overcompensation detected at rank %d, %s. Perhaps the overhead "
-        "estimator is incorrect (incorrect frequency?).\n", recv->rank,
-        recv->routine);
+    LOG_OVERCOMPENSATION(data, recv);
   if (c_send_end <= c_send_start)
-    LOG_ERROR("Overcompensation detected at rank %d, %s. Perhaps the overhead "
-        "estimator is incorrect (incorrect frequency?).\n", c_send->rank,
-        c_send->routine);
+    LOG_OVERCOMPENSATION(data, c_send);
   /* We assume recv.end ~= send.end */
-  UPDATE_STATE_TS(recv, c_recv_start, c_send_end, data->timestamps);
-  UPDATE_STATE_TS(c_send, c_send_start, c_send_end, data->timestamps);
-  state_print(c_send);
-  state_print(recv);
-  state_print_c_recv(recv, c_send);
+  UPDATE_STATE_TS(store, recv, c_recv_start, c_send_end, data->timestamps);
+  UPDATE_STATE_TS(store, c_send, c_send_start, c_send_end, data->timestamps);
+  print_state(data, c_send, send_start, send_end);
+  print_state(data, recv, recv_start, recv_end);
+  print_link(data, recv, c_send, send_start, recv_end);
 }
 
 void
-compensate_ssend(struct State *recv, struct Data *data)
+compensate_ssend(struct Handle recv, struct Data *data)
 {
-  assert(recv && recv->comm.c && recv->comm.c->match);
-  compensate_ssend_(recv, recv->comm.c->match, recv->comm.c->ostart,
-      recv->comm.c->oend, data);
+  struct Comm const *c = STORE_AT(data->store, recv, comm).c;
+  assert(c && c->match.index != STORE_NONE);
+  compensate_ssend_(recv, c->match, c->ostart, c->oend, data);
 }
 
 void
-compensate_gssend(struct State *grecv, size_t i, struct Data *data)
+compensate_gssend(struct Handle grecv, size_t i, struct Data *data)
 {
-  assert(grecv && grecv->comm.g && grecv->comm.g->match &&
-      grecv->comm.g->match[i]);
-  compensate_ssend_(grecv, grecv->comm.g->match[i],
-      grecv->comm.g->ostart[i], grecv->comm.g->oend[i], data);
+  struct Gcomm const *g = STORE_AT(data->store, grecv, comm).g;
+  assert(g && g->match && g->match[i].index != STORE_NONE);
+  compensate_ssend_(grecv, g->match[i], g->ostart[i], g->oend[i], data);
 }
 
 void
-compensate_wait(struct State *wait, struct Data *data)
+compensate_wait(struct Handle wait, struct Data *data)
 {
   /* wait && wait->comm.c && (c_recv || c_send) asserted at pj_compensate.c */
-  double c_wait_start = compensate_const(wait, data),
+  struct Store *store = data->store;
+  struct Comm const *c = STORE_AT(store, wait, comm).c;
+  double start = STORE_AT(store, wait, start),
+         end = STORE_AT(store, wait, end),
+         c_wait_start = compensate_const(wait, data),
          c_wait_end; /* Value being calculated */
   // FIXME don't neglect wait overhead
   // TODO sync verification should be done @ pj_compensate
-  if (comm_is_sync(wait->comm.c, data->sync_bytes)) {
-    struct State *c_recv = wait->comm.c->match;
-    c_wait_end = c_wait_start > c_recv->end ? c_wait_start : c_recv->end;
+  if (comm_is_sync(c, data->sync_bytes)) {
+    double c_recv_end = STORE_AT(store, c->match, end);
+    c_wait_end = c_wait_start > c_recv_end ? c_wait_start : c_recv_end;
   } else {
-    struct State *c_send = wait->comm.c->match->comm.c->match;
-    double ctime = c_send->end + copytime(data, (int)(wait->comm.c->bytes));
+    struct Handle c_send = STORE_AT(store, c->match, comm).c->match;
+    double ctime = STORE_AT(store, c_send, end) + copytime(data,
+        (int)(c->bytes));
     /* We need to do this manually (compensate_const is for event->start) */
-    c_wait_end = c_wait_start + (wait->end - wait->start) - data->overhead;
+    c_wait_end = c_wait_start + (end - start) - data->overhead;
     if (c_wait_end <= ctime)
       c_wait_end = ctime;
   }
@@ -195,6 +258,6 @@ compensate_wait(struct State *wait, struct Data *data)
    *   LOG_ERROR("Overcompensation detected at rank %d. Perhaps the overhead "
    *       "estimator is incorrect (incorrect frequency?).\n", wait->rank);
    */
-  UPDATE_STATE_TS(wait, c_wait_start, c_wait_end, data->timestamps);
-  state_print(wait);
+  UPDATE_STATE_TS(store, wait, c_wait_start, c_wait_end, data->timestamps);
+  print_state(data, wait, start, end);
 }
@@ -2,8 +2,10 @@
 /* strdup, logging.h */
 #define _POSIX_C_SOURCE 200809L
 #include "events.h"
-#include "ref.h"
+#include "store.h"
 #include "logging.h"
+#include "decimal.h"
+#include "output.h"
 #include <stdbool.h>
 #include <inttypes.h>
 #include <stdlib.h>
@@ -11,254 +13,357 @@
 #include <strings.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
 
-// FIXME use a real parser
+/*
+ * Record tokenizer
+ *
+ * pj_dump lines are split on runs of ", " (the strtok semantics we used to
+ * have) in a single pass over the const line, so the input is never copied nor
+ * mutated. The first field tells the record type, and only then are the other
+ * fields decoded.
+ */
 
-static inline int
-rank2int(char const *rank)
+/* Enough for the longest record we care about (a Link, 11 fields) */
+#define MAX_FIELDS 12
+
+struct Field {
+  char const *str;
+  size_t len;
+};
+
+#define CORRUPT_TRACE() LOG_AND_EXIT("Corrupt trace. Is it a pj_dump trace? "\
+    "Did you call pj_dump with -u?\n")
+
+static inline bool
+is_sep(char c)
 {
-  int ans = -1;
-  // FIXME regex
-  int rc = sscanf(rank, "rank%d", &ans);
-  if (rc != 1)
-    LOG_ERROR("Couldn't get rank number from string: %s\n", rank);
+  return c == ',' || c == ' ';
+}
+
+/*
+ * Split line into at most max (up to MAX_FIELDS) fields, stopping at the end
+ * of the line. Returns the number of fields.
+ */
+static size_t
+tokenize(char const *line, size_t len, struct Field *fields, size_t max)
+{
+  char const *it = line,
+             *end = line + len;
+  char const *nl = memchr(line, '\n', len);
+  if (nl)
+    end = nl;
+  size_t n = 0;
+  while (n < max) {
+    while (it < end && is_sep(*it))
+      it++;
+    if (it == end)
+      break;
+    fields[n].str = it;
+    while (it < end && !is_sep(*it))
+      it++;
+    fields[n].len = (size_t)(it - fields[n].str);
+    n++;
+  }
+  return n;
+}
+
+/* The last field of [line, end), empty if there is none */
+static struct Field
+last_field(char const *line, char const *end)
+{
+  while (end > line && (is_sep(end[-1]) || end[-1] == '\n'))
+    end--;
+  char const *it = end;
+  while (it > line && !is_sep(it[-1]))
+    it--;
+  struct Field ans = { it, (size_t)(end - it) };
   return ans;
 }
 
-/* strtok macros for link/state_from_line/new functions */
-#define CORRUPT_TRACE() LOG_AND_EXIT("Corrupt trace. Is it a pj_dump trace? "\
-    "Did you call pj_dump with -u?\n")
-#define SKIPTOKEN()\
-  do {\
-    if (!strtok(NULL, tok))\
-      CORRUPT_TRACE();\
-  } while(0)
-#define GETTOKEN()\
-  do {\
-    token = strtok(NULL, tok);\
-    if (!token)\
-      CORRUPT_TRACE();\
-  } while(0)
-#define ASSERTSTRTO()\
-  do {\
-    if (errno || endptr == token)\
-      CORRUPT_TRACE();\
-  } while(0)
+static inline bool
+field_is(struct Field const *field, char const *str, size_t len)
+{
+  return field->len == len && !memcmp(field->str, str, len);
+}
 
 /*
- * Link routines
+ * Decode the leading digits of field, ignoring any trailing garbage (like
+ * strtoull would). Aborts if there are no digits or on overflow.
  */
+static inline uint64_t
+field2u64(struct Field const *field)
+{
+  uint64_t ans = 0;
+  size_t i = 0;
+  for (; i < field->len; i++) {
+    unsigned d = (unsigned)(field->str[i] - '0');
+    if (d > 9)
+      break;
+    if (ans > (UINT64_MAX - d) / 10)
+      CORRUPT_TRACE();
+    ans = ans * 10 + d;
+  }
+  if (!i)
+    CORRUPT_TRACE();
+  return ans;
+}
 
-static void
-link_del(struct ref const *ref)
+/* Same as above, but for a possibly negative int (like strtol) */
+static inline int
+field2int(struct Field const *field)
 {
-  assert(ref);
-  struct Link *link = container_of(ref, struct Link, ref);
-  if (link->container)
-    free(link->container);
-  if (link->type)
-    free(link->type);
-  free(link);
+  if (field->len && field->str[0] == '-') {
+    struct Field abs = { field->str + 1, field->len - 1 };
+    uint64_t ans = field2u64(&abs);
+    if (ans > (uint64_t)INT_MAX + 1)
+      CORRUPT_TRACE();
+    return (int)(-(int64_t)ans);
+  }
+  uint64_t ans = field2u64(field);
+  if (ans > INT_MAX)
+    CORRUPT_TRACE();
+  return (int)ans;
 }
 
-struct Link *
-link_from_line(char *line)
-{
-  if (!line)
-    return NULL;
-  char tok[] = ", ";
-  char *token = strtok(line, tok);
-  if (!token || strcmp(token, "Link"))
-    return NULL;
-  struct Link *ans = malloc(sizeof(*ans));
-  if (!ans)
-    REPORT_AND_EXIT;
-  errno = 0;
+/* Field -> *ans, returns false (leaving it as is) on failure */
+static inline bool
+field_to_double(struct Field const *field, double *ans)
+{
+  if (decimal_to_double(field->str, field->len, ans))
+    return true;
+  /* Slow path, strtod needs a null terminated string */
+  char buff[64];
+  if (field->len >= sizeof(buff))
+    return false;
+  memcpy(buff, field->str, field->len);
+  buff[field->len] = 0;
   char *endptr;
-  /* container */
-  GETTOKEN();
-  ans->container = strdup(token);
-  if (!ans->container)
-    REPORT_AND_EXIT;
-  /* LINK */
-  SKIPTOKEN();
-  /* Start time */
-  GETTOKEN();
-  ans->start = strtod(token, &endptr);
-  ASSERTSTRTO();
-  /* End time */
-  GETTOKEN();
-  ans->end = strtod(token, &endptr);
-  ASSERTSTRTO();
-  /* Duration */
-  SKIPTOKEN();
-  /* Type */
-  GETTOKEN();
-  ans->type = strdup(token);
-  if (!ans->type)
-    REPORT_AND_EXIT;
-  /* From */
-  GETTOKEN();
-  ans->from = rank2int(token);
-  /* To */
-  GETTOKEN();
-  ans->to = rank2int(token);
-  /* send_mark */
-  GETTOKEN();
-  ans->mark = (uint64_t)strtoull(token, &endptr, 10);
-  ASSERTSTRTO();
-  /* bytes */
-  token = strtok(NULL, tok);
-  if (!token) {
-    LOG_ERROR("Failed to read byte count. Did you call pj_dump with -u?\n");
-    ans->bytes = 0;
-  } else {
-    ans->bytes = (size_t)strtoull(token, &endptr, 10);
-    ASSERTSTRTO();
-  }
-  ans->ref.count = 1;
-  ans->ref.free = link_del;
+  errno = 0;
+  double d = strtod(buff, &endptr);
+  if (errno || endptr == buff)
+    return false;
+  *ans = d;
+  return true;
+}
+
+static inline double
+field2double(struct Field const *field)
+{
+  double ans;
+  if (!field_to_double(field, &ans))
+    CORRUPT_TRACE();
   return ans;
 }
 
-bool
-link_is_ptp(struct Link const *link)
+/* "rankN" -> N in *rank, returns false (leaving it as is) on failure */
+static inline bool
+field2rank(struct Field const *field, int *rank)
 {
-  assert(link && link->type);
-  return !strcasecmp(link->type, "ptp");
+  int ans = 0;
+  size_t i = 4;
+  if (field->len > 4 && !memcmp(field->str, "rank", 4)) {
+    for (; i < field->len; i++) {
+      unsigned d = (unsigned)(field->str[i] - '0');
+      if (d > 9 || ans > (INT_MAX - (int)d) / 10)
+        break;
+      ans = ans * 10 + (int)d;
+    }
+  }
+  if (i == 4)
+    return false;
+  *rank = ans;
+  return true;
 }
 
-bool
-link_is_1tn(struct Link const *link)
+/* Same as above, but reports failures returning -1 */
+static inline int
+rank2int(struct Field const *field)
 {
-  assert(link && link->type);
-  return !strcasecmp(link->type, "1tn");
+  int ans = -1;
+  if (!field2rank(field, &ans))
+    LOG_ERROR("Couldn't get rank number from string: %.*s\n",
+        (int)field->len, field->str);
+  return ans;
 }
 
-bool
-link_is_nt1(struct Link const *link)
+static char const *
+field2str(struct Field const *field)
 {
-  assert(link && link->type);
-  return !strcasecmp(link->type, "nt1");
+  return intern_str(field->str, field->len);
 }
 
 /*
- * Comm routines
+ * Routine and link type classification
  */
 
-static void
-comm_del(struct ref const *ref)
-{
-  assert(ref);
-  struct Comm *comm = container_of(ref, struct Comm, ref);
-  if (comm->container)
-    free(comm->container);
-  /*
-   * These checks avoid some (not all) issues with circular references, which
-   * should not happen.
-   */
-  if (comm->match && comm->match->ref.count)
-    ref_dec(&(comm->match->ref));
-  else if (comm->match)
-    LOG_WARNING("Attempted to ref_dec state with ref.ct == 0\n");
-  free(comm);
+/* (ROUTINE_OTHER keeps its own name) */
+static char const *const routine_names[ROUTINE_COUNT] = {
+  [ROUTINE_OTHER]   = NULL,
+  [ROUTINE_RECV]    = "MPI_Recv",
+  [ROUTINE_WAIT]    = "MPI_Wait",
+  [ROUTINE_SEND]    = "MPI_Send",
+  [ROUTINE_SSEND]   = "MPI_Ssend",
+  [ROUTINE_ISEND]   = "MPI_Isend",
+  [ROUTINE_BSEND]   = "MPI_Bsend",
+  [ROUTINE_IBSEND]  = "MPI_Ibsend",
+  [ROUTINE_IRSEND]  = "MPI_Irsend",
+  [ROUTINE_ISSEND]  = "MPI_Issend",
+  [ROUTINE_SCATTER] = "MPI_Scatter",
+  [ROUTINE_GATHER]  = "MPI_Gather",
+};
+
+unsigned char const routine_flags[ROUTINE_COUNT] = {
+  [ROUTINE_OTHER]   = 0,
+  [ROUTINE_RECV]    = ROUTINE_IS_RECV,
+  [ROUTINE_WAIT]    = ROUTINE_IS_WAIT,
+  [ROUTINE_SEND]    = ROUTINE_IS_SEND,
+  [ROUTINE_SSEND]   = ROUTINE_IS_SEND,
+  [ROUTINE_ISEND]   = ROUTINE_IS_SEND | ROUTINE_IS_ASYNC,
+  [ROUTINE_BSEND]   = ROUTINE_IS_SEND | ROUTINE_IS_ASYNC,
+  [ROUTINE_IBSEND]  = ROUTINE_IS_SEND | ROUTINE_IS_ASYNC,
+  [ROUTINE_IRSEND]  = ROUTINE_IS_SEND | ROUTINE_IS_ASYNC,
+  [ROUTINE_ISSEND]  = ROUTINE_IS_SEND | ROUTINE_IS_ASYNC,
+  [ROUTINE_SCATTER] = ROUTINE_IS_1TN,
+  [ROUTINE_GATHER]  = ROUTINE_IS_NT1,
+};
+
+static enum Routine
+routine_code(struct Field const *field)
+{
+  /* Every known routine is MPI_* */
+  if (field->len < 5 || memcmp(field->str, "MPI_", 4))
+    return ROUTINE_OTHER;
+  for (int i = ROUTINE_OTHER + 1; i < ROUTINE_COUNT; i++)
+    if (field_is(field, routine_names[i], strlen(routine_names[i])))
+      return (enum Routine)i;
+  return ROUTINE_OTHER;
 }
 
-struct Comm *
-comm_new(struct State *match, char const *container, size_t bytes)
+enum Routine
+routine_from_name(char const *name)
 {
-  struct Comm *ans = calloc(1, sizeof(*ans));
-  if (!ans)
-    REPORT_AND_EXIT;
-  if (match) {
-    ans->ostart = match->start;
-    ans->oend = match->end;
-    ans->match = match;
-    ref_inc(&(ans->match->ref));
+  assert(name);
+  struct Field field = { name, strlen(name) };
+  return routine_code(&field);
+}
+
+static enum Link_type
+link_type(struct Field const *field)
+{
+  if (field->len == 3) {
+    if (!strncasecmp(field->str, "ptp", 3))
+      return LINK_PTP;
+    if (!strncasecmp(field->str, "1tn", 3))
+      return LINK_1TN;
+    if (!strncasecmp(field->str, "nt1", 3))
+      return LINK_NT1;
   }
-  ans->bytes = bytes;
-  if (container) {
-    ans->container = strdup(container);
-    if (!ans->container)
-      REPORT_AND_EXIT;
+  return LINK_OTHER;
+}
+
+enum Link_type
+link_type_from_name(char const *name)
+{
+  assert(name);
+  struct Field field = { name, strlen(name) };
+  return link_type(&field);
+}
+
+/*
+ * Link routines
+ */
+
+/* fields[0] is "Link" */
+static struct Link *
+link_from_fields(struct Arena *arena, struct Field const *fields, size_t n)
+{
+  /* Everything up to the send mark is mandatory */
+  if (n < 10)
+    CORRUPT_TRACE();
+  struct Link *ans = arena_alloc(arena, sizeof(*ans));
+  ans->container = field2str(fields + 1);
+  /* (fields[2] is LINK) */
+  ans->start = field2double(fields + 3);
+  ans->end = field2double(fields + 4);
+  /* (fields[5] is the duration) */
+  ans->type = link_type(fields + 6);
+  ans->from = rank2int(fields + 7);
+  ans->to = rank2int(fields + 8);
+  ans->mark = field2u64(fields + 9);
+  if (n < 11) {
+    LOG_ERROR("Failed to read byte count. Did you call pj_dump with -u?\n");
+    ans->bytes = 0;
+  } else {
+    ans->bytes = (size_t)field2u64(fields + 10);
   }
-  ans->ref.free = comm_del;
-  ans->ref.count = 1;
   return ans;
 }
 
-static void
-gcomm_del(struct ref const *ref)
-{
-  assert(ref);
-  struct Gcomm *gcomm = container_of(ref, struct Gcomm, ref);
-  if (gcomm->container)
-    free(gcomm->container);
-  if (gcomm->match) {
-    assert(gcomm->ostart && gcomm->oend);
-    for (size_t i = 0; i < gcomm->ranks; i++)
-      if (gcomm->match[i]) {
-        if (gcomm->match[i]->ref.count)
-          ref_dec(&(gcomm->match[i]->ref));
-        else
-          LOG_WARNING("Attempted to ref_dec state with ref.ct == 0\n");
-      }
-    free(gcomm->match);
-    free(gcomm->ostart);
-    free(gcomm->oend);
-  } else {
-    assert(!gcomm->ostart && !gcomm->oend);
+/*
+ * Comm routines
+ */
+
+struct Comm *
+comm_new(struct Arena *arena, struct Store const *store, struct Handle const
+    *match, char const *container, size_t bytes)
+{
+  struct Comm *ans = arena_alloc(arena, sizeof(*ans));
+  memset(ans, 0, sizeof(*ans));
+  ans->match.index = STORE_NONE;
+  if (match) {
+    ans->ostart = STORE_AT(store, *match, start);
+    ans->oend = STORE_AT(store, *match, end);
+    ans->match = *match;
   }
+  ans->bytes = bytes;
+  ans->container = container;
+  return ans;
 }
 
 struct Gcomm *
-gcomm_new(struct State **match, char const *container, size_t bytes,
-    size_t ranks)
+gcomm_new(struct Arena *arena, struct Store const *store, struct Handle
+    *match, char const *container, size_t bytes, size_t ranks)
 {
   assert(match);
-  struct Gcomm *ans = malloc(sizeof(*ans));
-  if (!ans)
-    REPORT_AND_EXIT;
-  if (container) {
-    ans->container = strdup(container);
-    if (!ans->container)
-      REPORT_AND_EXIT;
-  }
+  struct Gcomm *ans = arena_alloc(arena, sizeof(*ans));
+  ans->container = container;
   ans->match = match;
-  ans->ostart = calloc(ranks, sizeof(*(ans->ostart)));
-  ans->oend = calloc(ranks, sizeof(*(ans->oend)));
-  if (!(ans->ostart) || !(ans->oend))
-    REPORT_AND_EXIT;
+  ans->ostart = arena_alloc(arena, ranks * sizeof(*(ans->ostart)));
+  ans->oend = arena_alloc(arena, ranks * sizeof(*(ans->oend)));
   for (size_t i = 0; i < ranks; i++)
-    if (match[i]) {
-      ans->ostart[i] = match[i]->start;
-      ans->oend[i] = match[i]->end;
+    if (match[i].index != STORE_NONE) {
+      ans->ostart[i] = STORE_AT(store, match[i], start);
+      ans->oend[i] = STORE_AT(store, match[i], end);
+    } else {
+      ans->ostart[i] = ans->oend[i] = 0;
     }
   ans->ranks = ranks;
   ans->bytes = bytes;
-  ans->ref.free = gcomm_del;
-  ans->ref.count = 1;
   return ans;
 }
 
 bool
-compensated(struct State const *state, double ostart, double oend)
+compensated(struct Store const *store, struct Handle state, double ostart,
+    double oend)
 {
-  return (state->start != ostart || state->end != oend);
+  return (STORE_AT(store, state, start) != ostart ||
+      STORE_AT(store, state, end) != oend);
 }
 
 bool
-comm_compensated(struct Comm const *comm)
+comm_compensated(struct Store const *store, struct Comm const *comm)
 {
-  assert(comm && comm->match);
-  return compensated(comm->match, comm->ostart, comm->oend);
+  assert(comm && comm->match.index != STORE_NONE);
+  return compensated(store, comm->match, comm->ostart, comm->oend);
 }
 
 bool
-gcomm_compensated(struct Gcomm const *gcomm, size_t i)
+gcomm_compensated(struct Store const *store, struct Gcomm const *gcomm, size_t
+    i)
 {
-  assert(gcomm && gcomm->match && gcomm->match[i]);
-  return compensated(gcomm->match[i], gcomm->ostart[i],
+  assert(gcomm && gcomm->match && gcomm->match[i].index != STORE_NONE);
+  return compensated(store, gcomm->match[i], gcomm->ostart[i],
       gcomm->oend[i]);
 }
 
@@ -266,166 +371,242 @@ gcomm_compensated(struct Gcomm const *gcomm, size_t i)
  * State routines
  */
 
+/* Default mark (and complaints) for a state without one in the trace */
 static void
-state_del(struct ref const *ref)
+state_missing_mark(struct State *state)
 {
-  assert(ref);
-  struct State *state = container_of(ref, struct State, ref);
-  if (state_is_nt1(state) && !state_is_nt1s(state)) {
-    if (state->comm.g->ref.count)
-      ref_dec(&(state->comm.g->ref));
-    else
-      LOG_WARNING("Attempted to ref_dec state with ref.ct == 0\n");
-  } else if (state->comm.c && state->comm.c->ref.count) {
-    ref_dec(&(state->comm.c->ref));
-  } else if (state->comm.c) {
-    LOG_WARNING("Attempted to ref_dec state with ref.ct == 0\n");
+  state->mark = 0;
+  if (state_is_wait(state)) {
+    LOG_WARNING("No send mark for Wait. Did you use the correct version of "
+        "Akypuera? Did you call pj_dump with -u? MPI_Wait is currently "
+        "supported only for MPI_Isend (as opposed to waiting MPI_Irecv)\n");
+  } else if (state_is_send(state)) {
+    LOG_WARNING("No send mark for Send. Did you use the correct version of "
+        "Akypuera? Did you call pj_dump with -u?\n");
+  } else if (state_is_1tn(state) || state_is_nt1(state)) {
+    LOG_DEBUG("1-to-n/n-to-1 without mark (expected for the recvs only). Did "
+        "you use the correct version of Akypuera? Called pj_dump with -u?\n");
+    // FIXME find a better way to distinguish from the send scatter this
+    // early on (later on it can be inferred from the comm linkage but the
+    // file doing the linkage doesn't know if send/recv either w/o this
+    // (the issue is that a send scatter might legitimately have max mark)
+    state->mark = UINT64_MAX;
   }
-  if (state->routine)
-    free(state->routine);
-  free(state);
 }
 
-struct State *
-state_from_line(char *line)
-{
-  if (!line)
-    return NULL;
-  char tok[] = ", ";
-  char *token = strtok(line, tok);
-  if (!token || strcmp(token, "State"))
-    return NULL;
-  struct State *ans = malloc(sizeof(*ans));
-  if (!ans)
-    REPORT_AND_EXIT;
-  char *endptr;
-  errno = 0;
-  /* Rank */
-  GETTOKEN();
-  ans->rank = rank2int(token);
-  /* STATE */
-  SKIPTOKEN();
-  /* Start time */
-  GETTOKEN();
-  ans->start = strtod(token, &endptr);
-  ASSERTSTRTO();
-  /* End time */
-  GETTOKEN();
-  ans->end = strtod(token, &endptr);
-  ASSERTSTRTO();
-  /* Duration */
-  SKIPTOKEN();
-  /* Imbrication */
-  GETTOKEN();
-  ans->imbrication = (int)strtol(token, &endptr, 10);
-  ASSERTSTRTO();
-  /* Routine name */
-  GETTOKEN();
-  token[strcspn(token, "\n")] = 0;
-  ans->routine = strdup(token);
-  if (!ans->routine)
-    REPORT_AND_EXIT;
+/* fields[0] is "State" */
+static struct State *
+state_from_fields(struct Arena *arena, struct Field const *fields, size_t n)
+{
+  /* Everything up to the routine name is mandatory */
+  if (n < 8)
+    CORRUPT_TRACE();
+  struct State *ans = arena_alloc(arena, sizeof(*ans));
+  ans->rank = rank2int(fields + 1);
+  /* (fields[2] is STATE) */
+  ans->start = field2double(fields + 3);
+  ans->end = field2double(fields + 4);
+  /* (fields[5] is the duration) */
+  ans->imbrication = field2int(fields + 6);
+  ans->code = routine_code(fields + 7);
+  if (ans->code == ROUTINE_OTHER)
+    ans->routine = field2str(fields + 7);
+  else
+    ans->routine = routine_names[ans->code];
   /* Send mark (only relevant for the wait) */
-  token = strtok(NULL, tok);
-  if (!token) {
-    if (state_is_wait(ans)) {
-      LOG_WARNING("No send mark for Wait. Did you use the correct version of "
-          "Akypuera? Did you call pj_dump with -u? MPI_Wait is currently "
-          "supported only for MPI_Isend (as opposed to waiting MPI_Irecv)\n");
-    } else if (state_is_send(ans)) {
-      LOG_WARNING("No send mark for Send. Did you use the correct version of "
-          "Akypuera? Did you call pj_dump with -u?\n");
-    } else if (state_is_1tn(ans) || state_is_nt1(ans)) {
-      LOG_DEBUG("1-to-n/n-to-1 without mark (expected for the recvs only). Did "
-          "you use the correct version of Akypuera? Called pj_dump with -u?\n");
-      // FIXME find a better way to distinguish from the send scatter this
-      // early on (later on it can be inferred from the comm linkage but the
-      // file doing the linkage doesn't know if send/recv either w/o this
-      // (the issue is that a send scatter might legitimately have max mark)
-      ans->mark = UINT64_MAX;
-    }
-  } else {
-    ans->mark = (uint64_t)strtoull(token, &endptr, 10);
-    ASSERTSTRTO();
-  }
-  ans->ref.count = 1;
-  ans->ref.free = state_del;
+  if (n < 9)
+    state_missing_mark(ans);
+  else
+    ans->mark = field2u64(fields + 8);
   ans->comm.c = NULL;
   return ans;
 }
 
 struct State *
-state_cpy(struct State const *state)
+state_new(struct Arena *arena, int rank, double start, double end,
+    int imbrication, enum Routine code, char const *routine,
+    uint64_t const *mark)
 {
-  assert(state);
-  struct State *ans = malloc(sizeof(*ans));
-  if (!ans)
-    REPORT_AND_EXIT;
-  memcpy(ans, state, sizeof(*state));
-  if (state->routine) {
-    ans->routine = strdup(state->routine);
-    if (!ans->routine)
-      REPORT_AND_EXIT;
-  }
-  if (state->comm.c)
-    ref_inc(&(state->comm.c->ref));
-  ans->ref.count = 1;
+  assert(code == ROUTINE_OTHER || !routine ||
+      !strcmp(routine, routine_names[code]));
+  struct State *ans = arena_alloc(arena, sizeof(*ans));
+  ans->rank = rank;
+  ans->start = start;
+  ans->end = end;
+  ans->imbrication = imbrication;
+  ans->code = code;
+  ans->routine = code == ROUTINE_OTHER ? routine : routine_names[code];
+  if (mark)
+    ans->mark = *mark;
+  else
+    state_missing_mark(ans);
+  ans->comm.c = NULL;
+  return ans;
+}
+
+struct Link *
+link_new(struct Arena *arena, int from, int to, double start, double end,
+    enum Link_type type, char const *container, uint64_t mark, size_t bytes)
+{
+  struct Link *ans = arena_alloc(arena, sizeof(*ans));
+  ans->from = from;
+  ans->to = to;
+  ans->start = start;
+  ans->end = end;
+  ans->type = type;
+  ans->container = container;
+  ans->mark = mark;
+  ans->bytes = bytes;
   return ans;
 }
 
+enum Record
+event_from_line(struct Arena *arena, char const *line, size_t len,
+    struct State **state, struct Link **link)
+{
+  assert(line && state && link);
+  struct Field fields[MAX_FIELDS];
+  size_t n = tokenize(line, len, fields, MAX_FIELDS);
+  if (!n)
+    return RECORD_OTHER;
+  if (field_is(fields, "State", 5)) {
+    *state = state_from_fields(arena, fields, n);
+    return RECORD_STATE;
+  }
+  if (field_is(fields, "Link", 4)) {
+    *link = link_from_fields(arena, fields, n);
+    return RECORD_LINK;
+  }
+  return RECORD_OTHER;
+}
+
+enum Record
+event_scan_line(char const *line, size_t len, int *rank, bool *send,
+    uint64_t *mark, double *end)
+{
+  assert(line && rank && send && mark && end);
+  struct Field fields[MAX_FIELDS];
+  size_t n = tokenize(line, len, fields, 2);
+  if (n == 2 && field_is(fields, "State", 5) && field2rank(fields + 1, rank)) {
+    /*
+     * The routine is the last field, or the one before the send mark. Getting
+     * it from the end skips the timestamps, and a misread (a routine name of
+     * digits) only costs a reallocation later on.
+     */
+    struct Field routine = last_field(line, line + len);
+    if (routine.len && (unsigned)(routine.str[0] - '0') <= 9)
+      routine = last_field(line, routine.str);
+    *send = routine_flags[routine_code(&routine)] & ROUTINE_IS_SEND;
+    if (!*send)
+      return RECORD_STATE;
+    /* (the same fields as state_from_fields for the few Sends) */
+    n = tokenize(line, len, fields, 9);
+    *send = n >= 8 && routine_flags[routine_code(fields + 7)] &
+      ROUTINE_IS_SEND;
+    /* (a mark of up to 19 characters can't overflow) */
+    if (n < 9)
+      *mark = 0;
+    else if (fields[8].len <= 19 && (unsigned)(fields[8].str[0] - '0') <= 9)
+      *mark = field2u64(fields + 8);
+    else
+      *mark = UINT64_MAX;
+    return RECORD_STATE;
+  }
+  if (n && field_is(fields, "Link", 4) && tokenize(line, len, fields, 9) == 9 &&
+      field2rank(fields + 8, rank)) {
+    *send = false;
+    if (!field_to_double(fields + 4, end))
+      *end = -DBL_MAX;
+    return RECORD_LINK;
+  }
+  return RECORD_OTHER;
+}
+
 void
 state_print(struct State const *state)
 {
   assert(state);
-  if (state_is_send(state) || state_is_recv(state) || state_is_wait(state))
-    printf("State, rank%d, STATE, %.15f, %.15f, %.15f, %.15f, %s, %"PRIu64"\n",
-      state->rank, state->start, state->end, state->end - state->start,
-      (double)(state->imbrication), state->routine, state->mark);
-  else
-    printf("State, rank%d, STATE, %.15f, %.15f, %.15f, %.15f, %s\n",
-        state->rank, state->start, state->end, state->end - state->start,
-        (double)(state->imbrication), state->routine);
+  char *const line = output_reserve(EVENT_LINE_MAX_FIXED +
+      strlen(state->routine));
+  output_commit(state_format(line, state));
+}
+
+char *
+state_format(char *dst, struct State const *state)
+{
+  char *it = OUTPUT_FMT_LIT(dst, "State, rank");
+  it = output_fmt_int(it, state->rank);
+  it = OUTPUT_FMT_LIT(it, ", STATE, ");
+  it = output_fmt_fixed15(it, state->start);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_fixed15(it, state->end);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_fixed15(it, state->end - state->start);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_fixed15(it, (double)(state->imbrication));
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_str(it, state->routine);
+  if (state_is_send(state) || state_is_recv(state) || state_is_wait(state)) {
+    it = OUTPUT_FMT_LIT(it, ", ");
+    it = output_fmt_u64(it, state->mark);
+  }
+  *it++ = '\n';
+  return it;
 }
 
 void
-state_print_c_recv(struct State const *recv, struct State const *match)
+state_c_recv_link(struct State const *recv, struct State const *match,
+    struct Link *link)
 {
   assert(recv && match && match->comm.c);
-  printf("Link, %s, LINK, %.15f, %.15f, %.15f, PTP, rank%d, rank%d, %"PRIu64
-      ", %zu\n", match->comm.c->container, match->start, recv->end, recv->end -
-      match->start, match->rank, recv->rank, match->mark,
-      match->comm.c->bytes);
+  link->mark = match->mark;
+  link->start = match->start;
+  link->end = recv->end;
+  link->bytes = match->comm.c->bytes;
+  link->from = match->rank;
+  link->to = recv->rank;
+  link->type = LINK_PTP;
+  link->container = match->comm.c->container;
 }
 
-bool
-state_is_recv(struct State const *state)
+void
+state_print_c_recv(struct State const *recv, struct State const *match)
 {
-  assert(state && state->routine);
-  return !strcmp(state->routine, "MPI_Recv");
+  struct Link link;
+  state_c_recv_link(recv, match, &link);
+  link_print(&link);
 }
 
-bool
-state_is_wait(struct State const *state)
+void
+link_print(struct Link const *link)
 {
-  assert(state && state->routine);
-  return !strcmp(state->routine, "MPI_Wait");
+  assert(link);
+  char *const line = output_reserve(EVENT_LINE_MAX_FIXED + (link->container ?
+        strlen(link->container) : 0));
+  output_commit(link_format(line, link));
 }
 
-/* All routines that generate a PTP link by akypuera */
-bool
-state_is_send(struct State const *state)
+char *
+link_format(char *dst, struct Link const *link)
 {
-  assert(state && state->routine);
-  return (
-      !strcmp(state->routine, "MPI_Send")  ||
-      !strcmp(state->routine, "MPI_Ssend") ||
-      !strcmp(state->routine, "MPI_Isend") ||
-      !strcmp(state->routine, "MPI_Bsend") ||
-      !strcmp(state->routine, "MPI_Ibsend") ||
-      !strcmp(state->routine, "MPI_Irsend") ||
-      !strcmp(state->routine, "MPI_Issend") ||
-      !strcmp(state->routine, "MPI_Irsend")
-  );
+  char *it = OUTPUT_FMT_LIT(dst, "Link, ");
+  it = output_fmt_str(it, link->container);
+  it = OUTPUT_FMT_LIT(it, ", LINK, ");
+  it = output_fmt_fixed15(it, link->start);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_fixed15(it, link->end);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_fixed15(it, link->end - link->start);
+  it = OUTPUT_FMT_LIT(it, ", PTP, rank");
+  it = output_fmt_int(it, link->from);
+  it = OUTPUT_FMT_LIT(it, ", rank");
+  it = output_fmt_int(it, link->to);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_u64(it, link->mark);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_u64(it, (uint64_t)(link->bytes));
+  *it++ = '\n';
+  return it;
 }
 
 bool
@@ -434,9 +615,8 @@ state_is_local(struct State const *state, size_t sync_size)
   if (state_is_recv(state) || state_is_wait(state)) {
     return false;
   } else if (state_is_send(state)) {
-    assert(strlen(state->routine) > 5);
     /* Assumes there are enough resources in buffered mode */
-    if (state->routine[4] == 'I' || state->routine[4] == 'B')
+    if (routine_flags[state->code] & ROUTINE_IS_ASYNC)
       return true;
     return ! comm_is_sync(state->comm.c, sync_size);
   } else if (state_is_1tn(state)) {
@@ -456,20 +636,6 @@ state_is_local(struct State const *state, size_t sync_size)
   }
 }
 
-bool
-state_is_1tn(struct State const *state)
-{
-  assert(state && state->routine);
-  return !(strcmp(state->routine, "MPI_Scatter"));
-}
-
-bool
-state_is_nt1(struct State const *state)
-{
-  assert(state && state->routine);
-  return !(strcmp(state->routine, "MPI_Gather"));
-}
-
 bool
 state_is_1tns(struct State const *state)
 {
@@ -479,7 +645,7 @@ state_is_1tns(struct State const *state)
     LOG_DEBUG("no comm");
     return state->mark != UINT64_MAX;
   } else {
-    return (state_is_1tn(state) && !(state->comm.c->match));
+    return (state_is_1tn(state) && state->comm.c->match.index == STORE_NONE);
   }
 }
 
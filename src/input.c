@@ -0,0 +1,329 @@
+/* See the header file for contracts and more docs */
+/* madvise, pread */
+#define _DEFAULT_SOURCE
+#include "input.h"
+#include "logging.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <signal.h>
+
+/* Give consumed pages back to the kernel every RELEASE_WINDOW bytes */
+#define RELEASE_WINDOW ((size_t)4 << 20)
+
+/* Compressed formats we know of, by magic number */
+static struct Decompressor {
+  unsigned char magic[4];
+  size_t len;
+  char const *prog;
+} const decompressors[] = {
+  { { 0x1f, 0x8b }, 2, "gzip" },
+  { { 0x28, 0xb5, 0x2f, 0xfd }, 4, "zstd" },
+};
+
+/*
+ * The decompressor for a file starting with the len bytes at head, NULL if
+ * it isn't compressed. If len is short of a magic number, only the first len
+ * bytes are compared (streams can only be peeked at one byte, neither magic
+ * starts with a byte that can begin a text trace).
+ */
+static struct Decompressor const *
+decompressor(unsigned char const *head, size_t len)
+{
+  size_t n = sizeof(decompressors) / sizeof(*decompressors);
+  for (size_t i = 0; i < n; i++) {
+    size_t cmp = len < decompressors[i].len ? len : decompressors[i].len;
+    if (cmp && !memcmp(head, decompressors[i].magic, cmp))
+      return decompressors + i;
+  }
+  return NULL;
+}
+
+static int
+set_cloexec(int fd)
+{
+  int flags = fcntl(fd, F_GETFD);
+  return flags == -1 ? -1 : fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+}
+
+/* Copy in->src into in->sink, the child's stdin */
+static void *
+input_feed(void *arg)
+{
+  struct Input *in = arg;
+  /* A dead child is reported once its output ends, not by SIGPIPE */
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGPIPE);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  char buff[1 << 16];
+  size_t n;
+  while ((n = fread(buff, 1, sizeof(buff), in->src))) {
+    for (size_t off = 0; off < n;) {
+      ssize_t rc = write(in->sink, buff + off, n - off);
+      if (rc == -1 && errno == EINTR)
+        continue;
+      if (rc == -1)
+        goto out;
+      off += (size_t)rc;
+    }
+  }
+  if (ferror(in->src))
+    LOG_ERROR("Could not read the compressed trace: %s\n", strerror(errno));
+out:
+  close(in->sink);
+  return NULL;
+}
+
+/*
+ * Run d->prog -dc with its stdin on src (closing it) and read its stdout from
+ * in->f. If stream isn't NULL, src is ignored and a feeder thread copies
+ * stream into the child instead. Returns 0 on success, -1 on failure, in which
+ * case it also sets errno.
+ */
+static int
+input_spawn(struct Input *in, struct Decompressor const *d, int src,
+    FILE *stream)
+{
+  int out[2],
+      inp[2] = { -1, -1 };
+  if (pipe(out))
+    return -1;
+  if (stream) {
+    if (pipe(inp)) {
+      int err = errno;
+      close(out[0]);
+      close(out[1]);
+      errno = err;
+      return -1;
+    }
+    src = inp[0];
+  }
+  /* So that the child holds none of our pipe ends */
+  if (set_cloexec(out[0]) || (stream && set_cloexec(inp[1])))
+    goto fail;
+  pid_t pid = fork();
+  if (pid == -1)
+    goto fail;
+  if (!pid) {
+    if (dup2(src, STDIN_FILENO) == -1 || dup2(out[1], STDOUT_FILENO) == -1)
+      _exit(127);
+    execlp(d->prog, d->prog, "-dc", (char *)NULL);
+    _exit(127);
+  }
+  close(src);
+  close(out[1]);
+  in->child = pid;
+  in->prog = d->prog;
+  in->f = fdopen(out[0], "r");
+  if (!in->f)
+    REPORT_AND_EXIT;
+  if (stream) {
+    in->src = stream;
+    in->sink = inp[1];
+    if ((errno = pthread_create(&(in->feeder), NULL, input_feed, in)))
+      REPORT_AND_EXIT;
+    in->feeding = true;
+  }
+  return 0;
+fail:;
+  int err = errno;
+  close(out[0]);
+  close(out[1]);
+  if (stream) {
+    close(inp[0]);
+    close(inp[1]);
+  }
+  errno = err;
+  return -1;
+}
+
+/*
+ * Wait for the decompressor (and feeder). If check, abort if it failed,
+ * since the trace would be truncated.
+ */
+static void
+input_reap(struct Input *in, bool check)
+{
+  if (in->feeding) {
+    pthread_join(in->feeder, NULL);
+    in->feeding = false;
+  }
+  int status = 0;
+  while (waitpid(in->child, &status, 0) == -1)
+    if (errno != EINTR)
+      REPORT_AND_EXIT;
+  in->child = 0;
+  if (check && (!WIFEXITED(status) || WEXITSTATUS(status)))
+    LOG_AND_EXIT("Could not decompress the trace (%s -dc failed)\n",
+        in->prog);
+}
+
+int
+input_open(struct Input *in, char const *filename)
+{
+  memset(in, 0, sizeof(*in));
+  int fd = strcmp(filename, "-") ? open(filename, O_RDONLY) : STDIN_FILENO;
+  if (fd == -1)
+    return -1;
+  struct stat sb;
+  if (fstat(fd, &sb) == -1) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  if (S_ISREG(sb.st_mode) && sb.st_size > 0) {
+    unsigned char head[4];
+    ssize_t rc = pread(fd, head, sizeof(head), 0);
+    struct Decompressor const *d = rc > 0 ? decompressor(head, (size_t)rc) :
+      NULL;
+    if (d && lseek(fd, 0, SEEK_SET) == 0 && !input_spawn(in, d, fd, NULL))
+      return 0;
+    if (d) {
+      int err = errno;
+      close(fd);
+      errno = err;
+      return -1;
+    }
+    void *map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      /* Not fatal, just a hint */
+      if (madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL))
+        LOG_DEBUG("madvise: %s\n", strerror(errno));
+      in->map = map;
+      in->size = (size_t)sb.st_size;
+      close(fd);
+      return 0;
+    }
+    LOG_DEBUG("Could not mmap %s, falling back to getline: %s\n", filename,
+        strerror(errno));
+  }
+  FILE *f = fdopen(fd, "r");
+  if (!f) {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  /* Peek at the first byte to tell compressed streams apart */
+  int c = getc(f);
+  if (c != EOF && ungetc(c, f) == EOF)
+    REPORT_AND_EXIT;
+  unsigned char head = (unsigned char)c;
+  struct Decompressor const *d = c != EOF ? decompressor(&head, 1) : NULL;
+  if (d) {
+    if (input_spawn(in, d, -1, f)) {
+      int err = errno;
+      fclose(f);
+      errno = err;
+      return -1;
+    }
+    return 0;
+  }
+  in->f = f;
+  return 0;
+}
+
+/* Drop the pages that lie entirely before pos */
+static void
+input_release(struct Input *in, size_t pos)
+{
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  size_t end = pos - pos % page;
+  if (end <= in->released)
+    return;
+  if (madvise((char *)in->map + in->released, end - in->released,
+        MADV_DONTNEED))
+    LOG_DEBUG("madvise: %s\n", strerror(errno));
+  in->released = end;
+}
+
+char const *
+input_next(struct Input *in, size_t *len)
+{
+  if (!in->map) {
+    if (in->unget) {
+      in->unget = false;
+      *len = in->last;
+      return in->buff;
+    }
+    errno = 0;
+    ssize_t rc = getline(&(in->buff), &(in->cap), in->f);
+    if (rc == -1) {
+      if (errno)
+        REPORT_AND_EXIT;
+      if (in->child)
+        input_reap(in, true);
+      return NULL;
+    }
+    *len = in->last = (size_t)rc;
+    return in->buff;
+  }
+  if (in->pos >= in->size)
+    return NULL;
+  if (in->pos - in->released >= RELEASE_WINDOW)
+    input_release(in, in->pos);
+  char const *line = in->map + in->pos;
+  char const *nl = memchr(line, '\n', in->size - in->pos);
+  *len = nl ? (size_t)(nl - line) + 1 : in->size - in->pos;
+  in->pos += *len;
+  in->last = *len;
+  return line;
+}
+
+void
+input_unget(struct Input *in)
+{
+  assert(!in->unget);
+  if (in->map) {
+    assert(in->last <= in->pos);
+    in->pos -= in->last;
+    in->last = 0;
+  } else {
+    in->unget = true;
+  }
+}
+
+void
+input_consume(struct Input *in, size_t pos)
+{
+  assert(in->map && pos >= in->pos && pos <= in->size);
+  in->pos = pos;
+  input_release(in, pos);
+}
+
+void
+input_drop(struct Input const *in, size_t begin, size_t end)
+{
+  assert(in->map && begin <= end && end <= in->size);
+  size_t page = (size_t)sysconf(_SC_PAGESIZE);
+  begin += (page - begin % page) % page;
+  end -= end % page;
+  if (begin < end && madvise((char *)in->map + begin, end - begin,
+        MADV_DONTNEED))
+    LOG_DEBUG("madvise: %s\n", strerror(errno));
+}
+
+void
+input_close(struct Input *in)
+{
+  if (in->map)
+    munmap((void *)in->map, in->size);
+  if (in->f)
+    fclose(in->f);
+  /* (if the output wasn't read to the end, the child dies of SIGPIPE) */
+  if (in->child)
+    input_reap(in, false);
+  if (in->src)
+    fclose(in->src);
+  free(in->buff);
+  memset(in, 0, sizeof(*in));
+}
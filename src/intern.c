@@ -0,0 +1,83 @@
+/* See the header file for contracts and more docs */
+/* logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "intern.h"
+#include "arena.h"
+#include "logging.h"
+#include "uthash.h"
+#include <string.h>
+#include <pthread.h>
+
+struct Intern_string {
+  UT_hash_handle hh;
+  char str[];
+};
+
+static struct Intern {
+  pthread_mutex_t lock;
+  struct Intern_string *table;
+  /* Where the strings (with their hash handles) live */
+  struct Arena arena;
+  /* Bumped by intern_release, so that no thread trusts its cache after it */
+  unsigned generation;
+} s = { PTHREAD_MUTEX_INITIALIZER, NULL, { NULL, NULL, NULL }, 0 };
+
+/*
+ * The strings each thread looked up recently, by hash. The same few routine
+ * names and containers come back on every line, so most lookups end here,
+ * without taking the lock. The interned copies never move, so a slot only
+ * goes stale when they are all freed (see generation).
+ */
+#define CACHE_SLOTS 64
+
+static __thread struct Intern_cache {
+  unsigned generation;
+  struct {
+    char const *str;
+    size_t len;
+  } slot[CACHE_SLOTS];
+} cache;
+
+char const *
+intern_str(char const *str, size_t len)
+{
+  unsigned hash;
+  HASH_VALUE(str, len, hash);
+  if (cache.generation != s.generation) {
+    memset(&cache, 0, sizeof(cache));
+    cache.generation = s.generation;
+  }
+  size_t i = hash % CACHE_SLOTS;
+  if (cache.slot[i].str && cache.slot[i].len == len &&
+      !memcmp(cache.slot[i].str, str, len))
+    return cache.slot[i].str;
+  pthread_mutex_lock(&(s.lock));
+  struct Intern_string *e = NULL;
+  HASH_FIND(hh, s.table, str, len, e);
+  if (!e) {
+    e = arena_alloc(&(s.arena), sizeof(*e) + len + 1);
+    memcpy(e->str, str, len);
+    e->str[len] = 0;
+    HASH_ADD_KEYPTR(hh, s.table, e->str, len, e);
+  }
+  pthread_mutex_unlock(&(s.lock));
+  cache.slot[i].str = e->str;
+  cache.slot[i].len = len;
+  return e->str;
+}
+
+char const *
+intern_cstr(char const *str)
+{
+  return str ? intern_str(str, strlen(str)) : NULL;
+}
+
+void
+intern_release(void)
+{
+  pthread_mutex_lock(&(s.lock));
+  HASH_CLEAR(hh, s.table);
+  arena_release(&(s.arena));
+  s.generation++;
+  pthread_mutex_unlock(&(s.lock));
+}
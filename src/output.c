@@ -0,0 +1,369 @@
+/* See the header file for contracts and more docs */
+/* For logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "output.h"
+#include "logging.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define OUTPUT_BUFFER ((size_t)1 << 20)
+/* Buffers in flight between us and the writer thread, see output_async */
+#define OUTPUT_BUFFERS 4
+
+__extension__ typedef unsigned __int128 u128;
+
+/*
+ * Ring of buffers. We fill slot tail % OUTPUT_BUFFERS (buff, len and cap are
+ * its fields, cached) and the writer thread drains the slots before it, in
+ * order. There is a single producer and a single consumer, each owning its
+ * index, so no lock is needed: the semaphores only count the filled and free
+ * slots, for either side to sleep on (and order the accesses to the slots).
+ * In sync mode only the first slot is used.
+ */
+struct Output_slot {
+  char *data;
+  size_t len,
+         cap;
+};
+
+static struct Output_slot slots[OUTPUT_BUFFERS];
+static size_t tail = 0;
+static char *buff = NULL;
+static size_t len = 0,
+              cap = 0;
+
+static bool async = false;
+static pthread_t writer;
+static sem_t filled,
+             freed;
+/* errno of a failed write in the writer thread, 0 if none */
+static int failed = 0;
+/* Writer thread sentinel */
+#define SLOT_END SIZE_MAX
+
+/* Returns 0 on success, -1 on failure, in which case it also sets errno */
+static int
+write_all(char const *data, size_t n)
+{
+  while (n) {
+    ssize_t rc = write(STDOUT_FILENO, data, n);
+    if (rc == -1 && errno == EINTR)
+      continue;
+    if (rc == -1)
+      return -1;
+    data += rc;
+    n -= (size_t)rc;
+  }
+  return 0;
+}
+
+static void
+sem_wait_nointr(sem_t *sem)
+{
+  while (sem_wait(sem))
+    if (errno != EINTR)
+      REPORT_AND_EXIT;
+}
+
+static void *
+output_writer(void *arg)
+{
+  (void)arg;
+  for (size_t head = 0;; head++) {
+    sem_wait_nointr(&filled);
+    struct Output_slot const *slot = slots + head % OUTPUT_BUFFERS;
+    if (slot->len == SLOT_END)
+      return NULL;
+    /* (after a failure, keep draining so that we never block the producer) */
+    if (!__atomic_load_n(&failed, __ATOMIC_RELAXED) &&
+        write_all(slot->data, slot->len))
+      __atomic_store_n(&failed, errno, __ATOMIC_RELEASE);
+    if (sem_post(&freed))
+      REPORT_AND_EXIT;
+  }
+}
+
+static inline void
+check_writer(void)
+{
+  int err = __atomic_load_n(&failed, __ATOMIC_ACQUIRE);
+  if (err) {
+    /* (so that output_close, at exit, doesn't wait on the writer) */
+    async = false;
+    len = 0;
+    errno = err;
+    REPORT_AND_EXIT;
+  }
+}
+
+/* Hand the slot being filled (with slot_len bytes) to the writer thread */
+static void
+submit(size_t slot_len)
+{
+  struct Output_slot *slot = slots + tail % OUTPUT_BUFFERS;
+  slot->data = buff;
+  slot->cap = cap;
+  slot->len = slot_len;
+  tail++;
+  if (sem_post(&filled))
+    REPORT_AND_EXIT;
+}
+
+/* Move on to the next slot, once the writer is done with it */
+static void
+next_slot(void)
+{
+  sem_wait_nointr(&freed);
+  check_writer();
+  struct Output_slot *slot = slots + tail % OUTPUT_BUFFERS;
+  if (!slot->data) {
+    slot->data = malloc(OUTPUT_BUFFER);
+    if (!slot->data)
+      REPORT_AND_EXIT;
+    slot->cap = OUTPUT_BUFFER;
+  }
+  buff = slot->data;
+  cap = slot->cap;
+  len = 0;
+}
+
+void
+output_flush(void)
+{
+  if (!len)
+    return;
+  if (async) {
+    submit(len);
+    next_slot();
+  } else {
+    if (write_all(buff, len))
+      REPORT_AND_EXIT;
+    len = 0;
+  }
+}
+
+void
+output_close(void)
+{
+  /* (exit called by the writer thread itself, nothing we can do) */
+  if (async && pthread_equal(pthread_self(), writer))
+    return;
+  if (!async) {
+    output_flush();
+    return;
+  }
+  if (len) {
+    submit(len);
+    sem_wait_nointr(&freed);
+  }
+  /* The slot at tail is ours, the sentinel goes there */
+  struct Output_slot *last = slots + tail % OUTPUT_BUFFERS;
+  last->len = SLOT_END;
+  tail++;
+  if (sem_post(&filled))
+    REPORT_AND_EXIT;
+  if ((errno = pthread_join(writer, NULL)))
+    REPORT_AND_EXIT;
+  async = false;
+  sem_destroy(&filled);
+  sem_destroy(&freed);
+  check_writer();
+  /* Anything else is written synchronously, from a single buffer */
+  struct Output_slot keep = { NULL, 0, 0 };
+  for (size_t i = 0; i < OUTPUT_BUFFERS; i++) {
+    if (!keep.data)
+      keep = slots[i];
+    else
+      free(slots[i].data);
+  }
+  memset(slots, 0, sizeof(slots));
+  slots[0] = keep;
+  slots[0].len = 0;
+  tail = 0;
+  buff = keep.data;
+  cap = keep.cap;
+  len = 0;
+}
+
+/* Allocate the first buffer */
+static void
+output_init(size_t n)
+{
+  static bool registered = false;
+  cap = n > OUTPUT_BUFFER ? n : OUTPUT_BUFFER;
+  buff = malloc(cap);
+  if (!buff)
+    REPORT_AND_EXIT;
+  slots[0].data = buff;
+  slots[0].cap = cap;
+  /* Whatever is buffered when we exit (even on failure) is written */
+  if (!registered && atexit(output_close))
+    REPORT_AND_EXIT;
+  registered = true;
+}
+
+void
+output_async(void)
+{
+  assert(!async);
+  if (!buff)
+    output_init(OUTPUT_BUFFER);
+  /* (we hold one slot, the one being filled) */
+  if (sem_init(&filled, 0, 0) || sem_init(&freed, 0, OUTPUT_BUFFERS - 1))
+    REPORT_AND_EXIT;
+  if ((errno = pthread_create(&writer, NULL, output_writer, NULL)))
+    REPORT_AND_EXIT;
+  async = true;
+}
+
+char *
+output_reserve(size_t n)
+{
+  if (!buff)
+    output_init(n);
+  if (cap - len < n) {
+    output_flush();
+    if (cap < n) {
+      cap = n;
+      buff = realloc(buff, cap);
+      if (!buff)
+        REPORT_AND_EXIT;
+      slots[tail % OUTPUT_BUFFERS].data = buff;
+      slots[tail % OUTPUT_BUFFERS].cap = cap;
+    }
+  }
+  return buff + len;
+}
+
+void
+output_commit(char const *end)
+{
+  assert(end >= buff + len && end <= buff + cap);
+  len = (size_t)(end - buff);
+}
+
+void
+output_write(void const *data, size_t n)
+{
+  if (!async && n >= OUTPUT_BUFFER / 2) {
+    output_flush();
+    if (write_all(data, n))
+      REPORT_AND_EXIT;
+    return;
+  }
+  /* (through the buffers, the writer thread owns stdout) */
+  char const *src = data;
+  while (n) {
+    size_t chunk = n < OUTPUT_BUFFER ? n : OUTPUT_BUFFER;
+    char *dst = output_reserve(chunk);
+    memcpy(dst, src, chunk);
+    output_commit(dst + chunk);
+    src += chunk;
+    n -= chunk;
+  }
+}
+
+/*
+ * Formatting
+ */
+
+/* Write the decimal digits of x backwards, ending at end */
+static char *
+digits_backwards(char *end, uint64_t x)
+{
+  do {
+    *--end = (char)('0' + x % 10);
+    x /= 10;
+  } while (x);
+  return end;
+}
+
+char *
+output_fmt_u64(char *dst, uint64_t x)
+{
+  char tmp[20];
+  char *begin = digits_backwards(tmp + sizeof(tmp), x);
+  size_t n = (size_t)(tmp + sizeof(tmp) - begin);
+  memcpy(dst, begin, n);
+  return dst + n;
+}
+
+char *
+output_fmt_int(char *dst, int x)
+{
+  if (x < 0) {
+    *dst++ = '-';
+    return output_fmt_u64(dst, (uint64_t)(-(int64_t)x));
+  }
+  return output_fmt_u64(dst, (uint64_t)x);
+}
+
+#define E15 1000000000000000ULL
+
+/*
+ * x = m * 2^e exactly (m < 2^53), so x * 10^15 = m * 10^15 * 2^e, where
+ * m * 10^15 < 2^103. For e >= 0 that is an integer (up to e = 24 it fits in
+ * 128 bits), otherwise the shift discards bits that tell exactly whether the
+ * result is below, at, or above the halfway point, so we can round to nearest,
+ * ties to even, as printf does in the default rounding mode. Values that don't
+ * fit (|x| >= 2^77) or are not finite are left to snprintf. The fields are
+ * taken from the bits (we build with -ffinite-math-only, so no isfinite).
+ */
+char *
+output_fmt_fixed15(char *dst, double x)
+{
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  int biased = (int)((bits >> 52) & 0x7ff);
+  uint64_t m = bits & ((UINT64_C(1) << 52) - 1);
+  int e = biased ? biased - 1075 : -1074;
+  if (biased)
+    m |= UINT64_C(1) << 52;
+  if (biased == 0x7ff || e > 24)
+    return dst + snprintf(dst, OUTPUT_NUMBER_MAX, "%.15f", x);
+  /* (-0.0 and tiny negatives are printed as -0.000...) */
+  if (bits >> 63)
+    *dst++ = '-';
+  u128 q;
+  if (e >= 0) {
+    q = ((u128)m * E15) << e;
+  } else if (e <= -128) {
+    /* x * 10^15 < 2^103 * 2^-128, rounds to 0 */
+    q = 0;
+  } else {
+    u128 w = (u128)m * E15;
+    int s = -e;
+    q = w >> s;
+    u128 rem = w - (q << s),
+         half = (u128)1 << (s - 1);
+    if (rem > half || (rem == half && (q & 1)))
+      q++;
+  }
+  uint64_t ipart_lo = (uint64_t)(q / E15 % E15),
+           ipart_hi = (uint64_t)(q / E15 / E15),
+           fpart = (uint64_t)(q % E15);
+  /* Integer part, q / 10^15 < 2^77 / 10^15 * 10^15 < 10^30 */
+  if (ipart_hi) {
+    dst = output_fmt_u64(dst, ipart_hi);
+    char *end = dst + 15;
+    char *begin = digits_backwards(end, ipart_lo);
+    while (begin > dst)
+      *--begin = '0';
+    dst = end;
+  } else {
+    dst = output_fmt_u64(dst, ipart_lo);
+  }
+  *dst++ = '.';
+  char *end = dst + 15;
+  char *begin = digits_backwards(end, fpart);
+  while (begin > dst)
+    *--begin = '0';
+  return end;
+}
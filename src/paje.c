@@ -0,0 +1,1746 @@
+/* See the header file for contracts and more docs */
+/* strdup, strndup, logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "paje.h"
+#include "events.h"
+#include "intern.h"
+#include "input.h"
+#include "decimal.h"
+#include "logging.h"
+#include "output.h"
+#include "binout.h"
+#include "uthash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <limits.h>
+#include <float.h>
+
+#define CORRUPT_PAJE(lineno) LOG_AND_EXIT("Corrupt Pajé trace at line %zu\n",\
+    (lineno))
+
+/* Events we handle, everything else is ignored */
+enum Paje_event {
+  PAJE_IGNORED,
+  PAJE_CREATE_CONTAINER,
+  PAJE_DESTROY_CONTAINER,
+  PAJE_SET_STATE,
+  PAJE_PUSH_STATE,
+  PAJE_POP_STATE,
+  PAJE_RESET_STATE,
+  PAJE_START_LINK,
+  PAJE_END_LINK,
+  PAJE_DEFINE_VALUE
+};
+
+static char const *const event_names[] = {
+  [PAJE_IGNORED]           = NULL,
+  [PAJE_CREATE_CONTAINER]  = "PajeCreateContainer",
+  [PAJE_DESTROY_CONTAINER] = "PajeDestroyContainer",
+  [PAJE_SET_STATE]         = "PajeSetState",
+  [PAJE_PUSH_STATE]        = "PajePushState",
+  [PAJE_POP_STATE]         = "PajePopState",
+  [PAJE_RESET_STATE]       = "PajeResetState",
+  [PAJE_START_LINK]        = "PajeStartLink",
+  [PAJE_END_LINK]          = "PajeEndLink",
+  [PAJE_DEFINE_VALUE]      = "PajeDefineEntityValue",
+};
+
+/* Fields we use */
+enum Paje_field {
+  FIELD_TIME,
+  FIELD_CONTAINER,
+  FIELD_TYPE,
+  FIELD_VALUE,
+  FIELD_START_CONTAINER,
+  FIELD_END_CONTAINER,
+  FIELD_KEY,
+  FIELD_SIZE,
+  FIELD_MARK,
+  FIELD_ALIAS,
+  FIELD_NAME,
+  FIELD_COUNT
+};
+
+static char const *const field_names[FIELD_COUNT] = {
+  [FIELD_TIME]            = "Time",
+  [FIELD_CONTAINER]       = "Container",
+  [FIELD_TYPE]            = "Type",
+  [FIELD_VALUE]           = "Value",
+  [FIELD_START_CONTAINER] = "StartContainer",
+  [FIELD_END_CONTAINER]   = "EndContainer",
+  [FIELD_KEY]             = "Key",
+  [FIELD_SIZE]            = "Size",
+  [FIELD_MARK]            = "Mark",
+  [FIELD_ALIAS]           = "Alias",
+  [FIELD_NAME]            = "Name",
+};
+
+/* The decoder for one event id: where each field is in its lines */
+struct Paje_def {
+  enum Paje_event event;
+  /* -1 if the event has no such field */
+  int pos[FIELD_COUNT];
+  int nfields;
+};
+
+/* Plenty, the Pajé format doesn't have that many fields per event */
+#define MAX_FIELDS 32
+/* Sanity limit on event ids, which index the decoder table */
+#define MAX_EVENT_ID 65536
+
+struct Token {
+  char const *str;
+  size_t len;
+};
+
+/* Entity values may be referred to by alias, pj_dump prints their names */
+struct Paje_value {
+  char *alias,
+       *name;
+  UT_hash_handle hh;
+};
+
+/* A state that was pushed but not popped yet */
+struct Paje_open {
+  double start;
+  char *value;
+  bool has_mark;
+  uint64_t mark;
+};
+
+struct Paje_container {
+  /* Alias (or name, if there is no alias), what events refer to */
+  char *id;
+  char *name,
+       *parent,
+       *type;
+  double start;
+  bool destroyed;
+  /* -1 if the name is not rankN */
+  int rank;
+  struct Paje_open *stack;
+  size_t depth,
+         cap;
+  UT_hash_handle hh;
+};
+
+/* A link waiting for its other half */
+struct Paje_link {
+  char *key;
+  bool started,
+       ended,
+       has_mark;
+  double start,
+         end;
+  int from,
+      to;
+  char *container,
+       *value;
+  uint64_t mark;
+  size_t bytes;
+  UT_hash_handle hh;
+};
+
+/* States and Links read so far, with their order of completion */
+struct Paje_item {
+  double start;
+  size_t seq;
+  void *event;
+};
+
+struct Paje {
+  struct Paje_def *defs;
+  size_t ndefs;
+  struct Paje_container *containers;
+  struct Paje_link *links;
+  struct Paje_value *values;
+  struct Paje_item *states_out,
+                   *links_out;
+  size_t nstates,
+         states_cap,
+         nlinks,
+         links_cap;
+  size_t lineno;
+  /* Where the events go */
+  struct Arena *arena;
+  /* Currently inside an %EventDef */
+  struct Paje_def *def;
+};
+
+/*
+ * Tokenizing
+ */
+
+static inline bool
+is_space(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+/* Split a line on whitespace, "quoted strings" being a single token */
+static int
+tokenize(char const *line, size_t len, struct Token *tokens)
+{
+  char const *it = line,
+             *end = line + len;
+  char const *nl = memchr(line, '\n', len);
+  if (nl)
+    end = nl;
+  int n = 0;
+  while (n < MAX_FIELDS) {
+    while (it < end && is_space(*it))
+      it++;
+    if (it == end)
+      break;
+    if (*it == '"') {
+      tokens[n].str = ++it;
+      while (it < end && *it != '"')
+        it++;
+      tokens[n].len = (size_t)(it - tokens[n].str);
+      if (it < end)
+        it++;
+    } else {
+      tokens[n].str = it;
+      while (it < end && !is_space(*it))
+        it++;
+      tokens[n].len = (size_t)(it - tokens[n].str);
+    }
+    n++;
+  }
+  return n;
+}
+
+static inline bool
+token_is(struct Token const *token, char const *str)
+{
+  return token->len == strlen(str) && !memcmp(token->str, str, token->len);
+}
+
+static char *
+token2str(struct Token const *token)
+{
+  char *ans = strndup(token->str, token->len);
+  if (!ans)
+    REPORT_AND_EXIT;
+  return ans;
+}
+
+static double
+token2double(struct Paje const *p, struct Token const *token)
+{
+  double ans;
+  if (decimal_to_double(token->str, token->len, &ans))
+    return ans;
+  char buff[64];
+  if (token->len >= sizeof(buff))
+    CORRUPT_PAJE(p->lineno);
+  memcpy(buff, token->str, token->len);
+  buff[token->len] = 0;
+  char *endptr;
+  errno = 0;
+  ans = strtod(buff, &endptr);
+  if (errno || endptr == buff)
+    CORRUPT_PAJE(p->lineno);
+  return ans;
+}
+
+/* Leading digits of token, false if there are none */
+static bool
+token2u64(struct Token const *token, uint64_t *ans)
+{
+  uint64_t val = 0;
+  size_t i = 0;
+  for (; i < token->len; i++) {
+    unsigned d = (unsigned)(token->str[i] - '0');
+    if (d > 9 || val > (UINT64_MAX - d) / 10)
+      break;
+    val = val * 10 + d;
+  }
+  if (i)
+    *ans = val;
+  return i;
+}
+
+/* "rankN" -> N, -1 if name is something else */
+static int
+name2rank(char const *name)
+{
+  if (strncmp(name, "rank", 4) || !name[4])
+    return -1;
+  long ans = 0;
+  for (char const *it = name + 4; *it; it++) {
+    if (*it < '0' || *it > '9' || ans > INT_MAX / 10)
+      return -1;
+    ans = ans * 10 + (*it - '0');
+  }
+  return ans > INT_MAX ? -1 : (int)ans;
+}
+
+/*
+ * Header
+ */
+
+static void
+header_line(struct Paje *p, char const *line, size_t len)
+{
+  struct Token tokens[MAX_FIELDS];
+  /* (skip the %) */
+  int n = tokenize(line + 1, len - 1, tokens);
+  if (n >= 3 && token_is(tokens, "EventDef")) {
+    if (p->def)
+      CORRUPT_PAJE(p->lineno);
+    uint64_t id;
+    if (!token2u64(tokens + 2, &id) || id >= MAX_EVENT_ID)
+      CORRUPT_PAJE(p->lineno);
+    if (id >= p->ndefs) {
+      size_t ndefs = (size_t)id + 1;
+      p->defs = realloc(p->defs, ndefs * sizeof(*(p->defs)));
+      if (!p->defs)
+        REPORT_AND_EXIT;
+      memset(p->defs + p->ndefs, 0, (ndefs - p->ndefs) * sizeof(*(p->defs)));
+      p->ndefs = ndefs;
+    }
+    p->def = p->defs + id;
+    p->def->event = PAJE_IGNORED;
+    for (int i = PAJE_IGNORED + 1; i <= PAJE_DEFINE_VALUE; i++)
+      if (token_is(tokens + 1, event_names[i]))
+        p->def->event = (enum Paje_event)i;
+    for (int i = 0; i < FIELD_COUNT; i++)
+      p->def->pos[i] = -1;
+    p->def->nfields = 0;
+  } else if (n >= 1 && token_is(tokens, "EndEventDef")) {
+    if (!p->def)
+      CORRUPT_PAJE(p->lineno);
+    p->def = NULL;
+  } else if (n >= 2 && p->def) {
+    for (int i = 0; i < FIELD_COUNT; i++)
+      if (token_is(tokens, field_names[i]))
+        p->def->pos[i] = p->def->nfields;
+    p->def->nfields++;
+  } else if (n) {
+    CORRUPT_PAJE(p->lineno);
+  }
+}
+
+/*
+ * Containers
+ */
+
+static struct Paje_container *
+container_get(struct Paje *p, struct Token const *id)
+{
+  struct Paje_container *ans = NULL;
+  HASH_FIND(hh, p->containers, id->str, id->len, ans);
+  if (!ans) {
+    /* Lenient with traces that don't create every container */
+    ans = calloc(1, sizeof(*ans));
+    if (!ans)
+      REPORT_AND_EXIT;
+    ans->id = token2str(id);
+    ans->name = token2str(id);
+    ans->rank = name2rank(ans->name);
+    HASH_ADD_KEYPTR(hh, p->containers, ans->id, strlen(ans->id), ans);
+  }
+  return ans;
+}
+
+static void
+container_create(struct Paje *p, struct Paje_def const *def,
+    struct Token const *tokens)
+{
+  if (def->pos[FIELD_NAME] < 0)
+    CORRUPT_PAJE(p->lineno);
+  struct Token const *id = tokens + (def->pos[FIELD_ALIAS] >= 0 ?
+      def->pos[FIELD_ALIAS] : def->pos[FIELD_NAME]);
+  struct Paje_container *c = container_get(p, id);
+  free(c->name);
+  c->name = token2str(tokens + def->pos[FIELD_NAME]);
+  c->rank = name2rank(c->name);
+  if (def->pos[FIELD_TIME] >= 0)
+    c->start = token2double(p, tokens + def->pos[FIELD_TIME]);
+  if (def->pos[FIELD_TYPE] >= 0) {
+    free(c->type);
+    c->type = token2str(tokens + def->pos[FIELD_TYPE]);
+  }
+  if (def->pos[FIELD_CONTAINER] >= 0) {
+    struct Token const *parent = tokens + def->pos[FIELD_CONTAINER];
+    struct Paje_container *pc = NULL;
+    HASH_FIND(hh, p->containers, parent->str, parent->len, pc);
+    free(c->parent);
+    c->parent = pc ? strdup(pc->name) : token2str(parent);
+    if (!c->parent)
+      REPORT_AND_EXIT;
+  }
+}
+
+static void
+value_define(struct Paje *p, struct Paje_def const *def,
+    struct Token const *tokens)
+{
+  if (def->pos[FIELD_NAME] < 0)
+    CORRUPT_PAJE(p->lineno);
+  struct Token const *alias = tokens + (def->pos[FIELD_ALIAS] >= 0 ?
+      def->pos[FIELD_ALIAS] : def->pos[FIELD_NAME]);
+  struct Paje_value *v = NULL;
+  HASH_FIND(hh, p->values, alias->str, alias->len, v);
+  if (!v) {
+    v = malloc(sizeof(*v));
+    if (!v)
+      REPORT_AND_EXIT;
+    v->alias = token2str(alias);
+    HASH_ADD_KEYPTR(hh, p->values, v->alias, strlen(v->alias), v);
+  } else {
+    free(v->name);
+  }
+  v->name = token2str(tokens + def->pos[FIELD_NAME]);
+}
+
+/* Name of the value token refers to, a copy of the token if undefined */
+static char *
+value_name(struct Paje const *p, struct Token const *token)
+{
+  struct Paje_value *v = NULL;
+  HASH_FIND(hh, p->values, token->str, token->len, v);
+  if (!v)
+    return token2str(token);
+  char *ans = strdup(v->name);
+  if (!ans)
+    REPORT_AND_EXIT;
+  return ans;
+}
+
+/*
+ * Output
+ */
+
+static void
+push_item(struct Paje_item **items, size_t *len, size_t *cap, double start,
+    void *event)
+{
+  if (*len == *cap) {
+    *cap = *cap ? *cap * 2 : 1024;
+    *items = realloc(*items, *cap * sizeof(**items));
+    if (!*items)
+      REPORT_AND_EXIT;
+  }
+  (*items)[*len].start = start;
+  (*items)[*len].seq = *len;
+  (*items)[*len].event = event;
+  (*len)++;
+}
+
+static int
+item_cmp(void const *a, void const *b)
+{
+  struct Paje_item const *A = a,
+                         *B = b;
+  if (A->start < B->start)
+    return -1;
+  if (A->start > B->start)
+    return 1;
+  return (A->seq > B->seq) - (A->seq < B->seq);
+}
+
+/* Pop the top of the stack of c at time end, storing the State */
+static void
+state_pop(struct Paje *p, struct Paje_container *c, double end)
+{
+  if (!c->depth) {
+    LOG_WARNING("PopState on empty stack of %s at line %zu\n", c->name,
+        p->lineno);
+    return;
+  }
+  struct Paje_open *o = c->stack + --(c->depth);
+  if (c->rank < 0) {
+    LOG_DEBUG("Ignoring state of container %s\n", c->name);
+  } else {
+    struct State *state = state_new(p->arena, c->rank, o->start, end,
+        (int)c->depth, routine_from_name(o->value), intern_cstr(o->value),
+        o->has_mark ? &(o->mark) : NULL);
+    push_item(&(p->states_out), &(p->nstates), &(p->states_cap), o->start,
+        state);
+  }
+  free(o->value);
+}
+
+static void
+state_push(struct Paje *p, struct Paje_def const *def,
+    struct Token const *tokens, struct Paje_container *c, double time)
+{
+  if (def->pos[FIELD_VALUE] < 0)
+    CORRUPT_PAJE(p->lineno);
+  if (c->depth == c->cap) {
+    c->cap = c->cap ? c->cap * 2 : 8;
+    c->stack = realloc(c->stack, c->cap * sizeof(*(c->stack)));
+    if (!c->stack)
+      REPORT_AND_EXIT;
+  }
+  struct Paje_open *o = c->stack + c->depth++;
+  o->start = time;
+  o->value = value_name(p, tokens + def->pos[FIELD_VALUE]);
+  o->has_mark = def->pos[FIELD_MARK] >= 0 &&
+    token2u64(tokens + def->pos[FIELD_MARK], &(o->mark));
+}
+
+/* Start or end (start is true/false) of a link */
+static void
+link_half(struct Paje *p, struct Paje_def const *def,
+    struct Token const *tokens, double time, bool start)
+{
+  int cpos = def->pos[start ? FIELD_START_CONTAINER : FIELD_END_CONTAINER];
+  if (def->pos[FIELD_KEY] < 0 || cpos < 0 || def->pos[FIELD_CONTAINER] < 0)
+    CORRUPT_PAJE(p->lineno);
+  struct Token const *key = tokens + def->pos[FIELD_KEY];
+  struct Paje_link *l = NULL;
+  HASH_FIND(hh, p->links, key->str, key->len, l);
+  if (!l) {
+    l = calloc(1, sizeof(*l));
+    if (!l)
+      REPORT_AND_EXIT;
+    l->key = token2str(key);
+    HASH_ADD_KEYPTR(hh, p->links, l->key, strlen(l->key), l);
+  }
+  if ((start && l->started) || (!start && l->ended))
+    LOG_AND_EXIT("Duplicated link key %s at line %zu\n", l->key, p->lineno);
+  int rank = container_get(p, tokens + cpos)->rank;
+  if (start) {
+    l->started = true;
+    l->start = time;
+    l->from = rank;
+    l->container = strdup(container_get(p, tokens +
+          def->pos[FIELD_CONTAINER])->name);
+    if (!l->container)
+      REPORT_AND_EXIT;
+    if (def->pos[FIELD_VALUE] >= 0)
+      l->value = value_name(p, tokens + def->pos[FIELD_VALUE]);
+    l->has_mark = def->pos[FIELD_MARK] >= 0 &&
+      token2u64(tokens + def->pos[FIELD_MARK], &(l->mark));
+    /* pj_dump -u would have the key in the mark column */
+    if (!l->has_mark && !token2u64(key, &(l->mark)))
+      CORRUPT_PAJE(p->lineno);
+    uint64_t bytes = 0;
+    if (def->pos[FIELD_SIZE] < 0 ||
+        !token2u64(tokens + def->pos[FIELD_SIZE], &bytes))
+      LOG_ERROR("Failed to read byte count of link %s\n", l->key);
+    l->bytes = (size_t)bytes;
+  } else {
+    l->ended = true;
+    l->end = time;
+    l->to = rank;
+  }
+  if (!l->started || !l->ended)
+    return;
+  if (l->to < 0) {
+    LOG_DEBUG("Ignoring link to a container that is not a rank\n");
+  } else {
+    enum Link_type type = l->value ? link_type_from_name(l->value) :
+      LINK_OTHER;
+    struct Link *link = link_new(p->arena, l->from, l->to, l->start, l->end,
+        type, intern_cstr(l->container), l->mark, l->bytes);
+    push_item(&(p->links_out), &(p->nlinks), &(p->links_cap), l->start, link);
+  }
+  HASH_DEL(p->links, l);
+  free(l->key);
+  free(l->container);
+  free(l->value);
+  free(l);
+}
+
+/*
+ * Writing, see paje_out_start
+ */
+
+/* The header of the output when the input is not a Pajé trace (Akypuera's) */
+static char const builtin_header[] =
+  "%EventDef PajeDefineContainerType 0\n"
+  "%       Alias string\n"
+  "%       Type string\n"
+  "%       Name string\n"
+  "%EndEventDef\n"
+  "%EventDef PajeDefineStateType 2\n"
+  "%       Alias string\n"
+  "%       Type string\n"
+  "%       Name string\n"
+  "%EndEventDef\n"
+  "%EventDef PajeDefineLinkType 4\n"
+  "%       Alias string\n"
+  "%       Type string\n"
+  "%       StartContainerType string\n"
+  "%       EndContainerType string\n"
+  "%       Name string\n"
+  "%EndEventDef\n"
+  "%EventDef PajeCreateContainer 6\n"
+  "%       Time date\n"
+  "%       Alias string\n"
+  "%       Type string\n"
+  "%       Container string\n"
+  "%       Name string\n"
+  "%EndEventDef\n"
+  "%EventDef PajeDestroyContainer 7\n"
+  "%       Time date\n"
+  "%       Type string\n"
+  "%       Name string\n"
+  "%EndEventDef\n"
+  "%EventDef PajePushState 12\n"
+  "%       Time date\n"
+  "%       Container string\n"
+  "%       Type string\n"
+  "%       Value string\n"
+  "%EndEventDef\n"
+  "%EventDef PajePushState 13\n"
+  "%       Time date\n"
+  "%       Container string\n"
+  "%       Type string\n"
+  "%       Value string\n"
+  "%       Mark string\n"
+  "%EndEventDef\n"
+  "%EventDef PajePopState 14\n"
+  "%       Time date\n"
+  "%       Container string\n"
+  "%       Type string\n"
+  "%EndEventDef\n"
+  "%EventDef PajeStartLink 18\n"
+  "%       Time date\n"
+  "%       Container string\n"
+  "%       Type string\n"
+  "%       StartContainer string\n"
+  "%       Value string\n"
+  "%       Key string\n"
+  "%       Size double\n"
+  "%       Mark string\n"
+  "%EndEventDef\n"
+  "%EventDef PajeEndLink 19\n"
+  "%       Time date\n"
+  "%       Container string\n"
+  "%       Type string\n"
+  "%       EndContainer string\n"
+  "%       Value string\n"
+  "%       Key string\n"
+  "%EndEventDef\n";
+
+/* Ids of the type definitions of builtin_header */
+#define BUILTIN_CONTAINER_TYPE 0
+#define BUILTIN_STATE_TYPE 2
+#define BUILTIN_LINK_TYPE 4
+
+/* Akypuera's names, for whatever the input doesn't tell */
+#define DEFAULT_ROOT_TYPE "ROOT"
+#define DEFAULT_RANK_TYPE "PROCESS"
+#define DEFAULT_STATE_TYPE "STATE"
+#define DEFAULT_LINK_TYPE "LINK"
+
+/* The encoder for one event: which field goes at each position of its lines */
+struct Paje_out_def {
+  uint64_t id;
+  int nfields;
+  /* -1 for fields we know nothing about, written as "" */
+  int field_at[MAX_FIELDS];
+};
+
+struct Paje_out_container {
+  /* Also its alias */
+  char *name,
+       *parent,
+       *type;
+  double start,
+         end;
+  /* NULL for a container of the root of all (parent 0) */
+  struct Paje_out_container *up;
+  int depth;
+  /* Order of definition */
+  size_t seq;
+  bool created;
+  /* States pushed and not popped yet, by the id of their Paje_end */
+  uint64_t *stack;
+  size_t open,
+         cap;
+  UT_hash_handle hh;
+};
+
+/* A PopState or EndLink to write once the trace gets to its time */
+struct Paje_end {
+  double time;
+  bool link;
+  uint64_t seq;
+  /* Of the state or of the link */
+  struct Paje_out_container *c;
+  /* Of a state: where it is in the stack of c */
+  size_t level;
+  uint64_t id;
+  /* Of a link: where it ends, and what its key is made of */
+  struct Paje_out_container *to;
+  int from,
+      to_rank;
+  uint64_t key;
+};
+
+/* A field value of an event line */
+struct Paje_out_field {
+  enum {
+    OUT_NONE,
+    OUT_TIME,
+    OUT_STR,
+    OUT_U64
+  } kind;
+  union {
+    double time;
+    char const *str;
+    uint64_t u64;
+  } u;
+};
+
+static struct Paje_writer {
+  bool active,
+       /* Whether the input had a header, copied, or builtin_header is used */
+       copied,
+       /* Whether the definitions were written, see writer_begin */
+       begun;
+  /* Of the output, only defs is used */
+  struct Paje hdr;
+  struct Paje_out_def create,
+                      destroy,
+                      push,
+                      push_mark,
+                      pop,
+                      start_link,
+                      end_link;
+  char *state_type,
+       *link_type,
+       *rank_type;
+  struct Paje_out_container *containers,
+                            *root,
+                            /* Where the ranks with no container go */
+                            *rank_parent;
+  size_t ncontainers;
+  /* By rank, NULL until an event refers to it */
+  struct Paje_out_container **ranks;
+  size_t nranks;
+  /* By start time, those from create_next on are yet to be written */
+  struct Paje_out_container **creates;
+  size_t ncreates,
+         create_next;
+  /* Min-heap, see end_before */
+  struct Paje_end *ends;
+  size_t nends,
+         ends_cap;
+  uint64_t seq,
+           links,
+           states;
+  /* Time of the last line written, no line goes back in time */
+  double now;
+  /* Container types written, when the header is builtin_header */
+  char **types;
+  size_t ntypes;
+  /* Input lines with no place in the output, states ended early to nest */
+  size_t dropped,
+         cut;
+} pw;
+
+static void
+writer_line(char const *line, size_t len)
+{
+  output_write(line, len);
+  if (!len || line[len - 1] != '\n')
+    output_write("\n", 1);
+}
+
+/* A header line (or comment) of a Pajé input, copied to the output */
+static void
+writer_header(struct Paje const *p, char const *line, size_t len)
+{
+  if (line[0] == '%') {
+    pw.copied = true;
+    pw.hdr.lineno = p->lineno;
+    header_line(&(pw.hdr), line, len);
+  }
+  writer_line(line, len);
+}
+
+/*
+ * An event line of a Pajé input: definitions (events with no time) are copied
+ * to the output, the types of states and links noted, and containers left to
+ * paje_out_passthrough, as they are rewritten from the Container lines.
+ */
+static void
+writer_input(struct Paje_def const *def, struct Token const *fields, int n,
+    char const *line, size_t len)
+{
+  char **type = NULL;
+  switch (def->event) {
+    case PAJE_CREATE_CONTAINER:
+    case PAJE_DESTROY_CONTAINER:
+    case PAJE_POP_STATE:
+    case PAJE_RESET_STATE:
+    case PAJE_END_LINK:
+      return;
+    case PAJE_SET_STATE:
+    case PAJE_PUSH_STATE:
+      type = &(pw.state_type);
+      break;
+    case PAJE_START_LINK:
+      type = &(pw.link_type);
+      break;
+    default:
+      if (def->pos[FIELD_TIME] < 0)
+        writer_line(line, len);
+      else
+        pw.dropped++;
+      return;
+  }
+  if (!*type && def->pos[FIELD_TYPE] >= 0 && def->pos[FIELD_TYPE] < n)
+    *type = token2str(fields + def->pos[FIELD_TYPE]);
+}
+
+static struct Paje_out_container *
+out_container(char const *name)
+{
+  struct Paje_out_container *c = NULL;
+  HASH_FIND_STR(pw.containers, name, c);
+  return c;
+}
+
+static struct Paje_out_container *
+out_container_new(char const *name, char const *parent, char const *type,
+    double start, double end)
+{
+  struct Paje_out_container *c = calloc(1, sizeof(*c));
+  if (!c)
+    REPORT_AND_EXIT;
+  c->name = strdup(name);
+  c->parent = strdup(parent);
+  c->type = strdup(type);
+  if (!c->name || !c->parent || !c->type)
+    REPORT_AND_EXIT;
+  c->start = start;
+  c->end = end < start ? start : end;
+  c->seq = pw.ncontainers++;
+  HASH_ADD_KEYPTR(hh, pw.containers, c->name, strlen(c->name), c);
+  return c;
+}
+
+/* A container of the input, ignoring redefinitions and the root of all */
+static void
+writer_container(char const *name, char const *parent, char const *type,
+    double start, double end)
+{
+  if (!strcmp(name, "0"))
+    return;
+  if (out_container(name))
+    LOG_WARNING("Container %s defined twice, keeping the first\n", name);
+  else
+    out_container_new(name, parent, type, start, end);
+}
+
+/* Parse a pj_dump Container line, false if line is something else */
+static bool
+container_line(char const *line, size_t len)
+{
+  static char const prefix[] = "Container, ";
+  if (len < sizeof(prefix) - 1 || memcmp(line, prefix, sizeof(prefix) - 1))
+    return false;
+  if (line[len - 1] == '\n')
+    len--;
+  char *copy = strndup(line, len);
+  if (!copy)
+    REPORT_AND_EXIT;
+  /* Parent, type, start, end, duration and then the name, which may hold ", " */
+  char *fields[6];
+  char *it = copy + sizeof(prefix) - 1;
+  for (int i = 0; i < 5; i++) {
+    fields[i] = it;
+    if (!(it = strstr(it, ", ")))
+      LOG_AND_EXIT("Malformed Container line: %s\n", copy);
+    *it = 0;
+    it += 2;
+  }
+  fields[5] = it;
+  writer_container(fields[5], fields[0], fields[1], strtod(fields[2], NULL),
+      strtod(fields[3], NULL));
+  free(copy);
+  return true;
+}
+
+static inline int
+bit_count(unsigned x)
+{
+  int ans = 0;
+  for (; x; x &= x - 1)
+    ans++;
+  return ans;
+}
+
+#define FIELD_BIT(field) (1u << (field))
+
+/*
+ * The encoder for event from the output header: the def with every field in
+ * need, then the most fields in want, then the fewest others (those in avoid
+ * first). Aborts if there is none.
+ */
+static struct Paje_out_def
+pick_def(enum Paje_event event, unsigned need, unsigned want, unsigned avoid)
+{
+  struct Paje_def const *best = NULL;
+  int best_score = 0;
+  for (size_t i = 0; i < pw.hdr.ndefs; i++) {
+    struct Paje_def const *def = pw.hdr.defs + i;
+    unsigned has = 0;
+    for (int j = 0; j < FIELD_COUNT; j++)
+      if (def->pos[j] >= 0)
+        has |= FIELD_BIT(j);
+    if (def->event != event || (has & need) != need)
+      continue;
+    int score = 1024 * bit_count(has & want) - 32 * bit_count(has & avoid) -
+      (def->nfields - bit_count(has));
+    if (!best || score > best_score) {
+      best = def;
+      best_score = score;
+    }
+  }
+  if (!best)
+    LOG_AND_EXIT("No usable %s in the Pajé header\n", event_names[event]);
+  struct Paje_out_def ans;
+  ans.id = (uint64_t)(best - pw.hdr.defs);
+  ans.nfields = best->nfields < MAX_FIELDS ? best->nfields : MAX_FIELDS;
+  for (int i = 0; i < ans.nfields; i++)
+    ans.field_at[i] = -1;
+  for (int i = 0; i < FIELD_COUNT; i++)
+    if (best->pos[i] >= 0 && best->pos[i] < ans.nfields)
+      ans.field_at[best->pos[i]] = i;
+  return ans;
+}
+
+static inline bool
+needs_quotes(char const *str)
+{
+  return !*str || strpbrk(str, " \t");
+}
+
+static char *
+fmt_word(char *dst, char const *str)
+{
+  if (!needs_quotes(str))
+    return output_fmt_str(dst, str);
+  *dst++ = '"';
+  dst = output_fmt_str(dst, str);
+  *dst++ = '"';
+  return dst;
+}
+
+/* Write a line of n words, for the definitions */
+static void
+write_words(uint64_t id, int n, char const *const *words)
+{
+  size_t len = OUTPUT_NUMBER_MAX + 1;
+  for (int i = 0; i < n; i++)
+    len += strlen(words[i]) + 3;
+  char *const line = output_reserve(len);
+  char *it = output_fmt_u64(line, id);
+  for (int i = 0; i < n; i++) {
+    *it++ = ' ';
+    it = fmt_word(it, words[i]);
+  }
+  *it++ = '\n';
+  output_commit(it);
+}
+
+/* The key of a link, FROM_TO_N, N counting links */
+static void
+link_key(char *dst, struct Paje_end const *end)
+{
+  dst = output_fmt_int(dst, end->from);
+  *dst++ = '_';
+  dst = output_fmt_int(dst, end->to_rank);
+  *dst++ = '_';
+  *output_fmt_u64(dst, end->key) = 0;
+}
+
+/* Write an event with def, fields being indexed by enum Paje_field */
+static void
+write_event(struct Paje_out_def const *def,
+    struct Paje_out_field const *fields)
+{
+  size_t len = 2 * OUTPUT_NUMBER_MAX;
+  for (int i = 0; i < def->nfields; i++) {
+    int f = def->field_at[i];
+    if (f >= 0 && fields[f].kind == OUT_STR)
+      len += strlen(fields[f].u.str) + 3;
+    else
+      len += OUTPUT_NUMBER_MAX + 1;
+  }
+  char *const line = output_reserve(len);
+  char *it = output_fmt_u64(line, def->id);
+  for (int i = 0; i < def->nfields; i++) {
+    int f = def->field_at[i];
+    *it++ = ' ';
+    switch (f >= 0 ? fields[f].kind : OUT_NONE) {
+      case OUT_NONE:
+        it = OUTPUT_FMT_LIT(it, "\"\"");
+        break;
+      case OUT_TIME:
+        it = output_fmt_fixed15(it, fields[f].u.time);
+        break;
+      case OUT_STR:
+        it = fmt_word(it, fields[f].u.str);
+        break;
+      case OUT_U64:
+        it = output_fmt_u64(it, fields[f].u.u64);
+        break;
+    }
+  }
+  *it++ = '\n';
+  output_commit(it);
+}
+
+/* Fields with only the time set, which never goes back */
+static inline void
+fields_at(struct Paje_out_field *fields, double time)
+{
+  memset(fields, 0, FIELD_COUNT * sizeof(*fields));
+  if (time > pw.now)
+    pw.now = time;
+  fields[FIELD_TIME].kind = OUT_TIME;
+  fields[FIELD_TIME].u.time = pw.now;
+}
+
+static inline void
+field_str(struct Paje_out_field *fields, enum Paje_field f, char const *str)
+{
+  fields[f].kind = OUT_STR;
+  fields[f].u.str = str;
+}
+
+static inline void
+field_u64(struct Paje_out_field *fields, enum Paje_field f, uint64_t u64)
+{
+  fields[f].kind = OUT_U64;
+  fields[f].u.u64 = u64;
+}
+
+/* Pending ends, in a min-heap by time, then in order of arrival */
+
+static inline bool
+end_before(struct Paje_end const *a, struct Paje_end const *b)
+{
+  if (a->time < b->time)
+    return true;
+  if (a->time > b->time)
+    return false;
+  return a->seq < b->seq;
+}
+
+static void
+end_push(struct Paje_end *end)
+{
+  if (pw.nends == pw.ends_cap) {
+    pw.ends_cap = pw.ends_cap ? 2 * pw.ends_cap : 1024;
+    pw.ends = realloc(pw.ends, pw.ends_cap * sizeof(*(pw.ends)));
+    if (!pw.ends)
+      REPORT_AND_EXIT;
+  }
+  end->seq = pw.seq++;
+  size_t i = pw.nends++;
+  for (; i && end_before(end, pw.ends + (i - 1) / 2); i = (i - 1) / 2)
+    pw.ends[i] = pw.ends[(i - 1) / 2];
+  pw.ends[i] = *end;
+}
+
+static struct Paje_end
+end_pop(void)
+{
+  struct Paje_end ans = pw.ends[0],
+                  last = pw.ends[--pw.nends];
+  size_t i = 0;
+  for (;;) {
+    size_t min = 2 * i + 1;
+    if (min >= pw.nends)
+      break;
+    if (min + 1 < pw.nends && end_before(pw.ends + min + 1, pw.ends + min))
+      min++;
+    if (!end_before(pw.ends + min, &last))
+      break;
+    pw.ends[i] = pw.ends[min];
+    i = min;
+  }
+  pw.ends[i] = last;
+  return ans;
+}
+
+/* Make sure c (and its ancestors) last until time */
+static void
+container_extend(struct Paje_out_container *c, double time)
+{
+  for (; c; c = c->up)
+    if (time > c->end)
+      c->end = time;
+}
+
+/* Create c (and its ancestors) by time, earlier than it says if need be */
+static void
+container_write(struct Paje_out_container *c, double time)
+{
+  if (c->created)
+    return;
+  if (c->start < time)
+    time = c->start;
+  if (c->up)
+    container_write(c->up, time);
+  c->created = true;
+  struct Paje_out_field fields[FIELD_COUNT];
+  fields_at(fields, time);
+  field_str(fields, FIELD_ALIAS, c->name);
+  field_str(fields, FIELD_TYPE, c->type);
+  field_str(fields, FIELD_CONTAINER, c->up ? c->up->name : "0");
+  field_str(fields, FIELD_NAME, c->name);
+  write_event(&(pw.create), fields);
+}
+
+/*
+ * Pop the states of c down to level at time, those above it (nested in it,
+ * but ending later) ending early
+ */
+static void
+states_pop(struct Paje_out_container *c, size_t level, double time)
+{
+  if (c->open > level + 1)
+    pw.cut += c->open - level - 1;
+  for (; c->open > level; c->open--) {
+    struct Paje_out_field fields[FIELD_COUNT];
+    fields_at(fields, time);
+    field_str(fields, FIELD_CONTAINER, c->name);
+    field_str(fields, FIELD_TYPE, pw.state_type);
+    write_event(&(pw.pop), fields);
+  }
+}
+
+/* Write every pending end and container creation due by time */
+static void
+writer_advance(double time)
+{
+  for (;;) {
+    struct Paje_out_container *c = pw.create_next < pw.ncreates ?
+      pw.creates[pw.create_next] : NULL;
+    bool end_due = pw.nends && !(pw.ends[0].time > time);
+    if (c && !(c->start > time) && (!end_due ||
+          !(c->start > pw.ends[0].time))) {
+      container_write(c, c->start);
+      pw.create_next++;
+      continue;
+    }
+    if (!end_due)
+      return;
+    struct Paje_end end = end_pop();
+    struct Paje_out_field fields[FIELD_COUNT];
+    if (!end.link) {
+      /* (unless it was popped already) */
+      if (end.c->open > end.level && end.c->stack[end.level] == end.id)
+        states_pop(end.c, end.level, end.time);
+    } else {
+      char key[3 * OUTPUT_NUMBER_MAX];
+      link_key(key, &end);
+      fields_at(fields, end.time);
+      field_str(fields, FIELD_CONTAINER, end.c->name);
+      field_str(fields, FIELD_TYPE, pw.link_type);
+      field_str(fields, FIELD_END_CONTAINER, end.to->name);
+      field_str(fields, FIELD_VALUE, "PTP");
+      field_str(fields, FIELD_KEY, key);
+      write_event(&(pw.end_link), fields);
+    }
+  }
+}
+
+static int
+create_cmp(void const *a, void const *b)
+{
+  struct Paje_out_container const *A = *(struct Paje_out_container *const *)a,
+                                   *B = *(struct Paje_out_container *const *)b;
+  if (A->start < B->start)
+    return -1;
+  if (A->start > B->start)
+    return 1;
+  if (A->depth != B->depth)
+    return A->depth - B->depth;
+  return (A->seq > B->seq) - (A->seq < B->seq);
+}
+
+/* Write the definition of container type (for builtin_header) */
+static void
+define_type(struct Paje_out_container const *c)
+{
+  for (size_t i = 0; i < pw.ntypes; i++)
+    if (!strcmp(pw.types[i], c->type))
+      return;
+  if (c->up)
+    define_type(c->up);
+  pw.types = realloc(pw.types, (pw.ntypes + 1) * sizeof(*(pw.types)));
+  if (!pw.types)
+    REPORT_AND_EXIT;
+  pw.types[pw.ntypes++] = c->type;
+  char const *words[] = { c->type, c->up ? c->up->type : "0", c->type };
+  write_words(BUILTIN_CONTAINER_TYPE, 3, words);
+}
+
+static char *
+strdup_or(char *str, char const *otherwise)
+{
+  if (str)
+    return str;
+  if (!(str = strdup(otherwise)))
+    REPORT_AND_EXIT;
+  return str;
+}
+
+/* Whether some container has name as its name (or as its type if type) */
+static bool
+name_taken(char const *name, bool type)
+{
+  struct Paje_out_container *c = NULL,
+                            *tmp = NULL;
+  HASH_ITER(hh, pw.containers, c, tmp)
+    if (!strcmp(type ? c->type : c->name, name))
+      return true;
+  return false;
+}
+
+/*
+ * A name (type if type) that no container has: base, or base followed by the
+ * lowest number that makes it so. To be freed.
+ */
+static char *
+name_unused(char const *base, bool type)
+{
+  size_t const len = strlen(base);
+  char *ans = malloc(len + OUTPUT_NUMBER_MAX);
+  if (!ans)
+    REPORT_AND_EXIT;
+  memcpy(ans, base, len + 1);
+  for (int i = 1; name_taken(ans, type); i++)
+    *output_fmt_int(ans + len, i) = 0;
+  return ans;
+}
+
+/*
+ * The root of the containers, where links with no container of their own go:
+ * the top level container if there is a single one. Otherwise a new one, time
+ * being its start, that every top level container is moved into, unless the
+ * copied header has their types at the top (they then stay there, the first
+ * one defined being the root).
+ */
+static void
+writer_root(double time)
+{
+  struct Paje_out_container *c = NULL,
+                            *tmp = NULL,
+                            *top = NULL;
+  size_t ntop = 0;
+  HASH_ITER(hh, pw.containers, c, tmp) {
+    if (c->up)
+      continue;
+    ntop++;
+    if (!top || c->seq < top->seq)
+      top = c;
+  }
+  if (ntop == 1 || (ntop && pw.copied)) {
+    pw.root = top;
+    return;
+  }
+  char *name = name_unused("root", false),
+       *type = name_unused(DEFAULT_ROOT_TYPE, true);
+  pw.root = out_container_new(name, "0", type, time, time);
+  free(name);
+  free(type);
+  HASH_ITER(hh, pw.containers, c, tmp) {
+    if (c->up || c == pw.root)
+      continue;
+    c->up = pw.root;
+    free(c->parent);
+    if (!(c->parent = strdup(pw.root->name)))
+      REPORT_AND_EXIT;
+  }
+}
+
+/*
+ * Settle the container tree (time being that of the first event) and write
+ * whatever definitions the header didn't have
+ */
+static void
+writer_begin(double time)
+{
+  pw.begun = true;
+  /*
+   * Parents that are referred to but not defined are made up at the top level,
+   * as are containers that are their own parent
+   */
+  struct Paje_out_container *c = NULL,
+                            *tmp = NULL;
+  HASH_ITER(hh, pw.containers, c, tmp) {
+    if (!strcmp(c->parent, "0") || !strcmp(c->parent, c->name))
+      continue;
+    if (!(c->up = out_container(c->parent)))
+      c->up = out_container_new(c->parent, "0", DEFAULT_ROOT_TYPE, c->start,
+          c->end);
+  }
+  writer_root(time);
+  /* (the first rank defined tells where those made up go) */
+  HASH_ITER(hh, pw.containers, c, tmp) {
+    if (!pw.rank_type && name2rank(c->name) >= 0) {
+      pw.rank_type = strdup_or(NULL, c->type);
+      pw.rank_parent = c->up;
+    }
+    c->depth = 0;
+    for (struct Paje_out_container *up = c->up; up; up = up->up) {
+      if (++c->depth > (int)pw.ncontainers)
+        LOG_AND_EXIT("Container %s is its own ancestor\n", c->name);
+      if (c->start < up->start)
+        up->start = c->start;
+    }
+    container_extend(c, c->end);
+  }
+  pw.rank_type = strdup_or(pw.rank_type, DEFAULT_RANK_TYPE);
+  if (!pw.rank_parent)
+    pw.rank_parent = pw.root;
+  pw.creates = malloc((pw.ncontainers ? pw.ncontainers : 1) *
+      sizeof(*(pw.creates)));
+  if (!pw.creates)
+    REPORT_AND_EXIT;
+  HASH_ITER(hh, pw.containers, c, tmp)
+    pw.creates[pw.ncreates++] = c;
+  qsort(pw.creates, pw.ncreates, sizeof(*(pw.creates)), create_cmp);
+  if (!pw.copied) {
+    writer_line(builtin_header, sizeof(builtin_header) - 1);
+    for (char const *line = builtin_header; *line; ) {
+      char const *nl = strchr(line, '\n');
+      header_line(&(pw.hdr), line, (size_t)(nl - line));
+      line = nl + 1;
+    }
+    for (size_t i = 0; i < pw.ncreates; i++)
+      define_type(pw.creates[i]);
+    struct Paje_out_container rank = { .type = pw.rank_type,
+      .up = pw.rank_parent };
+    define_type(&rank);
+    char const *state[] = { DEFAULT_STATE_TYPE, pw.rank_type,
+      DEFAULT_STATE_TYPE };
+    write_words(BUILTIN_STATE_TYPE, 3, state);
+    char const *link[] = { DEFAULT_LINK_TYPE, pw.root->type, pw.rank_type,
+      pw.rank_type, DEFAULT_LINK_TYPE };
+    write_words(BUILTIN_LINK_TYPE, 5, link);
+  }
+  pw.state_type = strdup_or(pw.state_type, DEFAULT_STATE_TYPE);
+  pw.link_type = strdup_or(pw.link_type, DEFAULT_LINK_TYPE);
+  unsigned const time_bit = FIELD_BIT(FIELD_TIME),
+                 on = time_bit | FIELD_BIT(FIELD_CONTAINER) |
+                   FIELD_BIT(FIELD_TYPE);
+  pw.create = pick_def(PAJE_CREATE_CONTAINER, time_bit | FIELD_BIT(FIELD_TYPE)
+      | FIELD_BIT(FIELD_CONTAINER) | FIELD_BIT(FIELD_NAME),
+      FIELD_BIT(FIELD_ALIAS), 0);
+  pw.destroy = pick_def(PAJE_DESTROY_CONTAINER, time_bit |
+      FIELD_BIT(FIELD_TYPE) | FIELD_BIT(FIELD_NAME), 0, 0);
+  pw.push = pick_def(PAJE_PUSH_STATE, on | FIELD_BIT(FIELD_VALUE), 0,
+      FIELD_BIT(FIELD_MARK));
+  pw.push_mark = pick_def(PAJE_PUSH_STATE, on | FIELD_BIT(FIELD_VALUE),
+      FIELD_BIT(FIELD_MARK), 0);
+  pw.pop = pick_def(PAJE_POP_STATE, on, 0, 0);
+  pw.start_link = pick_def(PAJE_START_LINK, on |
+      FIELD_BIT(FIELD_START_CONTAINER) | FIELD_BIT(FIELD_KEY),
+      FIELD_BIT(FIELD_VALUE) | FIELD_BIT(FIELD_SIZE) | FIELD_BIT(FIELD_MARK),
+      0);
+  pw.end_link = pick_def(PAJE_END_LINK, on | FIELD_BIT(FIELD_END_CONTAINER) |
+      FIELD_BIT(FIELD_KEY), FIELD_BIT(FIELD_VALUE), 0);
+}
+
+/*
+ * The container of rank, made up next to the first rank defined (in the root
+ * if none was) if the input had none
+ */
+static struct Paje_out_container *
+rank_container(int rank, double time)
+{
+  if (rank < 0)
+    LOG_AND_EXIT("Negative rank %d can't be written\n", rank);
+  if ((size_t)rank >= pw.nranks) {
+    size_t nranks = (size_t)rank + 1;
+    pw.ranks = realloc(pw.ranks, nranks * sizeof(*(pw.ranks)));
+    if (!pw.ranks)
+      REPORT_AND_EXIT;
+    memset(pw.ranks + pw.nranks, 0, (nranks - pw.nranks) *
+        sizeof(*(pw.ranks)));
+    pw.nranks = nranks;
+  }
+  if (!pw.ranks[rank]) {
+    char name[16 + OUTPUT_NUMBER_MAX];
+    *output_fmt_int(OUTPUT_FMT_LIT(name, "rank"), rank) = 0;
+    struct Paje_out_container *c = out_container(name);
+    if (!c) {
+      c = out_container_new(name, pw.rank_parent->name, pw.rank_type, time,
+          time);
+      c->up = pw.rank_parent;
+      c->depth = pw.rank_parent->depth + 1;
+    }
+    pw.ranks[rank] = c;
+  }
+  return pw.ranks[rank];
+}
+
+/*
+ * Containers are destroyed last, by end time (deepest first), as events may
+ * well end later than their Container line says once compensated
+ */
+static int
+destroy_cmp(void const *a, void const *b)
+{
+  struct Paje_out_container const *A = *(struct Paje_out_container *const *)a,
+                                   *B = *(struct Paje_out_container *const *)b;
+  if (A->end < B->end)
+    return -1;
+  if (A->end > B->end)
+    return 1;
+  if (A->depth != B->depth)
+    return B->depth - A->depth;
+  return (A->seq > B->seq) - (A->seq < B->seq);
+}
+
+void
+paje_out_start(void)
+{
+  assert(!pw.active);
+  memset(&pw, 0, sizeof(pw));
+  pw.now = -DBL_MAX;
+  pw.active = true;
+}
+
+bool
+paje_out_active(void)
+{
+  return pw.active;
+}
+
+void
+paje_out_passthrough(char const *line, size_t len)
+{
+  assert(pw.active && !pw.begun);
+  if (!container_line(line, len))
+    pw.dropped++;
+}
+
+void
+paje_out_state(struct State const *state)
+{
+  assert(pw.active && state);
+  if (!pw.begun)
+    writer_begin(state->start);
+  writer_advance(state->start);
+  struct Paje_out_container *c = rank_container(state->rank, state->start);
+  container_write(c, state->start);
+  /*
+   * A state at the same level as (or above) one still open would be taken as
+   * nested in it, compensation may leave them overlapping a little
+   */
+  size_t level = state->imbrication > 0 ? (size_t)(state->imbrication) : 0;
+  if (c->open > level) {
+    pw.cut++;
+    states_pop(c, level, state->start);
+  }
+  bool marked = state_is_send(state) || state_is_recv(state) ||
+    state_is_wait(state);
+  struct Paje_out_field fields[FIELD_COUNT];
+  fields_at(fields, state->start);
+  field_str(fields, FIELD_CONTAINER, c->name);
+  field_str(fields, FIELD_TYPE, pw.state_type);
+  field_str(fields, FIELD_VALUE, state->routine);
+  if (marked)
+    field_u64(fields, FIELD_MARK, state->mark);
+  write_event(marked ? &(pw.push_mark) : &(pw.push), fields);
+  if (c->open == c->cap) {
+    c->cap = c->cap ? 2 * c->cap : 8;
+    c->stack = realloc(c->stack, c->cap * sizeof(*(c->stack)));
+    if (!c->stack)
+      REPORT_AND_EXIT;
+  }
+  struct Paje_end end = { .link = false, .c = c, .level = c->open,
+    .id = pw.states++ };
+  c->stack[c->open++] = end.id;
+  end.time = state->end < pw.now ? pw.now : state->end;
+  container_extend(c, end.time);
+  end_push(&end);
+}
+
+void
+paje_out_link(struct Link const *link)
+{
+  assert(pw.active && link);
+  if (!pw.begun)
+    writer_begin(link->start);
+  writer_advance(link->start);
+  struct Paje_out_container *c = link->container ?
+    out_container(link->container) : NULL,
+                            *from = rank_container(link->from, link->start),
+                            *to = rank_container(link->to, link->start);
+  if (!c)
+    c = pw.root;
+  container_write(c, link->start);
+  container_write(from, link->start);
+  container_write(to, link->start);
+  struct Paje_end end = { .link = true, .c = c, .to = to,
+    .from = link->from, .to_rank = link->to, .key = pw.links++ };
+  char key[3 * OUTPUT_NUMBER_MAX];
+  link_key(key, &end);
+  struct Paje_out_field fields[FIELD_COUNT];
+  fields_at(fields, link->start);
+  field_str(fields, FIELD_CONTAINER, c->name);
+  field_str(fields, FIELD_TYPE, pw.link_type);
+  field_str(fields, FIELD_START_CONTAINER, from->name);
+  field_str(fields, FIELD_VALUE, "PTP");
+  field_str(fields, FIELD_KEY, key);
+  field_u64(fields, FIELD_SIZE, link->bytes);
+  field_u64(fields, FIELD_MARK, link->mark);
+  write_event(&(pw.start_link), fields);
+  end.time = link->end < pw.now ? pw.now : link->end;
+  container_extend(c, end.time);
+  container_extend(to, end.time);
+  end_push(&end);
+}
+
+void
+paje_out_finish(void)
+{
+  assert(pw.active);
+  if (!pw.begun)
+    writer_begin(0);
+  writer_advance(DBL_MAX);
+  if (pw.dropped)
+    LOG_WARNING("%zu lines of the input have no Pajé equivalent, left out "
+        "of the output\n", pw.dropped);
+  if (pw.cut)
+    LOG_INFO("%zu states ended early, to nest in the Pajé output\n", pw.cut);
+  struct Paje_out_container **destroys = malloc((pw.ncontainers ?
+        pw.ncontainers : 1) * sizeof(*destroys));
+  if (!destroys)
+    REPORT_AND_EXIT;
+  size_t ndestroys = 0;
+  struct Paje_out_container *c = NULL,
+                            *tmp = NULL;
+  HASH_ITER(hh, pw.containers, c, tmp)
+    destroys[ndestroys++] = c;
+  qsort(destroys, ndestroys, sizeof(*destroys), destroy_cmp);
+  for (size_t i = 0; i < ndestroys; i++) {
+    struct Paje_out_field fields[FIELD_COUNT];
+    fields_at(fields, destroys[i]->end);
+    field_str(fields, FIELD_TYPE, destroys[i]->type);
+    field_str(fields, FIELD_NAME, destroys[i]->name);
+    write_event(&(pw.destroy), fields);
+  }
+  free(destroys);
+  HASH_ITER(hh, pw.containers, c, tmp) {
+    HASH_DEL(pw.containers, c);
+    free(c->name);
+    free(c->parent);
+    free(c->type);
+    free(c->stack);
+    free(c);
+  }
+  free(pw.hdr.defs);
+  free(pw.state_type);
+  free(pw.link_type);
+  free(pw.rank_type);
+  free(pw.ranks);
+  free(pw.creates);
+  free(pw.ends);
+  free(pw.types);
+  memset(&pw, 0, sizeof(pw));
+}
+
+/*
+ * Events
+ */
+
+/* As a pj_dump Container line */
+static void
+container_print(struct Paje_container const *c, double end)
+{
+  char const *parent = c->parent ? c->parent : "0",
+             *type = c->type ? c->type : "0";
+  char *const line = output_reserve(16 + 3 * OUTPUT_NUMBER_MAX +
+      strlen(parent) + strlen(type) + strlen(c->name));
+  char *it = OUTPUT_FMT_LIT(line, "Container, ");
+  it = output_fmt_str(it, parent);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_str(it, type);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_fixed15(it, c->start);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_fixed15(it, end);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_fixed15(it, end - c->start);
+  it = OUTPUT_FMT_LIT(it, ", ");
+  it = output_fmt_str(it, c->name);
+  *it++ = '\n';
+  /* (the line is left uncommitted in the buffer in those cases) */
+  if (paje_out_active())
+    paje_out_passthrough(line, (size_t)(it - line));
+  else if (binout_active())
+    binout_passthrough(line, (size_t)(it - line));
+  else
+    output_commit(it);
+}
+
+static struct Paje_container *
+event_container(struct Paje *p, struct Paje_def const *def,
+    struct Token const *tokens)
+{
+  if (def->pos[FIELD_CONTAINER] < 0)
+    CORRUPT_PAJE(p->lineno);
+  return container_get(p, tokens + def->pos[FIELD_CONTAINER]);
+}
+
+static void
+event_line(struct Paje *p, char const *line, size_t len)
+{
+  struct Token tokens[MAX_FIELDS];
+  int n = tokenize(line, len, tokens);
+  if (!n)
+    return;
+  uint64_t id;
+  if (!token2u64(tokens, &id) || id >= p->ndefs)
+    CORRUPT_PAJE(p->lineno);
+  struct Paje_def const *def = p->defs + id;
+  if (pw.active)
+    writer_input(def, tokens + 1, n - 1, line, len);
+  if (def->event == PAJE_IGNORED)
+    return;
+  /* (the id is not a field) */
+  if (n - 1 < def->nfields)
+    CORRUPT_PAJE(p->lineno);
+  struct Token const *fields = tokens + 1;
+  if (def->event == PAJE_CREATE_CONTAINER) {
+    container_create(p, def, fields);
+    return;
+  } else if (def->event == PAJE_DEFINE_VALUE) {
+    value_define(p, def, fields);
+    return;
+  }
+  if (def->pos[FIELD_TIME] < 0)
+    CORRUPT_PAJE(p->lineno);
+  double time = token2double(p, fields + def->pos[FIELD_TIME]);
+  struct Paje_container *c = NULL;
+  switch (def->event) {
+    case PAJE_DESTROY_CONTAINER:
+      if (def->pos[FIELD_NAME] < 0)
+        CORRUPT_PAJE(p->lineno);
+      c = container_get(p, fields + def->pos[FIELD_NAME]);
+      while (c->depth)
+        state_pop(p, c, time);
+      c->destroyed = true;
+      container_print(c, time);
+      break;
+    case PAJE_SET_STATE:
+      c = event_container(p, def, fields);
+      while (c->depth)
+        state_pop(p, c, time);
+      state_push(p, def, fields, c, time);
+      break;
+    case PAJE_PUSH_STATE:
+      c = event_container(p, def, fields);
+      state_push(p, def, fields, c, time);
+      break;
+    case PAJE_POP_STATE:
+      c = event_container(p, def, fields);
+      state_pop(p, c, time);
+      break;
+    case PAJE_RESET_STATE:
+      c = event_container(p, def, fields);
+      while (c->depth)
+        state_pop(p, c, time);
+      break;
+    case PAJE_START_LINK:
+      link_half(p, def, fields, time, true);
+      break;
+    case PAJE_END_LINK:
+      link_half(p, def, fields, time, false);
+      break;
+    default:
+      assert(false);
+  }
+}
+
+/*
+ * Interface
+ */
+
+void
+paje_read(struct Input *in, struct Arena *arena, struct State ***states,
+    size_t *nstates, struct Link ***links, size_t *nlinks)
+{
+  struct Paje p;
+  memset(&p, 0, sizeof(p));
+  p.arena = arena;
+  size_t len = 0;
+  char const *line = NULL;
+  while ((line = input_next(in, &len))) {
+    p.lineno++;
+    if (pw.active && (line[0] == '#' || line[0] == '%'))
+      writer_header(&p, line, len);
+    if (line[0] == '#')
+      continue;
+    else if (line[0] == '%')
+      header_line(&p, line, len);
+    else
+      event_line(&p, line, len);
+  }
+  /* Whatever is still open ends with the trace */
+  struct Paje_container *c = NULL,
+                        *ctmp = NULL;
+  HASH_ITER(hh, p.containers, c, ctmp) {
+    if (c->depth)
+      LOG_WARNING("%zu states of %s never popped\n", c->depth, c->name);
+    /* (never destroyed, it lasts as long as its events) */
+    if (pw.active && !c->destroyed && c->type)
+      writer_container(c->name, c->parent ? c->parent : "0", c->type, c->start,
+          c->start);
+    for (size_t i = 0; i < c->depth; i++)
+      free(c->stack[i].value);
+    HASH_DEL(p.containers, c);
+    free(c->id);
+    free(c->name);
+    free(c->parent);
+    free(c->type);
+    free(c->stack);
+    free(c);
+  }
+  struct Paje_link *l = NULL,
+                   *ltmp = NULL;
+  HASH_ITER(hh, p.links, l, ltmp) {
+    LOG_WARNING("Link %s never %s\n", l->key, l->started ? "ended" :
+        "started");
+    HASH_DEL(p.links, l);
+    free(l->key);
+    free(l->container);
+    free(l->value);
+    free(l);
+  }
+  struct Paje_value *v = NULL,
+                    *vtmp = NULL;
+  HASH_ITER(hh, p.values, v, vtmp) {
+    HASH_DEL(p.values, v);
+    free(v->alias);
+    free(v->name);
+    free(v);
+  }
+  free(p.defs);
+  /* pj_dump order */
+  qsort(p.states_out, p.nstates, sizeof(*(p.states_out)), item_cmp);
+  qsort(p.links_out, p.nlinks, sizeof(*(p.links_out)), item_cmp);
+  *states = malloc((p.nstates ? p.nstates : 1) * sizeof(**states));
+  *links = malloc((p.nlinks ? p.nlinks : 1) * sizeof(**links));
+  if (!*states || !*links)
+    REPORT_AND_EXIT;
+  for (size_t i = 0; i < p.nstates; i++)
+    (*states)[i] = p.states_out[i].event;
+  for (size_t i = 0; i < p.nlinks; i++)
+    (*links)[i] = p.links_out[i].event;
+  *nstates = p.nstates;
+  *nlinks = p.nlinks;
+  free(p.states_out);
+  free(p.links_out);
+}
@@ -9,13 +9,22 @@
 #include <argp.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "logging.h"
 #include "events.h"
 #include "copytime.h"
-#include "utlist.h"
 #include "queue.h"
 #include "args.h"
 #include "compensation.h"
+#include "output.h"
+#include "binout.h"
+#include "textout.h"
+#include "reorder.h"
+#include "split.h"
+#include "paje.h"
+#include "store.h"
+#include "sends.h"
 #include "pj_dump_read.c"
 
 #define ASSERTSTRTO(nptr, endptr)\
@@ -27,74 +36,92 @@
     }\
   } while(0)
 
+/*
+ * The lock queue of each rank: the first State of the rank that
+ * compensate_loop went through but couldn't compensate yet, and the ones it
+ * went through after it. As each rank is compensated in file order, the lock
+ * queue of rank r is always the States [done[r], seen[r]) of its store.
+ */
+struct Locks {
+  uint32_t *done,
+           *seen;
+};
+
 #if LOG_LEVEL == LOG_LEVEL_DEBUG
 static void
-print_queues(struct State_q **queues, size_t ranks, size_t states)
+print_queues(struct Store const *store, struct Locks const *locks, size_t
+    ranks, size_t states)
 {
   for (size_t i = 0; i < ranks; i++) {
     fprintf(stderr, "%zu [ ", i);
-    struct State_q *head = queues[i];
-    size_t j = 0;
-    while (head && j < states) {
-      if (state_is_recv(head->state))
-        fprintf(stderr, "%s (%d, %p), ", head->state->routine,
-            head->state->comm.c->match->rank,
-            (void *)(head->state->comm.c->match));
+    for (uint32_t j = locks->done[i]; j < locks->seen[i] &&
+        j - locks->done[i] < states; j++) {
+      struct State state;
+      store_get(store, (struct Handle){ (int)i, j }, &state);
+      if (state_is_recv(&state))
+        fprintf(stderr, "%s (%d, %"PRIu32"), ", state.routine,
+            state.comm.c->match.rank, state.comm.c->match.index);
       else
-        fprintf(stderr, "%s (%p), ", head->state->routine, (void *)(head->state));
-      head = head->next;
-      j++;
+        fprintf(stderr, "%s (%"PRIu32"), ", state.routine, j);
     }
     fprintf(stderr, " ],\n");
   }
 }
 #endif
 
-/* DRY */
+/* DRY (complains about non-empty queues, frees them all) */
 #define QUEUES_CLEANUP(queue_, queue_str_, i_, f_)\
   do{\
-    if ((queue_)[(i_)]) {\
+    if ((queue_)[(i_)].len)\
       LOG_ERROR("Queue %s non-empty on rank %zu\n", (queue_str_), (i_));\
-      (f_)(((queue_) + (i_)));\
-    }\
+    (f_)(((queue_) + (i_)));\
   }while(0)
 
+/* Is the lock queue of rank r empty? */
+static inline bool
+lock_is_empty(struct Locks const *locks, int r)
+{
+  return locks->done[r] == locks->seen[r];
+}
+
 static inline bool
-is_head(struct State *state, struct State_q **lock_qs)
+is_head(struct Handle state, struct Locks const *locks)
 {
-  struct State_q *head = lock_qs[state->rank];
-  return (head && head->state == state);
+  return !lock_is_empty(locks, state.rank) &&
+    locks->done[state.rank] == state.index;
 }
 
 /* Circular references in the two functions below */
 static int
-compensate_state(struct State *state, struct Data *data, struct State_q
-    **lock_qs, bool lower);
+compensate_state(struct Handle state, struct Data *data, struct Locks *locks,
+    bool lower);
 
 static int
-compensate_state_recv(struct State *recv, struct State *match, double ostart,
-    double oend, struct Data *data, struct State_q **lock_qs, bool lower)
+compensate_state_recv(struct Handle recv, struct Handle match, double ostart,
+    double oend, struct Data *data, struct Locks *locks, bool lower)
 {
   int ans = 0;
   /* To compensate a recv the matching send should've been compensated first */
-  if (compensated(match, ostart, oend)) {
+  if (compensated(data->store, match, ostart, oend)) {
     compensate_recv_(recv, match, ostart, oend, data, lower);
   /* Or be the head of the lock queue for the rank of the matching send */
-  } else if (is_head(match, lock_qs)) {
+  } else if (is_head(match, locks)) {
     /* OBS: match is guaranteed to be a send */
-    if (!state_is_local(match, data->sync_bytes)) {
+    struct State send;
+    store_get(data->store, match, &send);
+    if (!state_is_local(&send, data->sync_bytes)) {
       compensate_ssend_(recv, match, ostart, oend, data);
-      state_q_pop(lock_qs + match->rank);
+      locks->done[match.rank]++;
     } else {
       /*
-       * An async send might be the head of a lock_q if a non-local event was
-       * the former head and got popped via the state_q_pop above instead of
-       * the compensate_queue state_q_pop. In this case, the recv can either
-       * wait the asend to be compensated as a local event or we can do it
-       * here and now (it is the head after all) like we did with the ssend.
+       * An async send might be the head of a lock queue if a non-local event
+       * was the former head and got popped via the done++ above instead of
+       * the compensate_queue one. In this case, the recv can either wait the
+       * asend to be compensated as a local event or we can do it here and
+       * now (it is the head after all) like we did with the ssend.
        */
-      assert(!compensate_state(match, data, lock_qs, lower));
-      state_q_pop(lock_qs + match->rank);
+      assert(!compensate_state(match, data, locks, lower));
+      locks->done[match.rank]++;
       compensate_recv_(recv, match, ostart, oend, data, lower);
     }
   } else {
@@ -108,59 +135,65 @@ compensate_state_recv(struct State *recv, struct State *match, double ostart,
  * and its members are valid.
  */
 static int
-compensate_state(struct State *state, struct Data *data, struct State_q
-    **lock_qs, bool lower)
+compensate_state(struct Handle h, struct Data *data, struct Locks *locks,
+    bool lower)
 {
+  struct Store const *store = data->store;
+  /* (what is tested of it doesn't change when compensated) */
+  struct State state;
+  store_get(store, h, &state);
   int ans = 0;
-  if (state_is_recv(state)) {
-    assert(state->comm.c);
-    ans = compensate_state_recv(state, state->comm.c->match, state->comm.c->ostart,
-        state->comm.c->oend, data, lock_qs, lower);
-  } else if (state_is_send(state) && !state_is_local(state, data->sync_bytes)) {
+  if (state_is_recv(&state)) {
+    assert(state.comm.c);
+    ans = compensate_state_recv(h, state.comm.c->match, state.comm.c->ostart,
+        state.comm.c->oend, data, locks, lower);
+  } else if (state_is_send(&state) &&
+      !state_is_local(&state, data->sync_bytes)) {
     ans = 1;
-  } else if (state_is_wait(state)) {
-    if (comm_is_sync(state->comm.c, data->sync_bytes)) {
-      if (comm_compensated(state->comm.c))
-        compensate_wait(state, data);
+  } else if (state_is_wait(&state)) {
+    if (comm_is_sync(state.comm.c, data->sync_bytes)) {
+      if (comm_compensated(store, state.comm.c))
+        compensate_wait(h, data);
       else
         ans = 1;
     } else {
-      if (comm_compensated(state->comm.c->match->comm.c))
-        compensate_wait(state, data);
+      if (comm_compensated(store, STORE_AT(store, state.comm.c->match,
+              comm).c))
+        compensate_wait(h, data);
       else
         ans = 1;
     }
-  } else if (state_is_1tn(state)) {
-    assert(state->comm.c);
-    if (state_is_1tns(state)) {
-      if (comm_is_sync(state->comm.c, data->sync_bytes))
+  } else if (state_is_1tn(&state)) {
+    assert(state.comm.c);
+    if (state_is_1tns(&state)) {
+      if (comm_is_sync(state.comm.c, data->sync_bytes))
         ans = 1;
       else
-        compensate_local(state, data);
+        compensate_local(h, data);
     } else {
-      ans = compensate_state_recv(state, state->comm.c->match,
-          state->comm.c->ostart, state->comm.c->oend, data, lock_qs, lower);
+      ans = compensate_state_recv(h, state.comm.c->match,
+          state.comm.c->ostart, state.comm.c->oend, data, locks, lower);
     }
-  } else if (state_is_nt1(state)) {
-    assert(state->comm.g);
-    if (state_is_nt1s(state)) {
-      if (comm_is_sync(state->comm.g, data->sync_bytes))
+  } else if (state_is_nt1(&state)) {
+    assert(state.comm.g);
+    if (state_is_nt1s(&state)) {
+      if (comm_is_sync(state.comm.g, data->sync_bytes))
         ans = 1;
       else
-        compensate_local(state, data);
+        compensate_local(h, data);
     } else {
       ans = 0;
-      for (size_t i = 0; i < state->comm.g->ranks; i++)
-        if (state->comm.g->match[i]) {
-          if (compensate_state_recv(state, state->comm.g->match[i],
-                state->comm.g->ostart[i], state->comm.g->oend[i], data, lock_qs,
+      for (size_t i = 0; i < state.comm.g->ranks; i++)
+        if (state.comm.g->match[i].index != STORE_NONE) {
+          if (compensate_state_recv(h, state.comm.g->match[i],
+                state.comm.g->ostart[i], state.comm.g->oend[i], data, locks,
                 lower))
             LOG_AND_EXIT("GatherRecv could not be compensated because of "
                 "blocking GatherSend. This is yet to be implemented\n");
         }
     }
   } else {
-    compensate_local(state, data);
+    compensate_local(h, data);
   }
   return ans;
 }
@@ -168,64 +201,74 @@ compensate_state(struct State *state, struct Data *data, struct State_q
 // TODO improve this
 /* Try to compensate all enqueued states, popping on success */
 static inline void
-compensate_queue(struct State_q **lock_qs, int offset, struct Data *data, bool
+compensate_queue(struct Locks *locks, int offset, struct Data *data, bool
     lower)
 {
-  while (lock_qs[offset] &&
-      !compensate_state(lock_qs[offset]->state, data, lock_qs, lower))
-    state_q_pop(lock_qs + offset);
+  while (!lock_is_empty(locks, offset) && !compensate_state((struct Handle){
+        offset, locks->done[offset] }, data, locks, lower))
+    locks->done[offset]++;
 }
 
 /* Cycles through non-empty queues, returning an index, or -1 if all empty */
 static int
-cycle(struct State_q **qs, int ranks, int last)
+cycle(struct Locks const *locks, int ranks, int last)
 {
   if (last == -1)
     last = 0;
   int i = (last + 1) % ranks;
-  while (i != last && state_q_is_empty(qs[i]))
+  while (i != last && lock_is_empty(locks, i))
     i = (i + 1) % ranks;
-  if (i == last && state_q_is_empty(qs[i]))
+  if (i == last && lock_is_empty(locks, i))
     return -1;
   return i;
 }
 
-/* Compensate all events in the queue, using a lock mechanism */
+/*
+ * Compensate all the States of store, going through them in the order they
+ * were read and using a lock mechanism
+ */
 static void
-compensate_loop(struct State_q **state_q, struct Data *data, size_t ranks, bool
+compensate_loop(struct Store *store, struct Data *data, size_t ranks, bool
     lower)
 {
-  /* Either calloc or ->next = NULL, because of DL_APPEND(head, head) */
-  struct State_q **lock_qs = calloc(ranks, sizeof(*lock_qs));
-  if (!lock_qs)
+  /* (zeroed cursors are empty queues) */
+  struct Locks locks = {
+    calloc(ranks, sizeof(*(locks.done))),
+    calloc(ranks, sizeof(*(locks.seen)))
+  };
+  if (!locks.done || !locks.seen)
     REPORT_AND_EXIT;
   /* (from here onwards, data and its members are all valid) */
-  struct State_q *head = *state_q;
+  size_t next = 0;
   int lock_head = 0;
-  while (head || lock_head != -1) {
-    if (head) {
-      if (lock_qs[head->state->rank]) {
-        state_q_push_ref(lock_qs + head->state->rank, head->state);
-        compensate_queue(lock_qs, head->state->rank, data, lower);
-      } else if (compensate_state(head->state, data, lock_qs, lower)) {
-        state_q_push_ref(lock_qs + head->state->rank, head->state);
+  while (next < store->len || lock_head != -1) {
+    if (next < store->len) {
+      int const r = store->order[next++];
+      struct Handle const head = { r, locks.seen[r] };
+      if (!lock_is_empty(&locks, r)) {
+        locks.seen[r]++;
+        compensate_queue(&locks, r, data, lower);
+      } else {
+        /* (compensated right away, it never joins the lock queue) */
+        if (!compensate_state(head, data, &locks, lower))
+          locks.done[r]++;
+        locks.seen[r]++;
       }
-      state_q_pop(state_q);
     } else {
-      compensate_queue(lock_qs, lock_head, data, lower);
+      compensate_queue(&locks, lock_head, data, lower);
     }
-    head = *state_q;
-    lock_head = cycle(lock_qs, (int)ranks, lock_head);
+    lock_head = cycle(&locks, (int)ranks, lock_head);
   }
   /* Cleanup */
   for (size_t i = 0; i < ranks; i++)
-    QUEUES_CLEANUP(lock_qs, "Lock", i, state_q_empty);
-  free(lock_qs);
+    if (!lock_is_empty(&locks, (int)i))
+      LOG_ERROR("Queue %s non-empty on rank %zu\n", "Lock", i);
+  free(locks.done);
+  free(locks.seen);
 }
 
 static inline void
-no_matching_comm(struct State const *send, struct State const *recv,
-    struct Link const *link)
+no_matching_comm(bool send, bool recv, struct Link const *link)
 {
   LOG_AND_EXIT("No matching %s for link. Comm from rank %d @ %.15f mark "
       "%"PRIu64" to rank %d @ %.15f. Unsupported routine? Spaces or () in "
@@ -233,107 +276,205 @@ no_matching_comm(struct State const *send, struct State const *recv,
       link->from, link->start, link->mark, link->to, link->end);
 }
 
+/* Link the PTP link to its send, recv and wait (if any), from arena */
 static void
-link_send_recvs(struct Link_q **links, struct State_q **recvs, struct State
-    ***sends, uint64_t *slens, size_t ranks, struct State_q **scattersS,
-    struct State_q **scattersR, struct State_q **gathersS, struct State_q
-    **gathersR)
+link_ptp(struct Arena *arena, struct Store *store, struct State_q *recvs,
+    struct Sends *sends, struct Link const *link)
 {
+  assert(link_is_ptp(link));
+  struct Handle const recv = { link->to, state_q_front(recvs + link->to) },
+                      send = { link->from, sends_take(sends + link->from,
+                          link->mark) };
+  if (send.index == STORE_NONE || recv.index == STORE_NONE)
+    no_matching_comm(send.index != STORE_NONE, recv.index != STORE_NONE,
+        link);
+  /*
+   * TODO I don't think we need send->comm.c, just pass recv->comm.c to the
+   * test functions
+   * This order is important. Send creates a comm only with msg byte info
+   * (TODO transfer this information to the state struct?), recv then
+   * creates a comm linking it to the send, and finally the wait links
+   * itself to that recv, giving the graph containing no cyclic references
+   * (described in the Hacking/Notes section of README.org)
+   */
+  struct Comm const *c = STORE_AT(store, send, comm).c;
+  struct Handle const wait = c ? c->match : (struct Handle){ -1, STORE_NONE };
+  STORE_AT(store, send, comm).c = comm_new(arena, store, NULL, NULL,
+      link->bytes);
+  STORE_AT(store, send, mark) = link->mark;
+  STORE_AT(store, recv, comm).c = comm_new(arena, store, &send,
+      link->container, link->bytes);
+  STORE_AT(store, recv, mark) = link->mark;
+  if (wait.index != STORE_NONE) {
+    STORE_AT(store, wait, comm).c = comm_new(arena, store, &recv,
+        link->container, link->bytes);
+    // TODO isn't this already done @ pj_dump_read.c?
+    STORE_AT(store, wait, mark) = link->mark;
+  }
+  state_q_pop(recvs + link->to);
+}
+
+/* The ranks linked by link_ptps, each taken by the next free thread */
+struct Ptp_job {
+  struct Store *store;
+  struct Link_q *links;
+  struct State_q *recvs;
+  struct Sends *sends;
+  size_t ranks,
+         next;
+  pthread_mutex_t lock;
+};
+
+struct Ptp_worker {
+  struct Ptp_job *job;
+  /* Where the comms go */
+  struct Arena *arena;
+  pthread_t thread;
+};
+
+/*
+ * Link the PTP links of the ranks taken, in order, leaving only the collective
+ * links in their queues (in order too)
+ */
+static void *
+ptp_worker(void *arg)
+{
+  struct Ptp_worker *worker = arg;
+  struct Ptp_job *job = worker->job;
+  for (;;) {
+    pthread_mutex_lock(&(job->lock));
+    size_t i = job->next++;
+    pthread_mutex_unlock(&(job->lock));
+    if (i >= job->ranks)
+      break;
+    struct Link_q *q = job->links + i;
+    for (size_t n = q->len; n > 0; n--) {
+      struct Link *link = link_q_front(q);
+      link_q_pop(q);
+      if (link_is_1tn(link) || link_is_nt1(link)) {
+        /* (never grows, one was just popped) */
+        link_q_push_ref(q, link);
+      } else {
+        assert(link->to == (int)i);
+        link_ptp(worker->arena, job->store, job->recvs, job->sends, link);
+      }
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Link the PTP links of every rank, with up to jobs threads. A PTP link only
+ * touches the recv queue of its rank, its send (with its wait), claimed with
+ * sends_take, and the comms it creates, each thread putting them in an arena
+ * of its own. When a rank indexes some mark twice, which Send a link gets
+ * depends on the ones linked before, so the ranks are linked in order by a
+ * single thread instead.
+ */
+static void
+link_ptps(struct Arena *arena, struct Store *store, struct Link_q
+    *links, struct State_q *recvs, struct Sends *sends, size_t ranks, unsigned
+    jobs)
+{
+  struct Ptp_job job = { store, links, recvs, sends, ranks, 0,
+    PTHREAD_MUTEX_INITIALIZER };
+  size_t nthreads = jobs < ranks ? jobs : ranks;
+  for (size_t i = 0; i < ranks && nthreads > 1; i++)
+    if (sends[i].dups)
+      nthreads = 1;
+  if (nthreads < 2) {
+    struct Ptp_worker worker = { .job = &job, .arena = arena };
+    ptp_worker(&worker);
+  } else {
+    struct Ptp_worker *workers = calloc(nthreads, sizeof(*workers));
+    struct Arena *arenas = calloc(nthreads, sizeof(*arenas));
+    if (!workers || !arenas)
+      REPORT_AND_EXIT;
+    for (size_t i = 0; i < nthreads; i++) {
+      workers[i].job = &job;
+      workers[i].arena = arenas + i;
+      if ((errno = pthread_create(&(workers[i].thread), NULL, ptp_worker,
+              workers + i)))
+        REPORT_AND_EXIT;
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+      if ((errno = pthread_join(workers[i].thread, NULL)))
+        REPORT_AND_EXIT;
+      arena_merge(arena, arenas + i);
+    }
+    free(workers);
+    free(arenas);
+  }
+  pthread_mutex_destroy(&(job.lock));
+}
+
+static void
+link_send_recvs(struct Arena *arena, struct Store *store, struct Link_q *links,
+    struct State_q *recvs, struct Sends *sends, size_t ranks, struct State_q
+    *scattersS, struct State_q *scattersR, struct State_q *gathersS, struct
+    State_q *gathersR, unsigned jobs)
+{
+  /* (every rank at once, linking one doesn't touch the links of another) */
+  link_qs_sort_e(links, ranks, jobs);
+  link_ptps(arena, store, links, recvs, sends, ranks, jobs);
+  /* The collective links left, in a deterministic order */
   for (size_t i = 0; i < ranks; i++) {
-    DL_SORT(links[i], link_q_sort_e);
-    struct Link_q *link_e = NULL,
-                  *link_tmp = NULL;
-    DL_FOREACH_SAFE(links[i], link_e, link_tmp) {
-      struct Link *link = link_e->link;
-      assert(link);
+    struct Link *link = NULL;
+    while ((link = link_q_front(links + i))) {
       if (link_is_1tn(link)) {
         // FIXME we should somehow pop the link at the 'for' below
-        if (!scattersS[link->from]) {
+        if (state_q_is_empty(scattersS + link->from)) {
           LOG_DEBUG("No ScattersS for link->from %d\n", link->from);
           link_q_pop(links + i);
           continue;
         }
-        struct State *scatterS = scattersS[link->from]->state;
-        scatterS->comm.c = comm_new(NULL, NULL, link->bytes);
-        struct Comm *comm_recvs = comm_new(scatterS, link->container,
+        struct Handle const scatterS = { link->from,
+          state_q_front(scattersS + link->from) };
+        STORE_AT(store, scatterS, comm).c = comm_new(arena, store, NULL, NULL,
             link->bytes);
+        struct Comm *comm_recvs = comm_new(arena, store, &scatterS,
+            link->container, link->bytes);
         for (size_t j = 0; j < ranks; j++) {
           if (j != (size_t)(link->from)) {
-            assert(scattersR[j]);
-            struct State *scatterR = scattersR[j]->state;
-            scatterR->comm.c = comm_recvs;
-            ref_inc(&(comm_recvs->ref));
+            struct Handle const scatterR = { (int)j,
+              state_q_front(scattersR + j) };
+            assert(scatterR.index != STORE_NONE);
+            STORE_AT(store, scatterR, comm).c = comm_recvs;
             // TODO perhaps we should have independent marks for 1TN?
-            scatterR->mark = scatterS->mark;
+            STORE_AT(store, scatterR, mark) = STORE_AT(store, scatterS, mark);
             state_q_pop(scattersR + j);
           }
         }
-        ref_dec(&(comm_recvs->ref));
         state_q_pop(scattersS + link->from);
       } else if (link_is_nt1(link)) {
-        if (!gathersS[link->from]) {
+        if (state_q_is_empty(gathersS + link->from)) {
           LOG_DEBUG("Not GathersS for link->from %d\n", link->from);
           link_q_pop(links + i);
           continue;
         }
-        struct State *gatherR = gathersR[link->to]->state;
-        struct State **gather_sends = calloc(ranks, sizeof(*gather_sends));
-        if (!gather_sends)
-          REPORT_AND_EXIT;
-        struct Comm *comm_sends = comm_new(gatherR, link->container,
-            link->bytes);
+        struct Handle const gatherR = { link->to,
+          state_q_front(gathersR + link->to) };
+        struct Handle *gather_sends = arena_alloc(arena, ranks *
+            sizeof(*gather_sends));
+        for (size_t j = 0; j < ranks; j++)
+          gather_sends[j] = (struct Handle){ (int)j, STORE_NONE };
+        struct Comm *comm_sends = comm_new(arena, store, &gatherR,
+            link->container, link->bytes);
         for (size_t j = 0; j < ranks; j++) {
           if (j != (size_t)(link->to)) {
-            if (!gathersS[j])
+            struct Handle const gatherS = { (int)j,
+              state_q_front(gathersS + j) };
+            if (gatherS.index == STORE_NONE)
               LOG_AND_EXIT("No gather (send) at rank %zu for gather (recv) at "
                   "rank %zu", j, i);
-            struct State *gatherS = gathersS[j]->state;
-            gatherS->comm.c = comm_sends;
-            ref_inc(&(comm_sends->ref));
+            STORE_AT(store, gatherS, comm).c = comm_sends;
             gather_sends[j] = gatherS;
-            ref_inc(&(gatherS->ref));
             state_q_pop(gathersS + j);
           }
         }
-        gatherR->comm.g = gcomm_new(gather_sends, link->container,
-            link->bytes, ranks);
-        ref_dec(&(comm_sends->ref));
+        STORE_AT(store, gatherR, comm).g = gcomm_new(arena, store,
+            gather_sends, link->container, link->bytes, ranks);
         state_q_pop(gathersR + link->to);
-      } else {
-        assert(link->to == (int)i && link_is_ptp(link));
-        if (slens[link->from] <= link->mark)
-          no_matching_comm(NULL, NULL, link);
-        struct State *recv = recvs[link->to]->state;
-        struct State *send = sends[link->from][link->mark];
-        if (!send || !recv)
-          no_matching_comm(send, recv, link);
-        /*
-         * TODO I don't think we need send->comm.c, just pass recv->comm.c to the
-         * test functions
-         * This order is important. Send creates a comm only with msg byte info
-         * (TODO transfer this information to the state struct?), recv then
-         * creates a comm linking it to the send, and finally the wait links
-         * itself to that recv, giving the graph containing no cyclic references
-         * (described in the Hacking/Notes section of README.org)
-         */
-        struct State *wait = NULL;
-        if (send->comm.c) {
-          wait = send->comm.c->match;
-          assert(send->comm.c->ref.count == 1 && wait->ref.count == 2);
-          ref_dec(&(send->comm.c->ref));
-        }
-        send->comm.c = comm_new(NULL, NULL, link->bytes);
-        send->mark = link->mark;
-        recv->comm.c = comm_new(send, link->container, link->bytes);
-        recv->mark = link->mark;
-        if (wait) {
-          wait->comm.c = comm_new(recv, link->container, link->bytes);
-          // TODO isn't this already done @ pj_dump_read.c?
-          wait->mark = link->mark;
-        }
-        sends[link->from][link->mark] = NULL;
-        ref_dec(&(send->ref));
-        state_q_pop(recvs + link->to);
       }
       link_q_pop(links + i);
     }
@@ -341,21 +482,17 @@ link_send_recvs(struct Link_q **links, struct State_q **recvs, struct State
   /* Cleanup */
   for (size_t i = 0; i < ranks; i++) {
     /* This inner loop is not necessary, it's just a check */
-    for (size_t j = 0; j < slens[i]; j++)
-      if (sends[i][j]) {
-        LOG_ERROR("Queue Sends non-empty on rank %zu\n", i);
-        ref_dec(&(sends[i][j]->ref));
-      }
+    for (size_t j = sends_pending(sends + i); j > 0; j--)
+      LOG_ERROR("Queue Sends non-empty on rank %zu\n", i);
     QUEUES_CLEANUP(links, "Link", i, link_q_empty);
     QUEUES_CLEANUP(recvs, "Recv", i, state_q_empty);
     QUEUES_CLEANUP(scattersS, "scattersS", i, state_q_empty);
     QUEUES_CLEANUP(scattersR, "scattersR", i, state_q_empty);
     QUEUES_CLEANUP(gathersS, "gathersS", i, state_q_empty);
     QUEUES_CLEANUP(gathersR, "gathersR", i, state_q_empty);
-    free(sends[i]);
+    sends_empty(sends + i);
   }
   free(sends);
-  free(slens);
   free(links);
   free(recvs);
   free(scattersS);
@@ -365,36 +502,42 @@ link_send_recvs(struct Link_q **links, struct State_q **recvs, struct State
 }
 
 static void
-compensate(char const *filename, bool lower, struct Data *data)
+compensate(char *const *filenames, size_t nfiles, unsigned jobs, bool lower,
+    struct Data *data)
 {
   assert(data);
-  struct State_q *state_q = NULL;
   size_t ranks = 0;
   /*
    * These are temporary queues used link sends to recvs. More details, see the
    * (lengthy) explanation on pj_dump_parse.c
    */
-  struct Link_q **links = NULL;
-  struct State_q **recvs = NULL,
-                 **scattersS = NULL,
-                 **scattersR = NULL,
-                 **gathersS = NULL,
-                 **gathersR = NULL;
-  struct State ***sends = NULL;
-  uint64_t *slens = NULL;
+  struct Link_q *links = NULL;
+  struct State_q *recvs = NULL,
+                 *scattersS = NULL,
+                 *scattersR = NULL,
+                 *gathersS = NULL,
+                 *gathersR = NULL;
+  struct Sends *sends = NULL;
+  /* Every event of the trace (and their comms), see arena.h */
+  struct Arena arena;
+  memset(&arena, 0, sizeof(arena));
+  /* Every State of the trace */
+  struct Store store;
+  memset(&store, 0, sizeof(store));
   /* (allocate and fill) */
   data->timestamps.last = NULL;
   data->timestamps.c_last = NULL;
-  read_events(filename, &ranks, &state_q, &links, &sends, &recvs, &slens,
-      &(data->timestamps.last), &(data->timestamps.c_last), &scattersS,
-        &scattersR, &gathersS, &gathersR);
+  data->store = &store;
+  read_events(filenames, nfiles, jobs, &arena, &store, &ranks, &links, &sends,
+      &recvs, &(data->timestamps.last), &(data->timestamps.c_last),
+      &scattersS, &scattersR, &gathersS, &gathersR);
   /* (empty and free) */
-  link_send_recvs(links, recvs, sends, slens, ranks, scattersS, scattersR,
-      gathersS, gathersR);
+  link_send_recvs(&arena, &store, links, recvs, sends, ranks, scattersS,
+      scattersR, gathersS, gathersR, jobs);
   /* Compensate the queues, printing the results, cleanup */
-  compensate_loop(&state_q, data, ranks, lower);
-  QUEUES_CLEANUP(&state_q, "State", (size_t)0, state_q_empty);
-  free(state_q);
+  compensate_loop(&store, data, ranks, lower);
+  store_release(&store);
+  arena_release(&arena);
   free(data->timestamps.last);
   free(data->timestamps.c_last);
 }
@@ -406,6 +549,9 @@ main(int argc, char **argv)
   struct arguments args;
   memset(&args, 0, sizeof(args));
   args.lower = false;
+  args.traces = malloc((size_t)argc * sizeof(*(args.traces)));
+  if (!args.traces)
+    REPORT_AND_EXIT;
   if (argp_parse(&argp, argc, argv, 0, 0, &args) == ARGP_KEY_ERROR)
     LOG_AND_EXIT("Unknown error while parsing parameters\n");
   char *endptr = NULL;
@@ -422,9 +568,40 @@ main(int argc, char **argv)
     copytime,
     /* Timestamp info, to be initialized by compensate() */
     { NULL, NULL },
-    sync_bytes
+    sync_bytes,
+    /* The States, to be read by compensate() */
+    NULL
   };
-  compensate(args.input[0], args.lower, &data);
+  if (!args.jobs) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    args.jobs = cpus > 0 ? (unsigned)cpus : 1;
+  }
+  /* (before reading, passthrough lines are written as they are read) */
+  output_async();
+  if (args.binary)
+    binout_start();
+  else if (args.paje)
+    paje_out_start();
+  else if (args.split)
+    split_start(args.split, args.jobs);
+  else if (args.jobs > 1)
+    textout_start(args.jobs);
+  if (args.sort)
+    reorder_start(args.sort);
+  compensate(args.traces, args.ntraces, args.jobs, args.lower, &data);
+  if (reorder_active())
+    reorder_finish();
+  if (args.binary)
+    binout_finish();
+  else if (paje_out_active())
+    paje_out_finish();
+  else if (split_active())
+    split_finish();
+  else if (textout_active())
+    textout_finish();
   copytime_del(&copytime);
+  free(args.traces);
+  intern_release();
+  output_close();
   return 0;
 }
@@ -1,37 +1,36 @@
 /* Read a pj_dump trace file into the event queues */
 /*
- * Every rank has an array of pointers to States, where we store all Sends to
- * later on link to Recvs.
+ * Every rank has an index of the handles of its Sends by mark (see sends.h),
+ * where we store all Sends to later on link to Recvs.
  *
- * [ * * * ... ] Outer arr, one inner arr per rank, State ***
- *   ^ [ * * * ...] Inner arr, one element per event in that rank, State **
- *       ^ The event pointer, State *
+ * [ * * * ... ] Outer arr, one index per rank, struct Sends *
+ *   ^ { mark -> * } Index, one element per Send in that rank
+ *       ^ The handle of the Send in the store of its rank, uint32_t
  *
- * The innermost array holds pointers because the structs are ref counted and
- * can be recycled this way.
+ * The States themselves are copied to the columns of the store (see store.h)
+ * as they are read, the queues keeping their indexes in the store of their
+ * rank. The Links and Comms go to the arena of the trace, their strings being
+ * interned (see intern.h). Whatever parses the trace allocates from an arena
+ * of its own, only needed until the events are copied out of it.
  *
- * We grow the arrs dynamically so the user doesn't have to inform the number
- * of ranks or the number of Sends per rank, so we need to use realloc, thus we
- * need to pass &outer_arr, thus having struct *****, which we typedef below
- * for sanity.
+ * The user doesn't have to inform the number of ranks or the number of Sends
+ * per rank. Whenever the trace can be read twice they are counted beforehand
+ * (see Sizing below) and every array (and index) is allocated once, at its
+ * final size. Otherwise they grow as the trace is read, so we need to use
+ * realloc, thus we need to pass &outer_arr.
  *
- * The growing of the arrays works like this: The outer array always has an
- * exact known size equal to the highest rank found so far. The inner arrays
- * have each their own, independent number of elements, equal to the number of
- * events in that rank so far (it grows with time), and a cap (the actual size
- * allocated), also independent between the ranks. The cap is doubled every
- * time it is reached. Thus we have the following auxiliary arrays:
- *
- * scaps - The array of caps for the send arrs (one cap per rank)
- * slens - The array of #eles for the send arrs (one #ele per rank)
+ * The growing of the arrays works like this: The outer arrays have a cap that
+ * doubles whenever a higher rank is found, the first *ranks (the highest rank
+ * found so far, plus one) being used. The indexes have each their own,
+ * independent number of Sends, which grows with time, and room for them,
+ * doubled every time it is reached (see sends.h).
  *
  * Rationale and how we link Recvs and Sends:
  *
- * Why not use a double linked list, since the arrs represent a FIFO queue, one
- * might ask. We actually use this for the recv and link queues, because it's
- * simpler than arrays that grow. We shouldn't use for the send queue because
- * we associate sends with recvs using send_mark, and it'd be O(n) with a DL
- * list:
+ * Why not use a FIFO queue (see queue.h), since the arrs represent one, one
+ * might ask. We actually use those for the recv and link queues. We shouldn't
+ * use one for the send queue because we associate sends with recvs using
+ * send_mark, which indexes every send of the rank, not just the pending ones:
  *
  * for each rank in ranks:
  *   sort_by_end_time(links[rank])
@@ -48,7 +47,7 @@
  * [ 2t0 2t0 2t1 1t0 1t0 2t0] Links
  * (all sends are asynchronous)
  *
- * How can we link recvs with sends in this case? If we were to use a DL FIFO:
+ * How can we link recvs with sends in this case? If we were to use a FIFO:
  *
  * The link only has info about the send (send rank and send mark) and the recv
  * rank, but not a recv mark, so we need to align the link queue to the recv
@@ -95,184 +94,1338 @@
 #include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
+#include <float.h>
+#include <pthread.h>
 #include "logging.h"
-#include "ref.h"
 #include "events.h"
+#include "intern.h"
 #include "queue.h"
+#include "store.h"
+#include "sends.h"
+#include "input.h"
+#include "bintrace.h"
+#include "paje.h"
+#include "output.h"
+#include "binout.h"
+
+/* What read_events fills, bundled so it can be passed around */
+struct Events {
+  size_t *ranks,
+         /* The cap of the outer arrs/queues, at least *ranks */
+         cap;
+  struct Link_q **links;
+  struct Sends **sends;
+  struct State_q **recvs,
+                 **scattersS,
+                 **scattersR,
+                 **gathersS,
+                 **gathersR;
+  double **last,
+         **clast;
+  /* Where the events read are copied to, see arena.h and store.h */
+  struct Arena *arena;
+  struct Store *store;
+  /* Where the main thread parses to, cleared once copied from */
+  struct Arena scratch;
+  /* Online linking (see below), pending being NULL when it is off */
+  struct Link_h *pending;
+  double *bound;
+  struct Bound *bounds;
+  size_t nbounds,
+         next_bound;
+};
+
+/* Resize the outer arrs/queues to cap, initializing the new ranks */
+static void
+events_grow(struct Events *ev, size_t cap)
+{
+  *(ev->recvs) = realloc(*(ev->recvs), cap * sizeof(**(ev->recvs)));
+  *(ev->links) = realloc(*(ev->links), cap * sizeof(**(ev->links)));
+  *(ev->sends) = realloc(*(ev->sends), cap * sizeof(**(ev->sends)));
+  *(ev->last) = realloc(*(ev->last), cap * sizeof(**(ev->last)));
+  *(ev->clast) = realloc(*(ev->clast), cap * sizeof(**(ev->clast)));
+  *(ev->scattersS) = realloc(*(ev->scattersS), cap *
+      sizeof(**(ev->scattersS)));
+  *(ev->scattersR) = realloc(*(ev->scattersR), cap *
+      sizeof(**(ev->scattersR)));
+  *(ev->gathersS) = realloc(*(ev->gathersS), cap * sizeof(**(ev->gathersS)));
+  *(ev->gathersR) = realloc(*(ev->gathersR), cap * sizeof(**(ev->gathersR)));
+  if (!*(ev->recvs) || !*(ev->links) || !*(ev->sends) || !*(ev->last) ||
+      !*(ev->clast) || !*(ev->scattersS) || !*(ev->scattersR) ||
+      !*(ev->gathersS) || !*(ev->gathersR))
+    REPORT_AND_EXIT;
+  if (ev->pending) {
+    ev->pending = realloc(ev->pending, cap * sizeof(*(ev->pending)));
+    ev->bound = realloc(ev->bound, cap * sizeof(*(ev->bound)));
+    if (!ev->pending || !ev->bound)
+      REPORT_AND_EXIT;
+  }
+  for (size_t i = ev->cap; i < cap; i++) {
+    memset(*(ev->sends) + i, 0, sizeof(**(ev->sends)));
+    memset(*(ev->links) + i, 0, sizeof(**(ev->links)));
+    memset(*(ev->recvs) + i, 0, sizeof(**(ev->recvs)));
+    (*(ev->last))[i] = -1;
+    (*(ev->clast))[i] = 0;
+    memset(*(ev->scattersS) + i, 0, sizeof(**(ev->scattersS)));
+    memset(*(ev->scattersR) + i, 0, sizeof(**(ev->scattersR)));
+    memset(*(ev->gathersS) + i, 0, sizeof(**(ev->gathersS)));
+    memset(*(ev->gathersR) + i, 0, sizeof(**(ev->gathersR)));
+    if (ev->pending) {
+      /* (a rank the pre-scan missed, nothing can be told of its Links) */
+      memset(ev->pending + i, 0, sizeof(*(ev->pending)));
+      ev->bound[i] = -DBL_MAX;
+    }
+  }
+  ev->cap = cap;
+}
+
+/* Make sure there is room for rank in all outer arrs */
+static inline void
+events_reserve(struct Events *ev, int rank)
+{
+  size_t new_size = (size_t)rank + 1;
+  if (new_size <= *(ev->ranks))
+    return;
+  if (new_size > ev->cap)
+    events_grow(ev, new_size > 2 * ev->cap ? new_size : 2 * ev->cap);
+  *(ev->ranks) = new_size;
+}
+
+/* Store (a copy of) a link read from the trace */
+static void
+events_push_link(struct Events *ev, struct Link *link)
+{
+  events_reserve(ev, link->to);
+  /* (the PTP Links of link_ptps, see Online linking) */
+  if (ev->pending && !link_is_1tn(link) && !link_is_nt1(link)) {
+    link_h_push(ev->pending + link->to, link);
+    return;
+  }
+  struct Link *copy = arena_alloc(ev->arena, sizeof(*copy));
+  *copy = *link;
+  link = copy;
+  link_q_push_ref((*(ev->links)) + link->to, link);
+}
+
+/* Store (a copy of) a state read from the trace */
+static void
+events_push_state(struct Events *ev, struct State *state)
+{
+  struct Store *store = ev->store;
+  uint32_t const index = store_push(store, state);
+  events_reserve(ev, state->rank);
+  int const rank = state->rank;
+  if ((*(ev->last))[rank] < 0)
+    (*(ev->last))[rank] = state->start;
+  if (state_is_send(state)) {
+    sends_push(*(ev->sends) + rank, state->mark, index);
+  } else if (state_is_recv(state)) {
+    state_q_push((*(ev->recvs)) + rank, index);
+  } else if (state_is_wait(state)) {
+    /*
+     * For now we only support MPI_Wait for MPI_Isend (->mark). Thus,
+     * MPI_Wait is always in the same rank as the matching MPI_Isend and
+     * always comes after it, so we can assume the matching send has
+     * already been processed and create a temporary comm in here, to be
+     * used later to link the MPI_Wait to the MPI_Recv it is actually
+     * waiting for (we assume MPI_Isend was synchronous, albeit
+     * instantaneous, and we assert for that).
+     */
+    uint32_t const *handle = sends_find(*(ev->sends) + rank, state->mark);
+    if (!handle) {
+      LOG_CRITICAL("There is no Send for the Wait. Did you call MPI_Wait "
+          "without (or before) a matching MPI_Isend? This is not "
+          "supported.\n");
+      exit(EXIT_FAILURE);
+    }         // TODO can this be moved to pj_compensate.c with the rest?
+    struct Handle const send = { rank, *handle },
+                        wait = { rank, index };
+    assert(STORE_AT(store, send, mark) == state->mark);
+    struct Comm const *c = STORE_AT(store, send, comm).c;
+    /* (unless linked already, see Online linking) */
+    if (c && c->container)
+      STORE_AT(store, wait, comm).c = comm_new(ev->arena, store, &(c->match),
+          c->container, c->bytes);
+    else
+      STORE_AT(store, send, comm).c = comm_new(ev->arena, store, &wait, NULL,
+          0);
+  // TODO dont use a separate queue for scatter/gather
+  } else if (state_is_1tn(state)) {
+    if (state_is_1tns(state))
+      state_q_push((*(ev->scattersS)) + rank, index);
+    else
+      state_q_push((*(ev->scattersR)) + rank, index);
+  } else if (state_is_nt1(state)) {
+    if (state_is_nt1s(state))
+      state_q_push((*(ev->gathersS)) + rank, index);
+    else
+      state_q_push((*(ev->gathersR)) + rank, index);
+  }
+}
+
+/* A parsed line, either a State, a Link, or a line to pass through */
+struct Parsed {
+  enum Record type;
+  size_t len;
+  union {
+    struct State *state;
+    struct Link *link;
+    char const *line;
+  } u;
+};
+
+/* Pass a line that is neither a State nor a Link through to the output */
+static inline void
+passthrough(char const *line, size_t len)
+{
+  if (paje_out_active())
+    paje_out_passthrough(line, len);
+  else if (binout_active())
+    binout_passthrough(line, len);
+  else
+    output_write(line, len);
+}
+
+/* Store a parsed record (passing lines through) */
+static void
+events_push_parsed(struct Events *ev, struct Parsed const *rec)
+{
+  if (rec->type == RECORD_STATE) {
+    events_push_state(ev, rec->u.state);
+  } else if (rec->type == RECORD_LINK) {
+    events_push_link(ev, rec->u.link);
+  } else {
+    LOG_DEBUG("Line is not a State nor a Link\n");
+    passthrough(rec->u.line, rec->len);
+  }
+}
+
+/*
+ * Online linking
+ *
+ * Every Link could be kept until the trace is read, for link_send_recvs to
+ * sort them by end time and link them then. When the trace is pre-scanned (see
+ * Sizing), the PTP Links are linked while it is read instead, as soon as
+ * nothing read later can change what they get, so that only the Links in
+ * flight are kept, each in a heap of its receiving rank (see queue.h).
+ *
+ * The k-th PTP Link of a rank by end time gets its k-th Recv, so the first
+ * Link of a heap can be linked once no Link read later can end before it. The
+ * pre-scan notes the earliest end of the Links to each rank in every segment
+ * of ONLINE_SEG bytes of the trace, and the minimum of those from the segment
+ * being read on bounds the ends still to come (see online_check). Its Recv and
+ * its Send must have been read too, or the Link waits for them.
+ *
+ * Which Send a Link gets doesn't depend on the order Links are linked in only
+ * as long as no mark is indexed twice, so the pre-scan also checks that the
+ * marks of the Sends of every rank increase. When they don't, or the trace
+ * isn't pre-scanned, link_send_recvs links every Link, as before.
+ *
+ * A Send linked online keeps its Recv in its comm until the trace is read, so
+ * that a Wait read after it still gets linked to that Recv (see
+ * events_push_state). online_finish then gives it the comm link_send_recvs
+ * would have, and hands the Links left to link_send_recvs.
+ */
+
+#define ONLINE_SEG ((size_t)4 << 20)
+
+/* The earliest end of the Links to rank in segment seg of the trace */
+struct Bound {
+  uint32_t seg;
+  int rank;
+  double end;
+};
+
+/* What the pre-scan (of some range of the trace) tells online linking */
+struct Order {
+  bool scanned,
+       /* Whether some rank has a Send mark no greater than a previous one */
+       unordered;
+  /* The first mark and the last plus one, of the Sends of each rank */
+  uint64_t *first,
+           *next;
+  /* The bounds of every segment scanned before the one being scanned */
+  struct Bound *bounds;
+  size_t len,
+         room;
+  /* The segment being scanned, its earliest ends and the ranks it has */
+  uint32_t seg;
+  uint32_t *stamp;
+  double *min;
+  int *touched;
+  size_t ntouched;
+  /* The room of the per rank arrays */
+  size_t cap;
+};
+
+/* Make room for rank in the per rank arrays of order */
+static void
+order_room(struct Order *order, int rank)
+{
+  size_t new_size = (size_t)rank + 1;
+  if (new_size <= order->cap)
+    return;
+  size_t cap = new_size > 2 * order->cap ? new_size : 2 * order->cap;
+  order->first = realloc(order->first, cap * sizeof(*(order->first)));
+  order->next = realloc(order->next, cap * sizeof(*(order->next)));
+  order->stamp = realloc(order->stamp, cap * sizeof(*(order->stamp)));
+  order->min = realloc(order->min, cap * sizeof(*(order->min)));
+  order->touched = realloc(order->touched, cap * sizeof(*(order->touched)));
+  if (!order->first || !order->next || !order->stamp || !order->min ||
+      !order->touched)
+    REPORT_AND_EXIT;
+  for (size_t i = order->cap; i < cap; i++) {
+    order->first[i] = UINT64_MAX;
+    order->next[i] = 0;
+    order->stamp[i] = 0;
+  }
+  order->cap = cap;
+}
+
+/* Note a Send of rank with mark */
+static void
+order_send(struct Order *order, int rank, uint64_t mark)
+{
+  if (rank < 0)
+    return;
+  order_room(order, rank);
+  /* (UINT64_MAX being a mark that couldn't be read) */
+  if (mark == UINT64_MAX || mark < order->next[rank])
+    order->unordered = true;
+  if (order->first[rank] == UINT64_MAX)
+    order->first[rank] = mark;
+  order->next[rank] = mark + 1;
+}
+
+/* Make room for n more bounds */
+static void
+order_bounds(struct Order *order, size_t n)
+{
+  if (order->len + n <= order->room)
+    return;
+  order->room = order->len + n > 2 * order->room ? order->len + n :
+    2 * order->room;
+  order->bounds = realloc(order->bounds, order->room *
+      sizeof(*(order->bounds)));
+  if (!order->bounds)
+    REPORT_AND_EXIT;
+}
+
+/* Note the bounds of the segment being scanned, leaving it empty */
+static void
+order_flush(struct Order *order)
+{
+  order_bounds(order, order->ntouched);
+  for (size_t i = 0; i < order->ntouched; i++) {
+    struct Bound *bound = order->bounds + order->len++;
+    bound->seg = order->seg;
+    bound->rank = order->touched[i];
+    bound->end = order->min[order->touched[i]];
+  }
+  order->ntouched = 0;
+}
+
+/* Note a Link to rank ending at end, at segment seg (in file order) */
+static void
+order_link(struct Order *order, uint32_t seg, int rank, double end)
+{
+  if (rank < 0)
+    return;
+  order_room(order, rank);
+  if (seg != order->seg) {
+    order_flush(order);
+    order->seg = seg;
+  }
+  /* (stamps are segments plus one, zero being none) */
+  if (order->stamp[rank] != seg + 1) {
+    order->stamp[rank] = seg + 1;
+    order->min[rank] = end;
+    order->touched[order->ntouched++] = rank;
+  } else if (end < order->min[rank]) {
+    order->min[rank] = end;
+  }
+}
+
+/* Add what src tells of the (flushed) range right after that of dst to dst */
+static void
+order_merge(struct Order *dst, struct Order const *src)
+{
+  dst->unordered |= src->unordered;
+  for (size_t i = src->cap; i-- > 0;) {
+    if (src->first[i] == UINT64_MAX)
+      continue;
+    order_room(dst, (int)i);
+    if (src->first[i] < dst->next[i])
+      dst->unordered = true;
+    if (dst->first[i] == UINT64_MAX)
+      dst->first[i] = src->first[i];
+    dst->next[i] = src->next[i];
+  }
+  if (!src->len)
+    return;
+  order_bounds(dst, src->len);
+  memcpy(dst->bounds + dst->len, src->bounds, src->len *
+      sizeof(*(src->bounds)));
+  dst->len += src->len;
+}
+
+static void
+order_release(struct Order *order)
+{
+  free(order->first);
+  free(order->next);
+  free(order->bounds);
+  free(order->stamp);
+  free(order->min);
+  free(order->touched);
+  memset(order, 0, sizeof(*order));
+}
+
+/*
+ * Start linking online what the pre-scanned order allows, once the per rank
+ * arrays are sized. Takes the bounds of order.
+ */
+static void
+online_start(struct Events *ev, struct Order *order)
+{
+  if (!order->scanned || order->unordered || !ev->cap)
+    return;
+  ev->pending = calloc(ev->cap, sizeof(*(ev->pending)));
+  ev->bound = malloc(ev->cap * sizeof(*(ev->bound)));
+  if (!ev->pending || !ev->bound)
+    REPORT_AND_EXIT;
+  for (size_t i = 0; i < ev->cap; i++)
+    ev->bound[i] = DBL_MAX;
+  /*
+   * From the last segment back, each bound becomes the bound of its rank once
+   * its segment is read, and the bound of the first segment is left
+   */
+  for (size_t i = order->len; i-- > 0;) {
+    struct Bound *b = order->bounds + i;
+    if ((size_t)(b->rank) >= ev->cap)
+      continue;
+    double end = b->end;
+    b->end = ev->bound[b->rank];
+    if (end < ev->bound[b->rank])
+      ev->bound[b->rank] = end;
+  }
+  ev->bounds = order->bounds;
+  ev->nbounds = order->len;
+  ev->next_bound = 0;
+  order->bounds = NULL;
+  order->len = order->room = 0;
+}
+
+/*
+ * Link the PTP link, like link_ptp, if its Recv and Send were read. Returns
+ * whether it did.
+ */
+static bool
+online_link(struct Events *ev, struct Link const *link)
+{
+  assert(link_is_ptp(link));
+  struct Store *store = ev->store;
+  struct Handle const recv = { link->to,
+    state_q_front(*(ev->recvs) + link->to) };
+  if (recv.index == STORE_NONE || link->from < 0 ||
+      (size_t)(link->from) >= *(ev->ranks))
+    return false;
+  uint32_t const *handle = sends_find(*(ev->sends) + link->from, link->mark);
+  if (!handle)
+    return false;
+  struct Handle const send = { link->from, *handle };
+  struct Comm const *c = STORE_AT(store, send, comm).c;
+  /* (linked to another Recv, for link_send_recvs to report) */
+  if (c && c->container)
+    return false;
+  struct Handle const wait = c ? c->match : (struct Handle){ -1, STORE_NONE };
+  /* (the Recv kept for a Wait read later, until online_finish) */
+  STORE_AT(store, send, comm).c = comm_new(ev->arena, store, &recv,
+      link->container, link->bytes);
+  STORE_AT(store, send, mark) = link->mark;
+  STORE_AT(store, recv, comm).c = comm_new(ev->arena, store, &send,
+      link->container, link->bytes);
+  STORE_AT(store, recv, mark) = link->mark;
+  if (wait.index != STORE_NONE) {
+    STORE_AT(store, wait, comm).c = comm_new(ev->arena, store, &recv,
+        link->container, link->bytes);
+    STORE_AT(store, wait, mark) = link->mark;
+  }
+  state_q_pop(*(ev->recvs) + link->to);
+  return true;
+}
+
+/* Link what can be linked once everything before offset pos was read */
+static void
+online_check(struct Events *ev, size_t pos)
+{
+  while (ev->next_bound < ev->nbounds &&
+      ((size_t)(ev->bounds[ev->next_bound].seg) + 1) * ONLINE_SEG <= pos) {
+    struct Bound const *b = ev->bounds + ev->next_bound++;
+    if ((size_t)(b->rank) < ev->cap)
+      ev->bound[b->rank] = b->end;
+  }
+  for (size_t i = 0; i < *(ev->ranks); i++) {
+    struct Link const *link = NULL;
+    /* (a Link read later ending at the same time goes after it) */
+    while ((link = link_h_top(ev->pending + i)) && link->end <= ev->bound[i] &&
+        online_link(ev, link))
+      link_h_pop(ev->pending + i);
+    /* (most ranks have few Links pending at a time, if any) */
+    if (!ev->pending[i].len)
+      link_h_empty(ev->pending + i);
+  }
+}
+
+/* A rank of Sends swept by send_linked */
+struct Sweep {
+  struct Store const *store;
+  int rank;
+};
+
+/* Give a Send linked online the comm link_send_recvs would have */
+static bool
+send_linked(void *arg, uint32_t handle)
+{
+  struct Sweep const *sweep = arg;
+  struct Handle const send = { sweep->rank, handle };
+  struct Comm *c = STORE_AT(sweep->store, send, comm).c;
+  if (!c || !c->container)
+    return false;
+  size_t bytes = c->bytes;
+  memset(c, 0, sizeof(*c));
+  c->match.index = STORE_NONE;
+  c->bytes = bytes;
+  return true;
+}
+
+/* Stop linking online, leaving the Links left to link_send_recvs */
+static void
+online_finish(struct Events *ev)
+{
+  if (!ev->pending)
+    return;
+  for (size_t i = 0; i < ev->cap; i++) {
+    struct Link const *link = NULL;
+    /* (in order, so that it is kept by the sort in link_send_recvs) */
+    while ((link = link_h_top(ev->pending + i))) {
+      struct Link *copy = arena_alloc(ev->arena, sizeof(*copy));
+      *copy = *link;
+      link_q_push_ref((*(ev->links)) + i, copy);
+      link_h_pop(ev->pending + i);
+    }
+    link_h_empty(ev->pending + i);
+  }
+  for (size_t i = 0; i < *(ev->ranks); i++) {
+    struct Sweep sweep = { ev->store, (int)i };
+    sends_sweep(*(ev->sends) + i, send_linked, &sweep);
+  }
+  free(ev->pending);
+  free(ev->bound);
+  free(ev->bounds);
+  ev->pending = NULL;
+  ev->bound = NULL;
+  ev->bounds = NULL;
+}
+
+/*
+ * Sizing
+ *
+ * When the number of ranks and of Sends per rank are known before the trace is
+ * read, every per rank array is allocated once, at its final size, instead of
+ * growing as ranks show up. Binary traces tell them in their header (and
+ * routine column), mapped pj_dump traces are pre-scanned with up to jobs
+ * threads (splitting the lines, without decoding the events, see
+ * event_scan_line), and Pajé traces are counted once parsed. Traces that can't
+ * be read twice (pipes, compressed ones, see input.h) are not sized.
+ *
+ * The pre-scan gives the pages it read back to the kernel as it goes, every
+ * SCAN_DROP bytes, so it doesn't make the whole trace resident at once.
+ */
+
+#define SCAN_DROP ((size_t)8 << 20)
+
+/* The number of ranks (highest plus one), and of States and Sends of each */
+struct Sizes {
+  size_t ranks,
+         cap;
+  uint64_t *states,
+           *sends;
+};
+
+/* Count states States and sends Sends (possibly none) of rank */
+static void
+sizes_count(struct Sizes *sizes, int rank, uint64_t states, uint64_t sends)
+{
+  if (rank < 0)
+    return;
+  size_t new_size = (size_t)rank + 1;
+  if (new_size > sizes->cap) {
+    size_t cap = new_size > 2 * sizes->cap ? new_size : 2 * sizes->cap;
+    sizes->states = realloc(sizes->states, cap * sizeof(*(sizes->states)));
+    sizes->sends = realloc(sizes->sends, cap * sizeof(*(sizes->sends)));
+    if (!sizes->states || !sizes->sends)
+      REPORT_AND_EXIT;
+    memset(sizes->states + sizes->cap, 0, (cap - sizes->cap) *
+        sizeof(*(sizes->states)));
+    memset(sizes->sends + sizes->cap, 0, (cap - sizes->cap) *
+        sizeof(*(sizes->sends)));
+    sizes->cap = cap;
+  }
+  if (new_size > sizes->ranks)
+    sizes->ranks = new_size;
+  sizes->states[rank] += states;
+  sizes->sends[rank] += sends;
+}
+
+/* Add the counts of src to dst */
+static void
+sizes_merge(struct Sizes *dst, struct Sizes const *src)
+{
+  for (size_t i = src->ranks; i-- > 0;)
+    sizes_count(dst, (int)i, src->states[i], src->sends[i]);
+}
 
-/* (see the explanation above) */
-typedef struct State *** outter_t;
-
-static char *
-mygetline(FILE *f)
-{
-  char *buff = NULL;
-  size_t size = 0;
-  ssize_t rc = getline(&buff, &size, f);
-  if (rc == -1) {
-    if (buff)
-      free(buff);
-    return NULL;
-  }
-  return buff;
-}
-
-// TODO decompose this
-/* Ad-hoc fun to resize the outer arrs/queues of size 'size' to 'new_size' */
-static void
-grow_outer(size_t *size, size_t new_size, struct Link_q ***links, outter_t
-    *sends, struct State_q ***recvs, struct State_q ***scattersS, struct
-    State_q ***scattersR, struct State_q ***gathersS, struct State_q
-    ***gathersR, double **last, double **clast, uint64_t **slens, uint64_t
-    **scaps, uint64_t ocap)
-{
-    *recvs = realloc(*recvs, new_size * sizeof(**recvs));
-    *links = realloc(*links, new_size * sizeof(**links));
-    *sends = realloc(*sends, new_size * sizeof(**sends));
-    *slens = realloc(*slens, new_size * sizeof(**slens));
-    *scaps = realloc(*scaps, new_size * sizeof(**scaps));
-    *last = realloc(*last, new_size * sizeof(*last));
-    *clast = realloc(*clast, new_size * sizeof(*clast));
-    *scattersS = realloc(*scattersS, new_size * sizeof(*scattersS));
-    *scattersR = realloc(*scattersR, new_size * sizeof(*scattersR));
-    *gathersS = realloc(*gathersS, new_size * sizeof(*gathersS));
-    *gathersR = realloc(*gathersR, new_size * sizeof(*gathersR));
-    if (!*recvs || !*links || !*sends || !*slens || !*scaps || !*last ||
-        !*clast || !*scattersS || !*scattersR || !*gathersS || !*gathersR)
+/* A range of a mapped pj_dump trace, pre-scanned by a thread */
+struct Scan {
+  struct Input const *in;
+  size_t begin,
+         end;
+  struct Sizes sizes;
+  struct Order order;
+  pthread_t thread;
+};
+
+static void *
+scan_range(void *arg)
+{
+  struct Scan *scan = arg;
+  char const *map = scan->in->map;
+  size_t pos = scan->begin,
+         dropped = scan->begin;
+  while (pos < scan->end) {
+    char const *line = map + pos;
+    char const *nl = memchr(line, '\n', scan->end - pos);
+    size_t len = nl ? (size_t)(nl - line) + 1 : scan->end - pos;
+    int rank = 0;
+    bool send = false;
+    uint64_t mark = 0;
+    double end = 0;
+    enum Record type = event_scan_line(line, len, &rank, &send, &mark, &end);
+    if (type != RECORD_OTHER)
+      sizes_count(&(scan->sizes), rank, type == RECORD_STATE, send);
+    if (send)
+      order_send(&(scan->order), rank, mark);
+    else if (type == RECORD_LINK)
+      order_link(&(scan->order), (uint32_t)(pos / ONLINE_SEG), rank, end);
+    pos += len;
+    if (pos - dropped >= SCAN_DROP) {
+      input_drop(scan->in, dropped, pos);
+      dropped = pos;
+    }
+  }
+  input_drop(scan->in, dropped, scan->end);
+  order_flush(&(scan->order));
+  return NULL;
+}
+
+/*
+ * Pre-scan the (rest of the) mapped pj_dump trace in with up to jobs threads,
+ * for order too unless it is NULL
+ */
+static void
+sizes_scan(struct Sizes *sizes, struct Order *order, struct Input const *in,
+    unsigned jobs)
+{
+  struct Scan *scans = calloc(jobs, sizeof(*scans));
+  if (!scans)
+    REPORT_AND_EXIT;
+  size_t pos = in->pos,
+         step = (in->size - in->pos) / jobs + 1;
+  unsigned n = 0;
+  while (n < jobs && pos < in->size) {
+    size_t end = pos + step;
+    if (end >= in->size) {
+      end = in->size;
+    } else {
+      char const *nl = memchr(in->map + end, '\n', in->size - end);
+      end = nl ? (size_t)(nl - in->map) + 1 : in->size;
+    }
+    scans[n].in = in;
+    scans[n].begin = pos;
+    scans[n].end = end;
+    if ((errno = pthread_create(&(scans[n].thread), NULL, scan_range,
+            scans + n)))
       REPORT_AND_EXIT;
-    for (size_t i = *size; i < new_size; i++) {
-      (*scaps)[i] = ocap;
-      (*slens)[i] = 0;
-      (*sends)[i] = malloc((size_t)ocap * sizeof(*((*sends)[i])));
-      if (!((*sends)[i]))
+    pos = end;
+    n++;
+  }
+  for (unsigned i = 0; i < n; i++) {
+    if ((errno = pthread_join(scans[i].thread, NULL)))
+      REPORT_AND_EXIT;
+    sizes_merge(sizes, &(scans[i].sizes));
+    free(scans[i].sizes.states);
+    free(scans[i].sizes.sends);
+    if (order)
+      order_merge(order, &(scans[i].order));
+    order_release(&(scans[i].order));
+  }
+  if (order)
+    order->scanned = true;
+  free(scans);
+}
+
+/* Count the ranks, States and Sends of the binary trace in from its columns */
+static void
+sizes_binary(struct Sizes *sizes, struct Input const *in)
+{
+  struct Bintrace bt;
+  /* (binary_records reports it) */
+  if (bintrace_open(&bt, in->map, in->size))
+    return;
+  struct Bintrace_header const *h = bt.header;
+  bool *sends = malloc((size_t)(h->strings ? h->strings : 1) *
+      sizeof(*sends));
+  if (!sends)
+    REPORT_AND_EXIT;
+  for (uint32_t i = 0; i < h->strings; i++)
+    sends[i] = routine_flags[routine_from_name(bintrace_string(&bt, i))] &
+      ROUTINE_IS_SEND;
+  for (size_t i = 0; i < h->ranks; i++) {
+    struct Bintrace_states cols;
+    bintrace_states(&bt, i, &cols);
+    uint64_t n = 0;
+    for (uint64_t j = 0; j < bt.ranks[i].states; j++)
+      if (cols.routine[j] < h->strings && sends[cols.routine[j]])
+        n++;
+    sizes_count(sizes, (int)i, bt.ranks[i].states, n);
+  }
+  free(sends);
+}
+
+/*
+ * Count the ranks, States and Sends of the trace in (binary or not), from where
+ * it is at, and fill order (unless NULL) for a pj_dump one. Returns false if
+ * it can't be read twice.
+ */
+static bool
+sizes_input(struct Sizes *sizes, struct Order *order, struct Input const *in,
+    bool binary, unsigned jobs)
+{
+  if (!in->map)
+    return false;
+  if (binary)
+    sizes_binary(sizes, in);
+  else
+    sizes_scan(sizes, order, in, jobs);
+  return true;
+}
+
+/* Allocate every per rank array (and the store) for sizes at once */
+static void
+events_presize(struct Events *ev, struct Sizes const *sizes)
+{
+  if (sizes->ranks > ev->cap)
+    events_grow(ev, sizes->ranks);
+  store_reserve(ev->store, sizes->ranks, sizes->states);
+  for (size_t i = 0; i < sizes->ranks; i++)
+    sends_reserve(*(ev->sends) + i, (size_t)sizes->sends[i]);
+}
+
+/*
+ * Parallel parsing
+ *
+ * The mapped trace is split into newline-aligned chunks of CHUNK_SIZE bytes,
+ * parsed concurrently into per-chunk buffers of records. Those are then
+ * stored in file order by the main thread, so the result is the same as with
+ * a serial parse. While a batch (one chunk per thread) is being stored, the
+ * next one is already being parsed. Every chunk allocates its events from an
+ * arena of its own, cleared once they are stored.
+ */
+
+#define CHUNK_SIZE ((size_t)8 << 20)
+
+struct Chunk {
+  char const *begin,
+             *end;
+  struct Parsed *recs;
+  size_t len,
+         cap;
+  struct Arena arena;
+  pthread_t thread;
+};
+
+static void *
+chunk_parse(void *arg)
+{
+  struct Chunk *chunk = arg;
+  chunk->len = 0;
+  char const *line = chunk->begin;
+  while (line < chunk->end) {
+    char const *nl = memchr(line, '\n', (size_t)(chunk->end - line));
+    size_t len = nl ? (size_t)(nl - line) + 1 : (size_t)(chunk->end - line);
+    if (chunk->len == chunk->cap) {
+      chunk->cap = chunk->cap ? chunk->cap * 2 : 1024;
+      chunk->recs = realloc(chunk->recs, chunk->cap * sizeof(*chunk->recs));
+      if (!chunk->recs)
         REPORT_AND_EXIT;
-      (*links)[i] = NULL;
-      (*recvs)[i] = NULL;
-      (*last)[i] = -1;
-      (*clast)[i] = 0;
-      (*scattersS)[i] = NULL;
-      (*scattersR)[i] = NULL;
-      (*gathersS)[i] = NULL;
-      (*gathersR)[i] = NULL;
     }
-    *size = new_size;
+    struct Parsed *rec = chunk->recs + chunk->len++;
+    rec->type = event_from_line(&(chunk->arena), line, len, &(rec->u.state),
+        &(rec->u.link));
+    if (rec->type == RECORD_OTHER) {
+      rec->u.line = line;
+      rec->len = len;
+    }
+    line += len;
+  }
+  return NULL;
+}
+
+/* Split [*pos, size) into up to jobs chunks and start parsing them */
+static size_t
+batch_start(struct Chunk *batch, unsigned jobs, char const *map, size_t *pos,
+    size_t size)
+{
+  size_t n = 0;
+  while (n < jobs && *pos < size) {
+    size_t end = *pos + CHUNK_SIZE;
+    if (end >= size) {
+      end = size;
+    } else {
+      char const *nl = memchr(map + end, '\n', size - end);
+      end = nl ? (size_t)(nl - map) + 1 : size;
+    }
+    batch[n].begin = map + *pos;
+    batch[n].end = map + end;
+    if ((errno = pthread_create(&(batch[n].thread), NULL, chunk_parse,
+            batch + n)))
+      REPORT_AND_EXIT;
+    *pos = end;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * Wait for the n chunks in batch of in and store their records in order,
+ * dropping the pages of each chunk once stored
+ */
+static void
+batch_store(struct Events *ev, struct Input const *in, struct Chunk *batch,
+    size_t n)
+{
+  for (size_t i = 0; i < n; i++) {
+    if ((errno = pthread_join(batch[i].thread, NULL)))
+      REPORT_AND_EXIT;
+    for (size_t j = 0; j < batch[i].len; j++)
+      events_push_parsed(ev, batch[i].recs + j);
+    arena_clear(&(batch[i].arena));
+    input_drop(in, (size_t)(batch[i].begin - in->map), (size_t)(batch[i].end -
+          in->map));
+  }
+}
+
+static void
+read_parallel(struct Events *ev, struct Input *in, unsigned jobs)
+{
+  /* Two batches, one being parsed while the other is stored */
+  struct Chunk *batches[2];
+  for (int i = 0; i < 2; i++) {
+    batches[i] = calloc(jobs, sizeof(*batches[i]));
+    if (!batches[i])
+      REPORT_AND_EXIT;
+  }
+  size_t pos = in->pos;
+  size_t n = batch_start(batches[0], jobs, in->map, &pos, in->size);
+  for (int cur = 0; n; cur = !cur) {
+    size_t stored = pos;
+    size_t next = batch_start(batches[!cur], jobs, in->map, &pos, in->size);
+    batch_store(ev, in, batches[cur], n);
+    if (ev->pending)
+      online_check(ev, stored);
+    /* Everything before the batch being parsed can be given back */
+    input_consume(in, stored);
+    n = next;
+  }
+  for (int i = 0; i < 2; i++) {
+    for (unsigned j = 0; j < jobs; j++) {
+      free(batches[i][j].recs);
+      arena_release(&(batches[i][j].arena));
+    }
+    free(batches[i]);
+  }
 }
 
-// TODO don't need the index I guess, just the correct ptr
-// TODO rename stuff
+/* Where records go as they are read, see binary_records */
+typedef void (*emit_t)(void *arg, struct Parsed const *rec);
+
+/*
+ * Turn a binary trace (see bintrace.h) in its mapping into records, the order
+ * column giving the original file order of the States. The passthrough lines
+ * are emitted first, as a single record, then the States, then the Links.
+ */
 static void
-grow_inner(outter_t sends, uint64_t *scaps)
+binary_records(struct Input *in, struct Arena *arena, emit_t emit, void *arg)
 {
-  uint64_t new_cap = *scaps * 2;
-  *sends = realloc(*sends, (size_t)new_cap * sizeof(**sends));
-  if (!*sends)
+  struct Bintrace bt;
+  if (bintrace_open(&bt, in->map, in->size))
+    LOG_AND_EXIT("Could not load the binary trace\n");
+  struct Bintrace_header const *h = bt.header;
+  struct Parsed rec;
+  rec.type = RECORD_OTHER;
+  rec.u.line = bt.passthrough;
+  rec.len = (size_t)h->passthrough_len;
+  emit(arg, &rec);
+  if (!h->ranks)
+    return;
+  /* Intern and classify every distinct string once */
+  enum Routine *codes = malloc((size_t)(h->strings ? h->strings : 1) *
+      sizeof(*codes));
+  char const **strs = malloc((size_t)(h->strings ? h->strings : 1) *
+      sizeof(*strs));
+  struct Bintrace_states *cols = malloc((size_t)h->ranks * sizeof(*cols));
+  size_t *next = calloc((size_t)h->ranks, sizeof(*next));
+  if (!codes || !strs || !cols || !next)
     REPORT_AND_EXIT;
-  *scaps = new_cap;
+  for (uint32_t i = 0; i < h->strings; i++) {
+    strs[i] = intern_cstr(bintrace_string(&bt, i));
+    codes[i] = routine_from_name(strs[i]);
+  }
+  for (size_t i = 0; i < h->ranks; i++)
+    bintrace_states(&bt, i, cols + i);
+  rec.type = RECORD_STATE;
+  for (uint64_t i = 0; i < h->states; i++) {
+    uint32_t rank = bt.order[i];
+    size_t j = next[rank]++;
+    if (j >= bt.ranks[rank].states)
+      LOG_AND_EXIT("Corrupt binary trace: order column overflows rank %u\n",
+          (unsigned)rank);
+    uint32_t routine = cols[rank].routine[j];
+    rec.u.state = state_new(arena, (int)rank, cols[rank].start[j],
+        cols[rank].end[j], cols[rank].imbrication[j], codes[routine],
+        strs[routine], cols[rank].mark + j);
+    emit(arg, &rec);
+  }
+  rec.type = RECORD_LINK;
+  for (size_t i = 0; i < h->ranks; i++) {
+    struct Bintrace_links l;
+    bintrace_links(&bt, i, &l);
+    for (uint64_t j = 0; j < bt.ranks[i].links; j++) {
+      enum Link_type type = l.type[j] <= LINK_NT1 ? (enum Link_type)l.type[j] :
+        LINK_OTHER;
+      rec.u.link = link_new(arena, l.from[j], (int)i, l.start[j], l.end[j],
+          type, strs[l.container[j]], l.mark[j], (size_t)l.bytes[j]);
+      emit(arg, &rec);
+    }
+  }
+  free(codes);
+  free(strs);
+  free(cols);
+  free(next);
+}
+
+static void
+emit_events(void *arg, struct Parsed const *rec)
+{
+  struct Events *ev = arg;
+  events_push_parsed(ev, rec);
+  arena_clear(&(ev->scratch));
+}
+
+/* Load a binary trace, see binary_records */
+static void
+read_binary(struct Events *ev, struct Input *in)
+{
+  binary_records(in, &(ev->scratch), emit_events, ev);
 }
 
 /*
- * Fills the arrays / queues with the states from the trace file and updates
- * counters. Assumes everything passed (except the filename) to be NULL/0.
+ * Abort if line, the first line of filename, starts a binary trace that in
+ * couldn't be loaded as one: binary traces are only read mapped, so neither
+ * compressed nor from a pipe, and have to hold at least their header.
  */
 static void
-read_events(char const *filename, size_t *ranks, struct State_q **state_q,
-    struct Link_q ***links, outter_t *sends, struct State_q ***recvs, uint64_t
-    **slens, double **last, double **clast, struct State_q ***scattersS,
-    struct State_q ***scattersR, struct State_q ***gathersS, struct State_q
-    ***gathersR)
+binary_unmapped(struct Input const *in, char const *filename, char const
+    *line, size_t len)
 {
-  /* Important for some (size_t) conversions from marks registered as uint64 */
-  assert(SIZE_MAX <= UINT64_MAX);
-  FILE *f = fopen(filename, "r");
-  if (!f)
-    LOG_AND_EXIT("Could not open %s: %s\n", filename, strerror(errno));
-  char *line = mygetline(f);
-  if (!line)
+  if (!bintrace_magic(line, len))
+    return;
+  if (in->map)
+    LOG_AND_EXIT("%s: Truncated binary trace\n", filename);
+  LOG_AND_EXIT("%s: Binary traces can't be streamed, give the uncompressed "
+      "file itself\n", filename);
+}
+
+/*
+ * Read a Pajé trace (see paje.h) and store its States and Links as if they
+ * came, in this order, from the equivalent pj_dump trace.
+ */
+static void
+read_paje(struct Events *ev, struct Input *in)
+{
+  struct State **states = NULL;
+  struct Link **links = NULL;
+  size_t nstates = 0,
+         nlinks = 0;
+  paje_read(in, &(ev->scratch), &states, &nstates, &links, &nlinks);
+  struct Sizes sizes = { 0, 0, NULL, NULL };
+  for (size_t i = 0; i < nstates; i++)
+    sizes_count(&sizes, states[i]->rank, 1, state_is_send(states[i]));
+  for (size_t i = 0; i < nlinks; i++)
+    sizes_count(&sizes, links[i]->to, 0, 0);
+  events_presize(ev, &sizes);
+  free(sizes.states);
+  free(sizes.sends);
+  for (size_t i = 0; i < nstates; i++)
+    events_push_state(ev, states[i]);
+  for (size_t i = 0; i < nlinks; i++)
+    events_push_link(ev, links[i]);
+  arena_clear(&(ev->scratch));
+  free(states);
+  free(links);
+}
+
+/*
+ * Sharded traces
+ *
+ * A trace split into shards (e.g. one file per rank), each sorted by start
+ * time, is merged by start time as it is read, with a min-heap of the shards
+ * keyed by the start of their next State (ties going to the first shard).
+ * Every shard has a reader thread parsing ahead of the merge into a ring of at
+ * most SHARD_READAHEAD blocks of records, so memory is bounded regardless of
+ * the shard sizes. Links and passthrough lines are stored as soon as they
+ * reach the merge (Links are sorted by end time later on anyway). Readers
+ * allocate events from an arena of their own, released once joined.
+ */
+
+#define SHARD_BLOCK 4096
+#define SHARD_READAHEAD 4
+
+struct Shard_block {
+  struct Parsed recs[SHARD_BLOCK];
+  size_t len;
+};
+
+struct Shard {
+  size_t index;
+  struct Input in;
+  bool binary;
+  struct Arena arena;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t filled,
+                 emptied;
+  /* Blocks [head, head + count) of the ring are ready for the merge */
+  struct Shard_block *ring;
+  size_t head,
+         count;
+  bool done;
+  /* Reader side, the block being filled (outside of the ring range) */
+  struct Shard_block *fill;
+  /* Merge side, the position in the block at head and the next State */
+  size_t pos;
+  struct State *next;
+};
+
+/* Make the block being filled available to the merge */
+static void
+shard_publish(struct Shard *shard)
+{
+  pthread_mutex_lock(&(shard->lock));
+  shard->count++;
+  pthread_cond_signal(&(shard->filled));
+  pthread_mutex_unlock(&(shard->lock));
+  shard->fill = NULL;
+}
+
+/* Reader side, emit_t for a shard (passthrough lines are copied) */
+static void
+shard_emit(void *arg, struct Parsed const *rec)
+{
+  struct Shard *shard = arg;
+  if (!shard->fill) {
+    pthread_mutex_lock(&(shard->lock));
+    while (shard->count == SHARD_READAHEAD)
+      pthread_cond_wait(&(shard->emptied), &(shard->lock));
+    shard->fill = shard->ring + (shard->head + shard->count) %
+      SHARD_READAHEAD;
+    pthread_mutex_unlock(&(shard->lock));
+    shard->fill->len = 0;
+  }
+  struct Parsed *dst = shard->fill->recs + shard->fill->len++;
+  *dst = *rec;
+  if (rec->type == RECORD_OTHER) {
+    char *line = malloc(rec->len);
+    if (!line)
+      REPORT_AND_EXIT;
+    memcpy(line, rec->u.line, rec->len);
+    dst->u.line = line;
+  }
+  if (shard->fill->len == SHARD_BLOCK)
+    shard_publish(shard);
+}
+
+static void *
+shard_read(void *arg)
+{
+  struct Shard *shard = arg;
+  if (shard->binary) {
+    binary_records(&(shard->in), &(shard->arena), shard_emit, shard);
+  } else {
+    size_t len = 0;
+    char const *line = NULL;
+    while ((line = input_next(&(shard->in), &len))) {
+      struct Parsed rec;
+      rec.type = event_from_line(&(shard->arena), line, len, &(rec.u.state),
+          &(rec.u.link));
+      if (rec.type == RECORD_OTHER) {
+        rec.u.line = line;
+        rec.len = len;
+      }
+      shard_emit(shard, &rec);
+    }
+  }
+  if (shard->fill)
+    shard_publish(shard);
+  pthread_mutex_lock(&(shard->lock));
+  shard->done = true;
+  pthread_cond_signal(&(shard->filled));
+  pthread_mutex_unlock(&(shard->lock));
+  return NULL;
+}
+
+/*
+ * Merge side: store the records of shard up to its next State, which is left
+ * in shard->next. Returns false if the shard ended instead.
+ */
+static bool
+shard_advance(struct Events *ev, struct Shard *shard)
+{
+  for (;;) {
+    pthread_mutex_lock(&(shard->lock));
+    if (shard->count && shard->pos == shard->ring[shard->head].len) {
+      shard->head = (shard->head + 1) % SHARD_READAHEAD;
+      shard->count--;
+      shard->pos = 0;
+      pthread_cond_signal(&(shard->emptied));
+    }
+    while (!shard->count && !shard->done)
+      pthread_cond_wait(&(shard->filled), &(shard->lock));
+    bool empty = !shard->count;
+    pthread_mutex_unlock(&(shard->lock));
+    if (empty)
+      return false;
+    /* The block at head is ours until we move past it */
+    struct Shard_block *block = shard->ring + shard->head;
+    while (shard->pos < block->len) {
+      struct Parsed *rec = block->recs + shard->pos++;
+      if (rec->type == RECORD_STATE) {
+        shard->next = rec->u.state;
+        return true;
+      }
+      events_push_parsed(ev, rec);
+      if (rec->type == RECORD_OTHER)
+        free((char *)rec->u.line);
+    }
+  }
+}
+
+static inline bool
+shard_before(struct Shard const *a, struct Shard const *b)
+{
+  if (a->next->start < b->next->start)
+    return true;
+  if (a->next->start > b->next->start)
+    return false;
+  return a->index < b->index;
+}
+
+static void
+heap_down(struct Shard **heap, size_t len, size_t i)
+{
+  for (;;) {
+    size_t min = i,
+           l = 2 * i + 1,
+           r = l + 1;
+    if (l < len && shard_before(heap[l], heap[min]))
+      min = l;
+    if (r < len && shard_before(heap[r], heap[min]))
+      min = r;
+    if (min == i)
+      return;
+    struct Shard *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+static void
+read_shards(struct Events *ev, char *const *filenames, size_t n, unsigned
+    jobs)
+{
+  struct Shard *shards = calloc(n, sizeof(*shards));
+  struct Shard **heap = malloc(n * sizeof(*heap));
+  if (!shards || !heap)
     REPORT_AND_EXIT;
-  uint64_t *scaps = NULL;
-  uint64_t const ocap = 10;
-  /* Initialize all arrs/queues with one rank each */
-  grow_outer(ranks, 1, links, sends, recvs, scattersS, scattersR, gathersS,
-      gathersR, last, clast, slens, &scaps, ocap);
-  do {
-    /* strtok shenanigans */
-    char *state_line = strdup(line),
-         *link_line = strdup(line),
-         *etc_line = strdup(line);
-    free(line);
-    if (!state_line || !link_line || !etc_line)
+  for (size_t i = 0; i < n; i++) {
+    struct Shard *shard = shards + i;
+    shard->index = i;
+    if (input_open(&(shard->in), filenames[i]))
+      LOG_AND_EXIT("Could not open %s: %s\n", filenames[i], strerror(errno));
+    shard->binary = shard->in.map && bintrace_is(shard->in.map,
+        shard->in.size);
+    size_t len = 0;
+    char const *line = NULL;
+    if (!shard->binary && (line = input_next(&(shard->in), &len))) {
+      binary_unmapped(&(shard->in), filenames[i], line, len);
+      if (input_is_paje(line, len))
+        LOG_AND_EXIT("%s: Pajé traces can't be shards, use pj_dump\n",
+            filenames[i]);
+      input_unget(&(shard->in));
+    }
+  }
+  /* Sized only if every shard can be */
+  struct Sizes sizes = { 0, 0, NULL, NULL };
+  bool sized = true;
+  for (size_t i = 0; i < n && sized; i++)
+    sized = sizes_input(&sizes, NULL, &(shards[i].in), shards[i].binary,
+        jobs);
+  if (sized)
+    events_presize(ev, &sizes);
+  free(sizes.states);
+  free(sizes.sends);
+  for (size_t i = 0; i < n; i++) {
+    struct Shard *shard = shards + i;
+    shard->ring = malloc(SHARD_READAHEAD * sizeof(*(shard->ring)));
+    if (!shard->ring)
       REPORT_AND_EXIT;
-    struct State *state = state_from_line(state_line);
-    if (!state) {
-      struct Link *link = link_from_line(link_line);
-      if (!link) {
-        LOG_DEBUG("Line is not a State nor a Link\n");//: %s", etc_line);
-        printf("%s", etc_line);
-      } else {
-        size_t rank = (size_t)(link->to + 1);
-        if (rank > *ranks)
-          grow_outer(ranks, rank, links, sends, recvs, scattersS, scattersR,
-              gathersS, gathersR, last, clast, slens, &scaps, ocap);
-        /* (grow outer aborts on failure) */
-        link_q_push_ref((*links) + link->to, link);
-        /* Toss away our local ref obtained on allocation */
-        ref_dec(&(link->ref));
+    if ((errno = pthread_mutex_init(&(shard->lock), NULL)) ||
+        (errno = pthread_cond_init(&(shard->filled), NULL)) ||
+        (errno = pthread_cond_init(&(shard->emptied), NULL)) ||
+        (errno = pthread_create(&(shard->thread), NULL, shard_read, shard)))
+      REPORT_AND_EXIT;
+  }
+  size_t len = 0;
+  for (size_t i = 0; i < n; i++)
+    if (shard_advance(ev, shards + i))
+      heap[len++] = shards + i;
+  for (size_t i = len / 2; i-- > 0;)
+    heap_down(heap, len, i);
+  while (len) {
+    struct Shard *shard = heap[0];
+    events_push_state(ev, shard->next);
+    shard->next = NULL;
+    if (!shard_advance(ev, shard))
+      heap[0] = heap[--len];
+    heap_down(heap, len, 0);
+  }
+  for (size_t i = 0; i < n; i++) {
+    struct Shard *shard = shards + i;
+    if ((errno = pthread_join(shard->thread, NULL)))
+      REPORT_AND_EXIT;
+    input_close(&(shard->in));
+    arena_release(&(shard->arena));
+    pthread_mutex_destroy(&(shard->lock));
+    pthread_cond_destroy(&(shard->filled));
+    pthread_cond_destroy(&(shard->emptied));
+    free(shard->ring);
+  }
+  free(shards);
+  free(heap);
+}
+
+/*
+ * Read a single trace file into ev. Mapped traces are parsed with up to jobs
+ * threads, binary traces (see pj_pack) are loaded directly and Pajé traces
+ * are read without needing pj_dump.
+ */
+static void
+read_file(struct Events *ev, char const *filename, unsigned jobs)
+{
+  struct Input in;
+  if (input_open(&in, filename))
+    LOG_AND_EXIT("Could not open %s: %s\n", filename, strerror(errno));
+  bool binary = in.map && bintrace_is(in.map, in.size),
+       paje = false;
+  /* Peek at the first line to tell Pajé traces from pj_dump ones */
+  size_t len = 0;
+  char const *line = NULL;
+  if (!binary && (line = input_next(&in, &len))) {
+    binary_unmapped(&in, filename, line, len);
+    paje = input_is_paje(line, len);
+    input_unget(&in);
+  }
+  /* (Pajé traces are sized once parsed) */
+  struct Sizes sizes = { 0, 0, NULL, NULL };
+  struct Order order;
+  memset(&order, 0, sizeof(order));
+  if (!paje && sizes_input(&sizes, &order, &in, binary, jobs))
+    events_presize(ev, &sizes);
+  free(sizes.states);
+  free(sizes.sends);
+  online_start(ev, &order);
+  order_release(&order);
+  if (binary) {
+    read_binary(ev, &in);
+  } else if (paje) {
+    read_paje(ev, &in);
+  } else if (in.map && jobs > 1) {
+    read_parallel(ev, &in, jobs);
+  } else {
+    size_t check = ONLINE_SEG;
+    while ((line = input_next(&in, &len))) {
+      if (ev->pending && (size_t)(line - in.map) >= check) {
+        online_check(ev, (size_t)(line - in.map));
+        check += ONLINE_SEG;
       }
-    } else {
-      size_t rank = (size_t)(state->rank + 1);
-      if (rank > *ranks)
-        grow_outer(ranks, rank, links, sends, recvs, scattersS, scattersR,
-            gathersS, gathersR, last, clast, slens, &scaps, ocap);
-      if ((*last)[state->rank] < 0)
-        (*last)[state->rank] = state->start;
-      state_q_push_ref(state_q, state);
-      if (state_is_send(state)) {
-        (*sends)[state->rank][(*slens)[state->rank]] = state;
-        ref_inc(&(state->ref));
-        if (++((*slens)[state->rank]) >= scaps[state->rank])
-          grow_inner((*sends) + state->rank, scaps + state->rank);
-      } else if (state_is_recv(state)) {
-        state_q_push_ref((*recvs) + state->rank, state);
-      } else if (state_is_wait(state)) {
-        /*
-         * For now we only support MPI_Wait for MPI_Isend (->mark). Thus,
-         * MPI_Wait is always in the same rank as the matching MPI_Isend and
-         * always comes after it, so we can assume the matching send has
-         * already been processed and create a temporary comm in here, to be
-         * used later to link the MPI_Wait to the MPI_Recv it is actually
-         * waiting for (we assume MPI_Isend was synchronous, albeit
-         * instantaneous, and we assert for that).
-         */
-        if ((*slens)[state->rank] <= state->mark) {
-          LOG_CRITICAL("There is no Send for the Wait. Did you call MPI_Wait "
-              "without (or before) a matching MPI_Isend? This is not "
-              "supported.\n");
-          exit(EXIT_FAILURE);
-        }         // TODO can this be moved to pj_compensate.c with the rest?
-        struct State *send = (*sends)[state->rank][state->mark];
-        assert(send->mark == state->mark);
-        send->comm.c = comm_new(state, NULL, 0);
-      // TODO dont use a separate queue for scatter/gather
-      } else if (state_is_1tn(state)) {
-        if (state_is_1tns(state))
-          state_q_push_ref((*scattersS) + state->rank, state);
-        else
-          state_q_push_ref((*scattersR) + state->rank, state);
-      } else if (state_is_nt1(state)) {
-        if (state_is_nt1s(state))
-          state_q_push_ref((*gathersS) + state->rank, state);
-        else
-          state_q_push_ref((*gathersR) + state->rank, state);
+      struct State *state = NULL;
+      struct Link *link = NULL;
+      enum Record type = event_from_line(&(ev->scratch), line, len, &state,
+          &link);
+      if (type == RECORD_STATE) {
+        events_push_state(ev, state);
+      } else if (type == RECORD_LINK) {
+        events_push_link(ev, link);
+      } else {
+        LOG_DEBUG("Line is not a State nor a Link\n");
+        passthrough(line, len);
       }
-      ref_dec(&(state->ref));
+      arena_clear(&(ev->scratch));
     }
-    free(state_line);
-    free(link_line);
-    free(etc_line);
-    line = mygetline(f);
-  } while (line);
-  fclose(f);
-  free(scaps);
+  }
+  online_finish(ev);
+  input_close(&in);
+}
+
+/*
+ * Fills the arrays / queues with the states from the trace files, stored in
+ * store (the rest being allocated from arena), and updates counters. Assumes
+ * everything passed (except the filenames) to be NULL/0. A single file is
+ * read with read_file, several are merged as shards of the same trace (see
+ * read_shards).
+ */
+static void
+read_events(char *const *filenames, size_t nfiles, unsigned jobs, struct Arena
+    *arena, struct Store *store, size_t *ranks, struct Link_q **links, struct
+    Sends **sends, struct State_q **recvs, double **last, double **clast,
+    struct State_q **scattersS, struct State_q **scattersR, struct State_q
+    **gathersS, struct State_q **gathersR)
+{
+  /* Important for some (size_t) conversions from marks registered as uint64 */
+  assert(SIZE_MAX <= UINT64_MAX);
+  struct Events ev = {
+    ranks, 0, links, sends, recvs, scattersS, scattersR, gathersS,
+    gathersR, last, clast, arena, store, { 0 }, NULL, NULL, NULL, 0, 0
+  };
+  if (nfiles > 1)
+    read_shards(&ev, filenames, nfiles, jobs);
+  else
+    read_file(&ev, filenames[0], jobs);
+  /* Initialize all arrs/queues with at least one rank each */
+  events_reserve(&ev, 0);
+  arena_release(&(ev.scratch));
   for (size_t i = 0; i < *ranks; i++)
     if ((*last)[i] < 0)
       LOG_WARNING("Empty rank %zu or initial timestamp < 0\n", i);
@@ -0,0 +1,99 @@
+/* Packs a pj_dump trace into a binary trace (see bintrace.h) */
+/* For logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include <argp.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logging.h"
+#include "events.h"
+#include "input.h"
+#include "bintrace.h"
+
+static char doc[] = "Packs a pj_dump trace into a binary trace that "
+  "pj_compensate can load without parsing";
+static char args_doc[] = "PJ_DUMP-TRACE BINARY-TRACE";
+static struct argp_option options[] = {
+  {"version", 'v', 0, OPTION_ARG_OPTIONAL, "Print version", 0},
+  { 0 }
+};
+
+#define NUM_ARGS 2
+
+struct arguments {
+  char *input[NUM_ARGS];
+};
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  struct arguments *args = state->input;
+  switch (key) {
+    case 'v':
+      printf("%s\n", VERSION);
+      exit(EXIT_SUCCESS);
+    case ARGP_KEY_ARG:
+      if (state->arg_num == NUM_ARGS)
+        argp_usage(state);
+      args->input[state->arg_num] = arg;
+      break;
+    case ARGP_KEY_END:
+      if (state->arg_num < NUM_ARGS)
+        argp_usage(state);
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+static struct argp argp = { options, parse_options, args_doc, doc, 0, 0, 0 };
+
+int
+main(int argc, char **argv)
+{
+  struct arguments args;
+  memset(&args, 0, sizeof(args));
+  if (argp_parse(&argp, argc, argv, 0, 0, &args) == ARGP_KEY_ERROR)
+    LOG_AND_EXIT("Unknown error while parsing parameters\n");
+  struct Input in;
+  if (input_open(&in, args.input[0]))
+    LOG_AND_EXIT("Could not open %s: %s\n", args.input[0], strerror(errno));
+  struct Bintrace_builder b;
+  bintrace_builder_init(&b);
+  /* (the builder copies what it needs, so an event lasts a single line) */
+  struct Arena arena;
+  memset(&arena, 0, sizeof(arena));
+  size_t len = 0;
+  char const *line = NULL;
+  bool first = true;
+  while ((line = input_next(&in, &len))) {
+    /* (either would only give passthrough lines) */
+    if (first && input_is_paje(line, len))
+      LOG_AND_EXIT("%s: Pajé traces can't be packed, use pj_dump\n",
+          args.input[0]);
+    if (first && bintrace_magic(line, len))
+      LOG_AND_EXIT("%s: Already a binary trace, pj_compensate reads it as "
+          "is\n", args.input[0]);
+    first = false;
+    struct State *state = NULL;
+    struct Link *link = NULL;
+    enum Record type = event_from_line(&arena, line, len, &state, &link);
+    if (type == RECORD_STATE)
+      bintrace_builder_state(&b, state);
+    else if (type == RECORD_LINK)
+      bintrace_builder_link(&b, link);
+    else
+      bintrace_builder_other(&b, line, len);
+    arena_clear(&arena);
+  }
+  arena_release(&arena);
+  input_close(&in);
+  if (bintrace_builder_write(&b, args.input[1]))
+    LOG_AND_EXIT("Could not write %s: %s\n", args.input[1], strerror(errno));
+  bintrace_builder_del(&b);
+  intern_release();
+  return 0;
+}
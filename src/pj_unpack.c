@@ -0,0 +1,125 @@
+/* Prints a compensated binary trace (see binout.h) as pj_dump text */
+/* For logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include <argp.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "logging.h"
+#include "events.h"
+#include "input.h"
+#include "output.h"
+#include "binout.h"
+
+static char doc[] = "Prints a compensated binary trace (pj_compensate -b) as "
+  "the pj_dump text pj_compensate would have written. The events come block "
+  "by block instead of in the order they were compensated, followed by the "
+  "lines that are neither States nor Links";
+static char args_doc[] = "COMPENSATED-BINARY-TRACE";
+static struct argp_option options[] = {
+  {"version", 'v', 0, OPTION_ARG_OPTIONAL, "Print version", 0},
+  { 0 }
+};
+
+#define NUM_ARGS 1
+
+struct arguments {
+  char *input[NUM_ARGS];
+};
+
+static error_t
+parse_options(int key, char *arg, struct argp_state *state)
+{
+  struct arguments *args = state->input;
+  switch (key) {
+    case 'v':
+      printf("%s\n", VERSION);
+      exit(EXIT_SUCCESS);
+    case ARGP_KEY_ARG:
+      if (state->arg_num == NUM_ARGS)
+        argp_usage(state);
+      args->input[state->arg_num] = arg;
+      break;
+    case ARGP_KEY_END:
+      if (state->arg_num < NUM_ARGS)
+        argp_usage(state);
+      break;
+    default:
+      return ARGP_ERR_UNKNOWN;
+  }
+  return 0;
+}
+
+static struct argp argp = { options, parse_options, args_doc, doc, 0, 0, 0 };
+
+/* Print the States of block of bo */
+static void
+print_states(struct Binout const *bo, size_t block)
+{
+  struct Binout_states cols;
+  binout_states(bo, block, &cols);
+  struct State state;
+  memset(&state, 0, sizeof(state));
+  state.rank = bo->index[block].rank;
+  for (uint64_t i = 0; i < bo->index[block].count; i++) {
+    state.start = cols.start[i];
+    state.end = cols.end[i];
+    state.mark = cols.mark[i];
+    state.code = cols.code[i] < ROUTINE_COUNT ? (enum Routine)(cols.code[i]) :
+      ROUTINE_OTHER;
+    state.routine = binout_string(bo, cols.routine[i]);
+    state.imbrication = cols.imbrication[i];
+    state_print(&state);
+  }
+}
+
+/* Print the Links (of compensated recvs) of block of bo */
+static void
+print_links(struct Binout const *bo, size_t block)
+{
+  struct Binout_links cols;
+  binout_links(bo, block, &cols);
+  struct Link link;
+  memset(&link, 0, sizeof(link));
+  link.to = bo->index[block].rank;
+  link.type = LINK_PTP;
+  for (uint64_t i = 0; i < bo->index[block].count; i++) {
+    link.start = cols.start[i];
+    link.end = cols.end[i];
+    link.mark = cols.mark[i];
+    link.bytes = (size_t)(cols.bytes[i]);
+    link.from = cols.from[i];
+    link.container = binout_string(bo, cols.container[i]);
+    link_print(&link);
+  }
+}
+
+int
+main(int argc, char **argv)
+{
+  struct arguments args;
+  memset(&args, 0, sizeof(args));
+  if (argp_parse(&argp, argc, argv, 0, 0, &args) == ARGP_KEY_ERROR)
+    LOG_AND_EXIT("Unknown error while parsing parameters\n");
+  struct Input in;
+  if (input_open(&in, args.input[0]))
+    LOG_AND_EXIT("Could not open %s: %s\n", args.input[0], strerror(errno));
+  /* (the columns are read in place) */
+  if (!in.map)
+    LOG_AND_EXIT("%s: Compensated binary traces can't be streamed, give the "
+        "uncompressed file itself\n", args.input[0]);
+  struct Binout bo;
+  if (binout_open(&bo, in.map, in.size))
+    LOG_AND_EXIT("%s: Not a compensated binary trace\n", args.input[0]);
+  for (size_t i = 0; i < bo.trailer->blocks; i++) {
+    if (bo.index[i].kind == BINOUT_STATES)
+      print_states(&bo, i);
+    else
+      print_links(&bo, i);
+  }
+  output_write(bo.passthrough, (size_t)(bo.trailer->passthrough_len));
+  output_close();
+  input_close(&in);
+  return 0;
+}
@@ -3,103 +3,286 @@
 #define _POSIX_C_SOURCE 200809L
 #include "queue.h"
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include "logging.h"
-#include "ref.h"
 #include "events.h"
-#include "utlist.h"
 
-void
-state_q_push_ref(struct State_q **head, struct State *state)
+/* Capacity of a queue on its first push */
+#define QUEUE_MIN_CAP 16
+/* Capacity of a link heap on its first push, as it holds copies of links */
+#define LINK_H_MIN_CAP 2
+
+/*
+ * Double the capacity of a full ring of elements of size bytes, returning the
+ * new ring. The elements keep their order, the wrapped ones ([0, head)) being
+ * moved right after the end of the old array.
+ */
+static void *
+ring_grow(void *ring, size_t head, size_t *cap, size_t size)
 {
-  assert(state);
-  struct State_q *node = calloc(1, sizeof(*node));
-  if (!node)
+  size_t new_cap = *cap ? *cap * 2 : QUEUE_MIN_CAP;
+  char *ans = realloc(ring, new_cap * size);
+  if (!ans)
     REPORT_AND_EXIT;
-  node->state = state;
-  ref_inc(&(state->ref));
-  /* head can be null, in this case node becomes the head (thus **) */
-  DL_APPEND(*head, node);
+  if (head)
+    memcpy(ans + *cap * size, ans, head * size);
+  *cap = new_cap;
+  return ans;
 }
 
 void
-state_q_push_cpy(struct State_q **head, struct State *state)
+state_q_push(struct State_q *q, uint32_t index)
 {
-  assert(state);
-  struct State_q *node = calloc(1, sizeof(*node));
-  if (!node)
-    REPORT_AND_EXIT;
-  node->state = state_cpy(state);
-  DL_APPEND(*head, node);
+  assert(index != STORE_NONE);
+  if (q->len == q->cap)
+    q->ring = ring_grow(q->ring, q->head, &(q->cap), sizeof(*(q->ring)));
+  q->ring[(q->head + q->len++) & (q->cap - 1)] = index;
 }
 
 void
-state_q_pop(struct State_q **head)
+state_q_empty(struct State_q *q)
 {
-  struct State_q *old_head = *head;
-  DL_DELETE(*head, *head);
-  /* (the state) */
-  assert(old_head->state);
-  ref_dec(&(old_head->state->ref));
-  /* (the node) */
-  free(old_head);
+  free(q->ring);
+  memset(q, 0, sizeof(*q));
 }
 
 void
-state_q_empty(struct State_q **q)
+link_q_push_ref(struct Link_q *q, struct Link *link)
 {
-  struct State_q *iter = NULL, *tmp = NULL;
-  DL_FOREACH_SAFE(*q, iter, tmp) {
-    state_q_pop(q);
-  }
+  assert(link);
+  if (q->len == q->cap)
+    q->ring = ring_grow(q->ring, q->head, &(q->cap), sizeof(*(q->ring)));
+  q->ring[(q->head + q->len++) & (q->cap - 1)] = link;
 }
 
 void
-state_q_delete(struct State_q **q, struct State_q *ele)
+link_q_empty(struct Link_q *q)
 {
-  DL_DELETE(*q, ele);
-  /* (the state) */
-  assert(ele->state);
-  ref_dec(&(ele->state->ref));
-  /* (the node) */
-  free(ele);
+  free(q->ring);
+  memset(q, 0, sizeof(*q));
 }
 
-void
-link_q_push_ref(struct Link_q **head, struct Link *link)
+/*
+ * Sorting links by end time
+ *
+ * Links are sorted by the bits of their end time, with an LSD radix sort of
+ * RADIX_BITS per pass, skipping the passes whose digit is the same for every
+ * link (like the high bits of timestamps close to each other). The keys are
+ * copied next to their links once, so the passes don't chase pointers. Being
+ * an LSD radix sort, it is stable.
+ *
+ * Links are pushed in start time order, so their ends are often sorted
+ * already, which is checked first. Queues of less than RADIX_MIN links are
+ * insertion sorted instead.
+ */
+
+#define RADIX_BITS 11
+#define RADIX_DIGITS (1 << RADIX_BITS)
+#define RADIX_PASSES ((64 + RADIX_BITS - 1) / RADIX_BITS)
+#define RADIX_MIN 64
+
+struct Link_key {
+  uint64_t key;
+  struct Link *link;
+};
+
+/* Room for the keys of a queue being sorted (and their copy) */
+struct Sort_buf {
+  struct Link_key *keys,
+                  *tmp;
+  size_t cap;
+};
+
+/*
+ * The bits of the end time of link, flipped so that they compare as unsigned
+ * integers the way the doubles do (-0 being 0)
+ */
+static inline uint64_t
+link_key(struct Link const *link)
 {
-  assert(link);
-  struct Link_q *node = calloc(1, sizeof(*node));
-  if (!node)
-    REPORT_AND_EXIT;
-  node->link = link;
-  ref_inc(&(link->ref));
-  DL_APPEND(*head, node);
+  uint64_t bits;
+  memcpy(&bits, &(link->end), sizeof(bits));
+  if (!(bits << 1))
+    bits = 0;
+  return bits >> 63 ? ~bits : bits | UINT64_C(1) << 63;
+}
+
+/* Stable sort of the n keys of a, returns a or tmp, whichever has them */
+static struct Link_key *
+keys_sort(struct Link_key *a, struct Link_key *tmp, size_t n)
+{
+  if (n < RADIX_MIN) {
+    for (size_t i = 1; i < n; i++) {
+      struct Link_key k = a[i];
+      size_t j = i;
+      for (; j && a[j - 1].key > k.key; j--)
+        a[j] = a[j - 1];
+      a[j] = k;
+    }
+    return a;
+  }
+  size_t counts[RADIX_PASSES][RADIX_DIGITS];
+  memset(counts, 0, sizeof(counts));
+  for (size_t i = 0; i < n; i++)
+    for (unsigned p = 0; p < RADIX_PASSES; p++)
+      counts[p][(a[i].key >> (p * RADIX_BITS)) & (RADIX_DIGITS - 1)]++;
+  for (unsigned p = 0; p < RADIX_PASSES; p++) {
+    unsigned shift = p * RADIX_BITS;
+    if (counts[p][(a[0].key >> shift) & (RADIX_DIGITS - 1)] == n)
+      continue;
+    size_t pos = 0;
+    for (unsigned d = 0; d < RADIX_DIGITS; d++) {
+      size_t c = counts[p][d];
+      counts[p][d] = pos;
+      pos += c;
+    }
+    for (size_t i = 0; i < n; i++)
+      tmp[counts[p][(a[i].key >> shift) & (RADIX_DIGITS - 1)]++] = a[i];
+    struct Link_key *swap = a;
+    a = tmp;
+    tmp = swap;
+  }
+  return a;
+}
+
+/* Stable sort of q by end time, with buf. Aborts on failure. */
+static void
+link_q_sort_buf(struct Link_q *q, struct Sort_buf *buf)
+{
+  size_t i = 1;
+  while (i < q->len && q->ring[(q->head + i - 1) & (q->cap - 1)]->end <=
+      q->ring[(q->head + i) & (q->cap - 1)]->end)
+    i++;
+  if (i >= q->len)
+    return;
+  if (buf->cap < q->len) {
+    free(buf->keys);
+    free(buf->tmp);
+    buf->cap = q->len;
+    buf->keys = malloc(buf->cap * sizeof(*(buf->keys)));
+    buf->tmp = malloc(buf->cap * sizeof(*(buf->tmp)));
+    if (!buf->keys || !buf->tmp)
+      REPORT_AND_EXIT;
+  }
+  for (i = 0; i < q->len; i++) {
+    struct Link *link = q->ring[(q->head + i) & (q->cap - 1)];
+    buf->keys[i].key = link_key(link);
+    buf->keys[i].link = link;
+  }
+  struct Link_key const *sorted = keys_sort(buf->keys, buf->tmp, q->len);
+  /* (unwrapping the ring) */
+  for (i = 0; i < q->len; i++)
+    q->ring[i] = sorted[i].link;
+  q->head = 0;
+}
+
+/* The queues sorted by link_qs_sort_e, each taken by the next free thread */
+struct Sort_job {
+  struct Link_q *qs;
+  size_t n,
+         next;
+  pthread_mutex_t lock;
+};
+
+static void *
+sort_worker(void *arg)
+{
+  struct Sort_job *job = arg;
+  struct Sort_buf buf = { NULL, NULL, 0 };
+  for (;;) {
+    pthread_mutex_lock(&(job->lock));
+    size_t i = job->next++;
+    pthread_mutex_unlock(&(job->lock));
+    if (i >= job->n)
+      break;
+    link_q_sort_buf(job->qs + i, &buf);
+  }
+  free(buf.keys);
+  free(buf.tmp);
+  return NULL;
 }
 
 void
-link_q_pop(struct Link_q **head)
+link_qs_sort_e(struct Link_q *qs, size_t n, unsigned jobs)
+{
+  struct Sort_job job = { qs, n, 0, PTHREAD_MUTEX_INITIALIZER };
+  size_t nthreads = jobs < n ? jobs : n;
+  if (nthreads < 2) {
+    sort_worker(&job);
+  } else {
+    pthread_t *threads = malloc(nthreads * sizeof(*threads));
+    if (!threads)
+      REPORT_AND_EXIT;
+    for (size_t i = 0; i < nthreads; i++)
+      if ((errno = pthread_create(threads + i, NULL, sort_worker, &job)))
+        REPORT_AND_EXIT;
+    for (size_t i = 0; i < nthreads; i++)
+      if ((errno = pthread_join(threads[i], NULL)))
+        REPORT_AND_EXIT;
+    free(threads);
+  }
+  pthread_mutex_destroy(&(job.lock));
+}
+
+/*
+ * Heap of links by end time
+ */
+
+/* Whether a comes before b, by end time and then push order */
+static inline bool
+node_before(struct Link_h_node const *a, struct Link_h_node const *b)
 {
-  struct Link_q *old_head = *head;
-  DL_DELETE(*head, *head);
-  ref_dec(&(old_head->link->ref));
-  free(old_head);
+  if (a->link.end < b->link.end)
+    return true;
+  return !(b->link.end < a->link.end) && a->seq < b->seq;
 }
 
-int
-link_q_sort_e(struct Link_q const *a, struct Link_q const *b)
+void
+link_h_push(struct Link_h *h, struct Link const *link)
 {
-  assert(a && b);
-  double A = a->link->end;
-  double B = b->link->end;
-  return (A > B) - (A < B);
+  assert(link);
+  if (h->len == h->cap) {
+    h->cap = h->cap ? h->cap * 2 : LINK_H_MIN_CAP;
+    h->nodes = realloc(h->nodes, h->cap * sizeof(*(h->nodes)));
+    if (!h->nodes)
+      REPORT_AND_EXIT;
+  }
+  struct Link_h_node node = { *link, h->seq++ };
+  size_t i = h->len++;
+  while (i && node_before(&node, h->nodes + (i - 1) / 2)) {
+    h->nodes[i] = h->nodes[(i - 1) / 2];
+    i = (i - 1) / 2;
+  }
+  h->nodes[i] = node;
 }
 
 void
-link_q_empty(struct Link_q **q)
+link_h_pop(struct Link_h *h)
 {
-  struct Link_q *iter = NULL, *tmp = NULL;
-  DL_FOREACH_SAFE(*q, iter, tmp) {
-    link_q_pop(q);
+  assert(h->len);
+  struct Link_h_node const last = h->nodes[--h->len];
+  size_t i = 0;
+  for (;;) {
+    size_t min = 2 * i + 1;
+    if (min >= h->len)
+      break;
+    if (min + 1 < h->len && node_before(h->nodes + min + 1, h->nodes + min))
+      min++;
+    if (!node_before(h->nodes + min, &last))
+      break;
+    h->nodes[i] = h->nodes[min];
+    i = min;
   }
+  h->nodes[i] = last;
+}
+
+void
+link_h_empty(struct Link_h *h)
+{
+  free(h->nodes);
+  memset(h, 0, sizeof(*h));
 }
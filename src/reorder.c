@@ -0,0 +1,542 @@
+/* See the header file for contracts and more docs */
+/* pread, logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "reorder.h"
+#include "events.h"
+#include "textout.h"
+#include "split.h"
+#include "paje.h"
+#include "logging.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+/* A compensated State or Link (its string is interned, see intern.h) */
+struct Reorder_event {
+  double start,
+         end;
+  /* Order of compensation, to break ties */
+  uint64_t seq;
+  uint64_t mark;
+  size_t bytes;
+  /* Routine of a State, container of a Link */
+  char const *str;
+  /* For a Link, rank is where it is from */
+  int rank,
+      to,
+      imbrication;
+  enum Routine code;
+  enum Record type;
+  /* Of the rank the event belongs to, see reorder.h */
+  uint32_t run;
+};
+
+/* len events of a run, in memory (mem) or spilled at offset */
+struct Reorder_chunk {
+  struct Reorder_event *mem;
+  off_t offset;
+  size_t len;
+};
+
+/*
+ * A sorted run: its chunks, then what was left in the buffer at the end. The
+ * rest is the merge cursor, the events at [pos, len) of buf being the next
+ * ones.
+ */
+struct Reorder_run {
+  struct Reorder_chunk *chunks;
+  size_t nchunks,
+         chunks_cap;
+  struct Reorder_event *tail;
+  size_t tail_len;
+  size_t chunk,
+         chunk_pos;
+  struct Reorder_event *buf;
+  size_t pos,
+         len;
+  /* Whether buf is the mem of a chunk rather than a read buffer */
+  bool buf_mem,
+       in_tail;
+};
+
+struct Reorder_rank {
+  /* Min-heap of up to r.size events */
+  struct Reorder_event *heap;
+  size_t len;
+  /* The run being written (an index in r.runs), SIZE_MAX if none yet */
+  size_t run;
+  uint32_t run_no;
+  /* Start of the last event taken out of the heap */
+  double last;
+  /* Events of run not in a chunk yet */
+  struct Reorder_event *out;
+  size_t out_len;
+};
+
+static struct Reorder {
+  bool active;
+  size_t size;
+  struct Reorder_rank *ranks;
+  size_t nranks;
+  struct Reorder_run *runs;
+  size_t nruns,
+         runs_cap;
+  /* Events in the chunks kept in memory */
+  size_t in_memory;
+  /* Created on the first spill */
+  FILE *spill;
+  off_t spill_off;
+  uint64_t seq,
+           late,
+           spilled;
+} r;
+
+/* Read this many events of a spilled chunk at a time when merging */
+#define REORDER_READ 256
+/* Chunks are kept in memory up to this many bytes, then spilled */
+#define REORDER_MEMORY ((size_t)256 << 20)
+
+/* Whether a goes before b in a run */
+static inline bool
+event_before(struct Reorder_event const *a, struct Reorder_event const *b)
+{
+  return a->start < b->start || (!(a->start > b->start) && a->seq < b->seq);
+}
+
+/* Whether a goes before b in the heap of a rank */
+static inline bool
+pending_before(struct Reorder_event const *a, struct Reorder_event const *b)
+{
+  return a->run < b->run || (a->run == b->run && event_before(a, b));
+}
+
+static int
+pending_cmp(void const *a, void const *b)
+{
+  return pending_before(a, b) ? -1 : (pending_before(b, a) ? 1 : 0);
+}
+
+static void
+heap_down(struct Reorder_event *heap, size_t len, size_t i)
+{
+  for (;;) {
+    size_t l = 2 * i + 1,
+           ri = l + 1,
+           min = i;
+    if (l < len && pending_before(heap + l, heap + min))
+      min = l;
+    if (ri < len && pending_before(heap + ri, heap + min))
+      min = ri;
+    if (min == i)
+      return;
+    struct Reorder_event tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+static void
+heap_up(struct Reorder_event *heap, size_t i)
+{
+  while (i) {
+    size_t parent = (i - 1) / 2;
+    if (!pending_before(heap + i, heap + parent))
+      return;
+    struct Reorder_event tmp = heap[i];
+    heap[i] = heap[parent];
+    heap[parent] = tmp;
+    i = parent;
+  }
+}
+
+static struct Reorder_rank *
+reorder_rank(int rank)
+{
+  if (rank < 0)
+    LOG_AND_EXIT("Negative rank %d can't be sorted\n", rank);
+  if ((size_t)rank >= r.nranks) {
+    size_t new_ranks = (size_t)rank + 1;
+    r.ranks = realloc(r.ranks, new_ranks * sizeof(*(r.ranks)));
+    if (!r.ranks)
+      REPORT_AND_EXIT;
+    memset(r.ranks + r.nranks, 0, (new_ranks - r.nranks) * sizeof(*(r.ranks)));
+    for (size_t i = r.nranks; i < new_ranks; i++)
+      r.ranks[i].run = SIZE_MAX;
+    r.nranks = new_ranks;
+  }
+  struct Reorder_rank *rk = r.ranks + rank;
+  if (!rk->heap) {
+    rk->heap = malloc(r.size * sizeof(*(rk->heap)));
+    if (!rk->heap)
+      REPORT_AND_EXIT;
+  }
+  return rk;
+}
+
+static struct Reorder_run *
+run_new(void)
+{
+  if (r.nruns == r.runs_cap) {
+    r.runs_cap = r.runs_cap ? 2 * r.runs_cap : 64;
+    r.runs = realloc(r.runs, r.runs_cap * sizeof(*(r.runs)));
+    if (!r.runs)
+      REPORT_AND_EXIT;
+  }
+  struct Reorder_run *run = r.runs + r.nruns++;
+  memset(run, 0, sizeof(*run));
+  return run;
+}
+
+/*
+ * Make the events of rk->out a chunk of its run, kept in memory while there is
+ * room for it, written to the spill file otherwise
+ */
+static void
+spill(struct Reorder_rank *rk)
+{
+  if (!rk->out_len)
+    return;
+  struct Reorder_run *run = r.runs + rk->run;
+  if (run->nchunks == run->chunks_cap) {
+    run->chunks_cap = run->chunks_cap ? 2 * run->chunks_cap : 16;
+    run->chunks = realloc(run->chunks, run->chunks_cap *
+        sizeof(*(run->chunks)));
+    if (!run->chunks)
+      REPORT_AND_EXIT;
+  }
+  struct Reorder_chunk *chunk = run->chunks + run->nchunks++;
+  chunk->len = rk->out_len;
+  rk->out_len = 0;
+  if ((r.in_memory + chunk->len) * sizeof(*(rk->out)) <= REORDER_MEMORY) {
+    /* (a run cut short leaves a partial chunk) */
+    chunk->mem = chunk->len < REORDER_CHUNK ? realloc(rk->out, chunk->len *
+        sizeof(*(rk->out))) : rk->out;
+    if (!chunk->mem)
+      REPORT_AND_EXIT;
+    rk->out = NULL;
+    r.in_memory += chunk->len;
+    return;
+  }
+  if (!r.spill && !(r.spill = tmpfile()))
+    REPORT_AND_EXIT;
+  if (fwrite(rk->out, sizeof(*(rk->out)), chunk->len, r.spill) != chunk->len)
+    REPORT_AND_EXIT;
+  chunk->mem = NULL;
+  chunk->offset = r.spill_off;
+  r.spill_off += (off_t)(chunk->len * sizeof(*(rk->out)));
+  r.spilled += chunk->len;
+}
+
+/* Append event, the earliest of the heap of rk, to the run of rk */
+static void
+run_append(struct Reorder_rank *rk, struct Reorder_event const *event)
+{
+  if (rk->run == SIZE_MAX || event->run != rk->run_no) {
+    if (rk->run != SIZE_MAX)
+      spill(rk);
+    run_new();
+    rk->run = r.nruns - 1;
+    rk->run_no = event->run;
+  }
+  if (!rk->out) {
+    rk->out = malloc(REORDER_CHUNK * sizeof(*(rk->out)));
+    if (!rk->out)
+      REPORT_AND_EXIT;
+  }
+  rk->out[rk->out_len++] = *event;
+  rk->last = event->start;
+  if (rk->out_len == REORDER_CHUNK)
+    spill(rk);
+}
+
+static void
+reorder_push(int rank, struct Reorder_event *event)
+{
+  struct Reorder_rank *rk = reorder_rank(rank);
+  if (rk->len == r.size) {
+    run_append(rk, rk->heap);
+    rk->heap[0] = rk->heap[--rk->len];
+    heap_down(rk->heap, rk->len, 0);
+  }
+  event->seq = r.seq++;
+  event->run = rk->run_no;
+  /* (too late for the run being written) */
+  if (rk->run != SIZE_MAX && event->start < rk->last) {
+    event->run++;
+    r.late++;
+  }
+  rk->heap[rk->len] = *event;
+  heap_up(rk->heap, rk->len++);
+}
+
+void
+reorder_start(size_t size)
+{
+  assert(!r.active && size);
+  memset(&r, 0, sizeof(r));
+  r.active = true;
+  r.size = size;
+}
+
+bool
+reorder_active(void)
+{
+  return r.active;
+}
+
+void
+reorder_state(struct State const *state)
+{
+  assert(state);
+  struct Reorder_event event = {
+    .start = state->start,
+    .end = state->end,
+    .mark = state->mark,
+    .str = state->routine,
+    .rank = state->rank,
+    .imbrication = state->imbrication,
+    .code = state->code,
+    .type = RECORD_STATE
+  };
+  reorder_push(state->rank, &event);
+}
+
+void
+reorder_link(struct Link const *link)
+{
+  assert(link);
+  struct Reorder_event event = {
+    .start = link->start,
+    .end = link->end,
+    .mark = link->mark,
+    .bytes = link->bytes,
+    .str = link->container,
+    .rank = link->from,
+    .to = link->to,
+    .type = RECORD_LINK
+  };
+  reorder_push(link->from, &event);
+}
+
+/* Sort what is left in the heap of rk into the tails of its runs */
+static void
+rank_drain(struct Reorder_rank *rk)
+{
+  qsort(rk->heap, rk->len, sizeof(*(rk->heap)), pending_cmp);
+  size_t i = 0;
+  while (i < rk->len || rk->out_len) {
+    /* (the events not spilled yet go first, in the same run) */
+    size_t j = i;
+    uint32_t run_no = i < rk->len ? rk->heap[i].run : rk->run_no;
+    if (rk->run == SIZE_MAX || run_no != rk->run_no) {
+      spill(rk);
+      run_new();
+      rk->run = r.nruns - 1;
+      rk->run_no = run_no;
+    }
+    while (j < rk->len && rk->heap[j].run == run_no)
+      j++;
+    struct Reorder_run *run = r.runs + rk->run;
+    run->tail_len = rk->out_len + (j - i);
+    run->tail = malloc(run->tail_len * sizeof(*(run->tail)));
+    if (!run->tail)
+      REPORT_AND_EXIT;
+    memcpy(run->tail, rk->out, rk->out_len * sizeof(*(rk->out)));
+    memcpy(run->tail + rk->out_len, rk->heap + i, (j - i) *
+        sizeof(*(rk->heap)));
+    rk->out_len = 0;
+    /* (any other run of the rank is a new one) */
+    rk->run = SIZE_MAX;
+    i = j;
+  }
+  free(rk->heap);
+  free(rk->out);
+}
+
+/* Load the next events of run into its buffer, returns false if none left */
+static bool
+run_fill(struct Reorder_run *run)
+{
+  if (run->in_tail)
+    return false;
+  if (run->buf_mem) {
+    free(run->buf);
+    run->buf = NULL;
+    run->buf_mem = false;
+  }
+  if (run->chunk == run->nchunks) {
+    run->in_tail = true;
+    free(run->buf);
+    run->buf = run->tail;
+    run->pos = 0;
+    run->len = run->tail_len;
+    return run->len;
+  }
+  struct Reorder_chunk *chunk = run->chunks + run->chunk;
+  if (chunk->mem) {
+    free(run->buf);
+    run->buf_mem = true;
+    run->buf = chunk->mem;
+    run->pos = 0;
+    run->len = chunk->len;
+    run->chunk++;
+    return true;
+  }
+  if (!run->buf) {
+    run->buf = malloc(REORDER_READ * sizeof(*(run->buf)));
+    if (!run->buf)
+      REPORT_AND_EXIT;
+  }
+  size_t n = chunk->len - run->chunk_pos;
+  if (n > REORDER_READ)
+    n = REORDER_READ;
+  size_t size = n * sizeof(*(run->buf));
+  off_t offset = chunk->offset + (off_t)(run->chunk_pos *
+      sizeof(*(run->buf)));
+  char *dst = (char *)(run->buf);
+  while (size) {
+    ssize_t rc = pread(fileno(r.spill), dst, size, offset);
+    if (rc == -1 && errno == EINTR)
+      continue;
+    if (rc <= 0) {
+      if (!rc)
+        errno = EIO;
+      REPORT_AND_EXIT;
+    }
+    dst += rc;
+    size -= (size_t)rc;
+    offset += (off_t)rc;
+  }
+  run->pos = 0;
+  run->len = n;
+  run->chunk_pos += n;
+  if (run->chunk_pos == chunk->len) {
+    run->chunk++;
+    run->chunk_pos = 0;
+  }
+  return true;
+}
+
+/* Whether the next event of a goes before the one of b */
+static inline bool
+run_before(struct Reorder_run const *a, struct Reorder_run const *b)
+{
+  return event_before(a->buf + a->pos, b->buf + b->pos);
+}
+
+static void
+merge_down(struct Reorder_run **heap, size_t len, size_t i)
+{
+  for (;;) {
+    size_t l = 2 * i + 1,
+           ri = l + 1,
+           min = i;
+    if (l < len && run_before(heap[l], heap[min]))
+      min = l;
+    if (ri < len && run_before(heap[ri], heap[min]))
+      min = ri;
+    if (min == i)
+      return;
+    struct Reorder_run *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+static void
+event_print(struct Reorder_event const *event)
+{
+  if (event->type == RECORD_STATE) {
+    struct State state;
+    memset(&state, 0, sizeof(state));
+    state.start = event->start;
+    state.end = event->end;
+    state.imbrication = event->imbrication;
+    state.rank = event->rank;
+    state.code = event->code;
+    state.routine = event->str;
+    state.mark = event->mark;
+    if (paje_out_active())
+      paje_out_state(&state);
+    else if (split_active())
+      split_state(&state);
+    else if (textout_active())
+      textout_state(&state);
+    else
+      state_print(&state);
+  } else {
+    struct Link link;
+    memset(&link, 0, sizeof(link));
+    link.mark = event->mark;
+    link.start = event->start;
+    link.end = event->end;
+    link.bytes = event->bytes;
+    link.from = event->rank;
+    link.to = event->to;
+    link.type = LINK_PTP;
+    link.container = event->str;
+    if (paje_out_active())
+      paje_out_link(&link);
+    else if (split_active())
+      split_link(&link);
+    else if (textout_active())
+      textout_link(&link);
+    else
+      link_print(&link);
+  }
+}
+
+void
+reorder_finish(void)
+{
+  assert(r.active);
+  for (size_t i = 0; i < r.nranks; i++)
+    if (r.ranks[i].heap)
+      rank_drain(r.ranks + i);
+  if (r.spill && fflush(r.spill))
+    REPORT_AND_EXIT;
+  struct Reorder_run **heap = malloc((r.nruns ? r.nruns : 1) *
+      sizeof(*heap));
+  if (!heap)
+    REPORT_AND_EXIT;
+  size_t len = 0;
+  for (size_t i = 0; i < r.nruns; i++)
+    if (run_fill(r.runs + i))
+      heap[len++] = r.runs + i;
+  for (size_t i = len / 2; i--;)
+    merge_down(heap, len, i);
+  while (len) {
+    struct Reorder_run *run = heap[0];
+    event_print(run->buf + run->pos);
+    if (++run->pos == run->len && !run_fill(run))
+      heap[0] = heap[--len];
+    merge_down(heap, len, 0);
+  }
+  free(heap);
+  /* (a bigger buffer would have taken fewer runs, or no spill) */
+  if (r.late || r.spilled)
+    LOG_WARNING("Sorted %"PRIu64" events with a reorder buffer of %zu events "
+        "per rank: %"PRIu64" came out of order beyond it, %zu runs, "
+        "%"PRIu64" events spilled to disk (see --sort)\n", r.seq, r.size,
+        r.late, r.nruns, r.spilled);
+  else
+    LOG_INFO("Sorted %"PRIu64" events with a reorder buffer of %zu events "
+        "per rank: %zu runs, in memory\n", r.seq, r.size, r.nruns);
+  for (size_t i = 0; i < r.nruns; i++) {
+    free(r.runs[i].chunks);
+    free(r.runs[i].buf);
+  }
+  free(r.runs);
+  free(r.ranks);
+  if (r.spill)
+    fclose(r.spill);
+  memset(&r, 0, sizeof(r));
+}
@@ -0,0 +1,189 @@
+/* See the header file for contracts and more docs */
+/* logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "sends.h"
+#include "store.h"
+#include "logging.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+/* Room of a dense index on its first Send, when not reserved beforehand */
+#define SENDS_FIRST 16
+
+/* (Fibonacci hashing, as consecutive marks are the common case) */
+static inline size_t
+sends_hash(uint64_t mark, size_t cap)
+{
+  return (size_t)((mark * UINT64_C(0x9E3779B97F4A7C15)) >> 32) & (cap - 1);
+}
+
+/*
+ * Put mark in the first unused slot of its probe sequence. Returns whether it
+ * was already in the table.
+ */
+static bool
+slots_put(struct Sends_slot *slots, size_t cap, uint64_t mark, uint32_t
+    handle)
+{
+  bool ans = false;
+  size_t i = sends_hash(mark, cap);
+  for (; slots[i].used; i = (i + 1) & (cap - 1))
+    ans |= slots[i].mark == mark;
+  slots[i].mark = mark;
+  slots[i].handle = handle;
+  slots[i].used = 1;
+  return ans;
+}
+
+/* Move every Send to a table of at least twice n slots */
+static void
+sends_rehash(struct Sends *s, size_t n)
+{
+  size_t cap = SENDS_FIRST;
+  while (cap < 2 * n)
+    cap *= 2;
+  struct Sends_slot *slots = calloc(cap, sizeof(*slots));
+  if (!slots)
+    REPORT_AND_EXIT;
+  if (s->slots) {
+    /*
+     * In slot order from an unused slot (there is one, the table being at most
+     * half full), so that every probe sequence is walked in order, which keeps
+     * the order of the Sends of each mark
+     */
+    size_t start = 0;
+    while (s->slots[start].used)
+      start++;
+    for (size_t k = 1; k <= s->cap; k++) {
+      struct Sends_slot const *slot = s->slots + ((start + k) & (s->cap - 1));
+      if (slot->used)
+        slots_put(slots, cap, slot->mark, slot->handle);
+    }
+    free(s->slots);
+  } else {
+    for (size_t i = 0; i < s->len; i++)
+      slots_put(slots, cap, s->base + i, s->dense[i]);
+    free(s->dense);
+    s->dense = NULL;
+  }
+  s->slots = slots;
+  s->cap = cap;
+}
+
+void
+sends_reserve(struct Sends *s, size_t n)
+{
+  if (s->slots) {
+    if (2 * n > s->cap)
+      sends_rehash(s, n);
+  } else if (n > s->cap) {
+    s->dense = realloc(s->dense, n * sizeof(*(s->dense)));
+    if (!s->dense)
+      REPORT_AND_EXIT;
+    s->cap = n;
+  }
+}
+
+void
+sends_push(struct Sends *s, uint64_t mark, uint32_t handle)
+{
+  if (!s->slots) {
+    if (!s->len)
+      s->base = mark;
+    if (mark >= s->base && mark - s->base == s->len) {
+      if (s->len == s->cap)
+        sends_reserve(s, s->cap ? 2 * s->cap : SENDS_FIRST);
+      s->dense[s->len++] = handle;
+      return;
+    }
+    /* (sized for as many Sends as the dense index was) */
+    sends_rehash(s, s->cap > s->len ? s->cap : s->len + 1);
+  }
+  if (2 * (s->len + 1) > s->cap)
+    sends_rehash(s, s->len + 1);
+  s->dups += slots_put(s->slots, s->cap, mark, handle);
+  s->len++;
+}
+
+uint32_t *
+sends_find(struct Sends *s, uint64_t mark)
+{
+  if (!s->slots) {
+    if (mark < s->base || mark - s->base >= s->len ||
+        s->dense[mark - s->base] == STORE_NONE)
+      return NULL;
+    return s->dense + (mark - s->base);
+  }
+  size_t i = sends_hash(mark, s->cap);
+  for (; s->slots[i].used; i = (i + 1) & (s->cap - 1))
+    if (s->slots[i].mark == mark && s->slots[i].handle != STORE_NONE)
+      return &(s->slots[i].handle);
+  return NULL;
+}
+
+uint32_t
+sends_take(struct Sends *s, uint64_t mark)
+{
+  uint32_t *handle = NULL;
+  if (s->dups) {
+    handle = sends_find(s, mark);
+    if (!handle)
+      return STORE_NONE;
+    uint32_t ans = *handle;
+    *handle = STORE_NONE;
+    return ans;
+  }
+  /* (the only Send with mark, if any, consumed or not) */
+  if (!s->slots) {
+    if (mark < s->base || mark - s->base >= s->len)
+      return STORE_NONE;
+    handle = s->dense + (mark - s->base);
+  } else {
+    size_t i = sends_hash(mark, s->cap);
+    for (; s->slots[i].used && !handle; i = (i + 1) & (s->cap - 1))
+      if (s->slots[i].mark == mark)
+        handle = &(s->slots[i].handle);
+    if (!handle)
+      return STORE_NONE;
+  }
+  return __atomic_exchange_n(handle, STORE_NONE, __ATOMIC_RELAXED);
+}
+
+void
+sends_sweep(struct Sends *s, bool (*linked)(void *arg, uint32_t handle), void
+    *arg)
+{
+  if (!s->slots) {
+    for (size_t i = 0; i < s->len; i++)
+      if (s->dense[i] != STORE_NONE && linked(arg, s->dense[i]))
+        s->dense[i] = STORE_NONE;
+  } else {
+    for (size_t i = 0; i < s->cap; i++)
+      if (s->slots[i].used && s->slots[i].handle != STORE_NONE &&
+          linked(arg, s->slots[i].handle))
+        s->slots[i].handle = STORE_NONE;
+  }
+}
+
+size_t
+sends_pending(struct Sends const *s)
+{
+  size_t ans = 0;
+  if (!s->slots) {
+    for (size_t i = 0; i < s->len; i++)
+      ans += s->dense[i] != STORE_NONE;
+  } else {
+    for (size_t i = 0; i < s->cap; i++)
+      ans += s->slots[i].used && s->slots[i].handle != STORE_NONE;
+  }
+  return ans;
+}
+
+void
+sends_empty(struct Sends *s)
+{
+  free(s->dense);
+  free(s->slots);
+  memset(s, 0, sizeof(*s));
+}
@@ -0,0 +1,269 @@
+/* See the header file for contracts and more docs */
+/* pwrite, logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "split.h"
+#include "events.h"
+#include "output.h"
+#include "logging.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+struct Split_sink {
+  int fd;
+  /* Where the next buffer goes in the file */
+  off_t offset;
+  char *buf;
+  size_t len;
+};
+
+/* A buffer to write at offset of fd */
+struct Split_job {
+  int fd;
+  off_t offset;
+  char *buf;
+  size_t len;
+};
+
+static struct Split {
+  bool active;
+  char *prefix;
+  struct Split_sink *sinks;
+  size_t nsinks;
+  pthread_t *writers;
+  unsigned nwriters;
+  pthread_mutex_t lock;
+  pthread_cond_t queued,
+                 written;
+  /* Jobs [head, head + count) of the ring are waiting for a writer */
+  struct Split_job queue[SPLIT_QUEUE];
+  size_t head,
+         count;
+  /* Jobs taken by a writer and not written yet */
+  size_t writing;
+  bool done;
+  /* Written buffers, for reuse */
+  char **free_bufs;
+  size_t nfree;
+  /* errno of the first failed write, 0 if none */
+  int failed;
+} s;
+
+/* Returns 0 on success, -1 on failure, in which case it also sets errno */
+static int
+pwrite_all(int fd, char const *buf, size_t len, off_t offset)
+{
+  while (len) {
+    ssize_t rc = pwrite(fd, buf, len, offset);
+    if (rc == -1 && errno == EINTR)
+      continue;
+    if (rc == -1)
+      return -1;
+    buf += rc;
+    len -= (size_t)rc;
+    offset += (off_t)rc;
+  }
+  return 0;
+}
+
+static void *
+split_writer(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&(s.lock));
+  for (;;) {
+    while (!s.count && !s.done)
+      pthread_cond_wait(&(s.queued), &(s.lock));
+    if (!s.count)
+      break;
+    struct Split_job job = s.queue[s.head];
+    s.head = (s.head + 1) % SPLIT_QUEUE;
+    s.count--;
+    s.writing++;
+    pthread_cond_signal(&(s.written));
+    pthread_mutex_unlock(&(s.lock));
+    int err = pwrite_all(job.fd, job.buf, job.len, job.offset) ? errno : 0;
+    pthread_mutex_lock(&(s.lock));
+    if (err && !s.failed)
+      s.failed = err;
+    s.free_bufs[s.nfree++] = job.buf;
+    s.writing--;
+    pthread_cond_signal(&(s.written));
+  }
+  pthread_mutex_unlock(&(s.lock));
+  return NULL;
+}
+
+/* Assumes s.lock is held */
+static inline void
+check_failed(void)
+{
+  if (s.failed) {
+    errno = s.failed;
+    REPORT_AND_EXIT;
+  }
+}
+
+/* Hand the buffer of sink to the writers, giving it an empty one */
+static void
+sink_submit(struct Split_sink *sink)
+{
+  pthread_mutex_lock(&(s.lock));
+  while (s.count == SPLIT_QUEUE)
+    pthread_cond_wait(&(s.written), &(s.lock));
+  check_failed();
+  s.queue[(s.head + s.count++) % SPLIT_QUEUE] = (struct Split_job){ sink->fd,
+    sink->offset, sink->buf, sink->len };
+  pthread_cond_signal(&(s.queued));
+  char *buf = s.nfree ? s.free_bufs[--s.nfree] : NULL;
+  pthread_mutex_unlock(&(s.lock));
+  if (!buf && !(buf = malloc(SPLIT_BUFFER)))
+    REPORT_AND_EXIT;
+  sink->offset += (off_t)(sink->len);
+  sink->buf = buf;
+  sink->len = 0;
+}
+
+static struct Split_sink *
+split_sink(int rank)
+{
+  if (rank < 0)
+    LOG_AND_EXIT("Negative rank %d can't be written\n", rank);
+  if ((size_t)rank >= s.nsinks) {
+    size_t new_sinks = (size_t)rank + 1;
+    s.sinks = realloc(s.sinks, new_sinks * sizeof(*(s.sinks)));
+    if (!s.sinks)
+      REPORT_AND_EXIT;
+    memset(s.sinks + s.nsinks, 0, (new_sinks - s.nsinks) * sizeof(*(s.sinks)));
+    for (size_t i = s.nsinks; i < new_sinks; i++)
+      s.sinks[i].fd = -1;
+    s.nsinks = new_sinks;
+  }
+  struct Split_sink *sink = s.sinks + rank;
+  if (sink->fd == -1) {
+    size_t len = strlen(s.prefix) + 16;
+    char *path = malloc(len);
+    if (!path)
+      REPORT_AND_EXIT;
+    snprintf(path, len, "%s.%d", s.prefix, rank);
+    sink->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (sink->fd == -1) {
+      perror(path);
+      exit(EXIT_FAILURE);
+    }
+    free(path);
+    sink->buf = malloc(SPLIT_BUFFER);
+    if (!sink->buf)
+      REPORT_AND_EXIT;
+  }
+  return sink;
+}
+
+/* Room for len bytes in the buffer of sink */
+static char *
+sink_reserve(struct Split_sink *sink, size_t len)
+{
+  if (SPLIT_BUFFER - sink->len < len) {
+    if (len > SPLIT_BUFFER)
+      LOG_AND_EXIT("Line of %zu bytes doesn't fit in a buffer\n", len);
+    sink_submit(sink);
+  }
+  return sink->buf + sink->len;
+}
+
+void
+split_start(char const *prefix, unsigned writers)
+{
+  assert(!s.active && prefix && writers);
+  memset(&s, 0, sizeof(s));
+  s.prefix = strdup(prefix);
+  if (!s.prefix)
+    REPORT_AND_EXIT;
+  /* A file per rank stays open */
+  struct rlimit lim;
+  if (!getrlimit(RLIMIT_NOFILE, &lim) && lim.rlim_cur < lim.rlim_max) {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+  /* (at most that many buffers are ever out of the sinks) */
+  s.free_bufs = malloc((SPLIT_QUEUE + writers) * sizeof(*(s.free_bufs)));
+  s.writers = malloc(writers * sizeof(*(s.writers)));
+  if (!s.free_bufs || !s.writers)
+    REPORT_AND_EXIT;
+  if ((errno = pthread_mutex_init(&(s.lock), NULL)) ||
+      (errno = pthread_cond_init(&(s.queued), NULL)) ||
+      (errno = pthread_cond_init(&(s.written), NULL)))
+    REPORT_AND_EXIT;
+  for (s.nwriters = 0; s.nwriters < writers; s.nwriters++)
+    if ((errno = pthread_create(s.writers + s.nwriters, NULL, split_writer,
+            NULL)))
+      REPORT_AND_EXIT;
+  s.active = true;
+}
+
+bool
+split_active(void)
+{
+  return s.active;
+}
+
+void
+split_state(struct State const *state)
+{
+  assert(state);
+  struct Split_sink *sink = split_sink(state->rank);
+  char *line = sink_reserve(sink, EVENT_LINE_MAX_FIXED +
+      strlen(state->routine));
+  sink->len = (size_t)(state_format(line, state) - sink->buf);
+}
+
+void
+split_link(struct Link const *link)
+{
+  assert(link);
+  struct Split_sink *sink = split_sink(link->to);
+  char *line = sink_reserve(sink, EVENT_LINE_MAX_FIXED + (link->container ?
+        strlen(link->container) : 0));
+  sink->len = (size_t)(link_format(line, link) - sink->buf);
+}
+
+void
+split_finish(void)
+{
+  assert(s.active);
+  for (size_t i = 0; i < s.nsinks; i++)
+    if (s.sinks[i].fd != -1 && s.sinks[i].len)
+      sink_submit(s.sinks + i);
+  pthread_mutex_lock(&(s.lock));
+  s.done = true;
+  pthread_cond_broadcast(&(s.queued));
+  pthread_mutex_unlock(&(s.lock));
+  for (unsigned i = 0; i < s.nwriters; i++)
+    if ((errno = pthread_join(s.writers[i], NULL)))
+      REPORT_AND_EXIT;
+  check_failed();
+  for (size_t i = 0; i < s.nsinks; i++) {
+    if (s.sinks[i].fd == -1)
+      continue;
+    if (close(s.sinks[i].fd))
+      REPORT_AND_EXIT;
+    free(s.sinks[i].buf);
+  }
+  for (size_t i = 0; i < s.nfree; i++)
+    free(s.free_bufs[i]);
+  pthread_mutex_destroy(&(s.lock));
+  pthread_cond_destroy(&(s.queued));
+  pthread_cond_destroy(&(s.written));
+  free(s.free_bufs);
+  free(s.writers);
+  free(s.sinks);
+  free(s.prefix);
+  memset(&s, 0, sizeof(s));
+}
@@ -0,0 +1,171 @@
+/* See the header file for contracts and more docs */
+/* logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "store.h"
+#include "logging.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Room of the columns of a rank on its first State, when not reserved */
+#define STORE_FIRST 8
+
+/* Bytes of the columns of a State, in the order rank_carve lays them out */
+#define STATE_BYTES (2 * sizeof(double) + sizeof(uint64_t) +\
+    sizeof(union comm) + sizeof(char const *) + sizeof(int) + 1)
+
+/* Bytes of the columns of n States, carved by rank_carve */
+#define RANK_BYTES(n) (((size_t)(n) * STATE_BYTES + 7) & ~(size_t)7)
+
+/* Give r (without columns) room for cap States in the slab at base */
+static void
+rank_carve(struct Store_rank *r, char *base, uint32_t cap)
+{
+  r->start = (double *)base;
+  r->end = r->start + cap;
+  r->mark = (uint64_t *)(r->end + cap);
+  r->comm = (union comm *)(r->mark + cap);
+  r->routine = (char const **)(r->comm + cap);
+  r->imbrication = (int *)(r->routine + cap);
+  r->code = (unsigned char *)(r->imbrication + cap);
+  r->cap = cap;
+}
+
+/* Resize the columns of r to cap States, moving them out of the slab */
+static void
+rank_resize(struct Store_rank *r, uint32_t cap)
+{
+  struct Store_rank const old = *r;
+  bool const carved = !r->own && r->cap;
+  if (!r->own)
+    *r = (struct Store_rank){ .len = old.len, .own = true };
+  r->start = realloc(r->start, cap * sizeof(*(r->start)));
+  r->end = realloc(r->end, cap * sizeof(*(r->end)));
+  r->mark = realloc(r->mark, cap * sizeof(*(r->mark)));
+  r->comm = realloc(r->comm, cap * sizeof(*(r->comm)));
+  r->routine = realloc(r->routine, cap * sizeof(*(r->routine)));
+  r->imbrication = realloc(r->imbrication, cap * sizeof(*(r->imbrication)));
+  r->code = realloc(r->code, cap * sizeof(*(r->code)));
+  if (!r->start || !r->end || !r->mark || !r->comm || !r->routine ||
+      !r->imbrication || !r->code)
+    REPORT_AND_EXIT;
+  r->cap = cap;
+  if (!carved)
+    return;
+  memcpy(r->start, old.start, old.len * sizeof(*(r->start)));
+  memcpy(r->end, old.end, old.len * sizeof(*(r->end)));
+  memcpy(r->mark, old.mark, old.len * sizeof(*(r->mark)));
+  memcpy(r->comm, old.comm, old.len * sizeof(*(r->comm)));
+  memcpy(r->routine, old.routine, old.len * sizeof(*(r->routine)));
+  memcpy(r->imbrication, old.imbrication, old.len *
+      sizeof(*(r->imbrication)));
+  memcpy(r->code, old.code, old.len * sizeof(*(r->code)));
+}
+
+/* Make room for n States in the file order column */
+static void
+order_resize(struct Store *store, size_t n)
+{
+  store->order = realloc(store->order, n * sizeof(*(store->order)));
+  if (!store->order)
+    REPORT_AND_EXIT;
+  store->cap = n;
+}
+
+void
+store_reserve(struct Store *store, size_t ranks, uint64_t const *states)
+{
+  if (ranks > store->nranks) {
+    store->ranks = realloc(store->ranks, ranks * sizeof(*(store->ranks)));
+    if (!store->ranks)
+      REPORT_AND_EXIT;
+    memset(store->ranks + store->nranks, 0, (ranks - store->nranks) *
+        sizeof(*(store->ranks)));
+    store->nranks = ranks;
+  }
+  if (!states)
+    return;
+  size_t total = store->len,
+         slab = 0;
+  for (size_t i = 0; i < ranks; i++) {
+    struct Store_rank *r = store->ranks + i;
+    if (states[i] >= STORE_NONE)
+      LOG_AND_EXIT("Too many States in rank %zu\n", i);
+    /* (the ranks without columns yet go to the slab, unless there is one) */
+    if (states[i] && !r->cap && !store->slab)
+      slab += RANK_BYTES(states[i]);
+    else if (states[i] > r->cap)
+      rank_resize(r, (uint32_t)(states[i]));
+    total += states[i] > r->len ? states[i] - r->len : 0;
+  }
+  if (total > store->cap)
+    order_resize(store, total);
+  if (!slab)
+    return;
+  if (!(store->slab = malloc(slab)))
+    REPORT_AND_EXIT;
+  char *base = store->slab;
+  for (size_t i = 0; i < ranks; i++)
+    if (!store->ranks[i].cap && states[i]) {
+      rank_carve(store->ranks + i, base, (uint32_t)(states[i]));
+      base += RANK_BYTES(states[i]);
+    }
+}
+
+/* Make sure there is a Store_rank for rank */
+static void
+store_room(struct Store *store, int rank)
+{
+  if (rank < 0)
+    LOG_AND_EXIT("Negative rank %d can't be stored\n", rank);
+  if ((size_t)rank < store->nranks)
+    return;
+  size_t new_ranks = store->nranks * 2;
+  if (new_ranks <= (size_t)rank)
+    new_ranks = (size_t)rank + 1;
+  store_reserve(store, new_ranks, NULL);
+}
+
+uint32_t
+store_push(struct Store *store, struct State const *state)
+{
+  store_room(store, state->rank);
+  struct Store_rank *r = store->ranks + state->rank;
+  if (r->len == r->cap) {
+    if (r->cap >= STORE_NONE / 2)
+      LOG_AND_EXIT("Too many States in rank %d\n", state->rank);
+    rank_resize(r, r->cap ? 2 * r->cap : STORE_FIRST);
+  }
+  if (store->len == store->cap)
+    order_resize(store, store->cap ? 2 * store->cap : STORE_FIRST);
+  store->order[store->len++] = state->rank;
+  uint32_t i = r->len++;
+  r->start[i] = state->start;
+  r->end[i] = state->end;
+  r->mark[i] = state->mark;
+  r->comm[i] = state->comm;
+  r->routine[i] = state->routine;
+  r->imbrication[i] = state->imbrication;
+  r->code[i] = (unsigned char)(state->code);
+  return i;
+}
+
+void
+store_release(struct Store *store)
+{
+  for (size_t i = 0; i < store->nranks; i++) {
+    struct Store_rank *r = store->ranks + i;
+    if (!r->own)
+      continue;
+    free(r->start);
+    free(r->end);
+    free(r->mark);
+    free(r->comm);
+    free(r->routine);
+    free(r->imbrication);
+    free(r->code);
+  }
+  free(store->ranks);
+  free(store->order);
+  free(store->slab);
+  memset(store, 0, sizeof(*store));
+}
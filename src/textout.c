@@ -0,0 +1,227 @@
+/* See the header file for contracts and more docs */
+/* For logging.h */
+#define _POSIX_C_SOURCE 200809L
+#include "textout.h"
+#include "events.h"
+#include "output.h"
+#include "logging.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+
+/* A copied event, its string (static or interned) pointed to as is */
+struct Textout_event {
+  enum Record type;
+  union {
+    struct State state;
+    struct Link link;
+  } u;
+};
+
+struct Textout_block {
+  struct Textout_event *events;
+  size_t len;
+  /* The formatted lines, and what they can take at most */
+  char *text;
+  size_t text_len,
+         text_cap,
+         text_max;
+  /* Whether the block is yet to be written, and whether it is formatted */
+  bool submitted,
+       formatted;
+};
+
+/*
+ * Ring of blocks, one more than there are workers. We fill blocks[cur]. The
+ * blocks after it (in ring order) are submitted, oldest first, so the next one
+ * is written (once formatted) before being filled again. The workers take the
+ * submitted blocks in ring order too, from blocks[take].
+ */
+static struct Textout_block *blocks = NULL;
+static size_t nblocks = 0,
+              cur = 0;
+
+/* The worker threads, and what they share, under lock */
+static pthread_t *workers = NULL;
+static size_t nworkers = 0;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t submitted = PTHREAD_COND_INITIALIZER,
+                      formatted = PTHREAD_COND_INITIALIZER;
+/* The submitted blocks no worker took yet are the pending from take on */
+static size_t take = 0,
+              pending = 0;
+static bool stopping = false;
+
+static void
+block_format(struct Textout_block *block)
+{
+  if (block->text_cap < block->text_max) {
+    free(block->text);
+    block->text_cap = block->text_max;
+    block->text = malloc(block->text_cap);
+    if (!block->text)
+      REPORT_AND_EXIT;
+  }
+  char *it = block->text;
+  for (size_t i = 0; i < block->len; i++) {
+    struct Textout_event *event = block->events + i;
+    if (event->type == RECORD_STATE)
+      it = state_format(it, &(event->u.state));
+    else
+      it = link_format(it, &(event->u.link));
+  }
+  block->text_len = (size_t)(it - block->text);
+}
+
+/* Format the submitted blocks as they come, until textout_finish */
+static void *
+worker(void *arg)
+{
+  (void)arg;
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!pending && !stopping)
+      pthread_cond_wait(&submitted, &lock);
+    if (!pending)
+      break;
+    struct Textout_block *block = blocks + take;
+    take = (take + 1) % nblocks;
+    pending--;
+    pthread_mutex_unlock(&lock);
+    block_format(block);
+    pthread_mutex_lock(&lock);
+    block->formatted = true;
+    pthread_cond_broadcast(&formatted);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+/* Wait for the block to be formatted, write it and empty it */
+static void
+block_write(struct Textout_block *block)
+{
+  if (block->submitted) {
+    pthread_mutex_lock(&lock);
+    while (!block->formatted)
+      pthread_cond_wait(&formatted, &lock);
+    pthread_mutex_unlock(&lock);
+    output_write(block->text, block->text_len);
+    block->submitted = false;
+    block->formatted = false;
+  }
+  block->len = 0;
+  block->text_max = 0;
+}
+
+/* Hand blocks[cur] to the workers, moving on to the next block */
+static void
+block_submit(void)
+{
+  pthread_mutex_lock(&lock);
+  blocks[cur].submitted = true;
+  pending++;
+  pthread_cond_signal(&submitted);
+  pthread_mutex_unlock(&lock);
+  cur = (cur + 1) % nblocks;
+  block_write(blocks + cur);
+}
+
+/*
+ * Room for the next event of blocks[cur], str being its string (NULL if none)
+ * and line_max what its line takes at most, besides that string
+ */
+static struct Textout_event *
+event_next(char const *str, size_t line_max)
+{
+  struct Textout_block *block = blocks + cur;
+  if (block->len == TEXTOUT_BLOCK) {
+    block_submit();
+    block = blocks + cur;
+  }
+  block->text_max += line_max;
+  if (str)
+    block->text_max += strlen(str);
+  return block->events + block->len++;
+}
+
+void
+textout_start(unsigned jobs)
+{
+  assert(!blocks && jobs);
+  nworkers = jobs;
+  nblocks = nworkers + 1;
+  cur = 0;
+  take = 0;
+  pending = 0;
+  stopping = false;
+  blocks = calloc(nblocks, sizeof(*blocks));
+  workers = malloc(nworkers * sizeof(*workers));
+  if (!blocks || !workers)
+    REPORT_AND_EXIT;
+  for (size_t i = 0; i < nblocks; i++) {
+    blocks[i].events = malloc(TEXTOUT_BLOCK * sizeof(*(blocks[i].events)));
+    if (!blocks[i].events)
+      REPORT_AND_EXIT;
+  }
+  for (size_t i = 0; i < nworkers; i++)
+    if ((errno = pthread_create(workers + i, NULL, worker, NULL)))
+      REPORT_AND_EXIT;
+}
+
+bool
+textout_active(void)
+{
+  return blocks;
+}
+
+void
+textout_state(struct State const *state)
+{
+  assert(state);
+  struct Textout_event *event = event_next(state->routine,
+      EVENT_LINE_MAX_FIXED);
+  event->type = RECORD_STATE;
+  event->u.state = *state;
+}
+
+void
+textout_link(struct Link const *link)
+{
+  assert(link);
+  struct Textout_event *event = event_next(link->container,
+      EVENT_LINE_MAX_FIXED);
+  event->type = RECORD_LINK;
+  event->u.link = *link;
+}
+
+void
+textout_finish(void)
+{
+  assert(blocks);
+  if (blocks[cur].len)
+    block_submit();
+  /* (in ring order from cur, that is oldest first) */
+  for (size_t i = 0; i < nblocks; i++) {
+    block_write(blocks + cur);
+    cur = (cur + 1) % nblocks;
+  }
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_broadcast(&submitted);
+  pthread_mutex_unlock(&lock);
+  for (size_t i = 0; i < nworkers; i++)
+    if ((errno = pthread_join(workers[i], NULL)))
+      REPORT_AND_EXIT;
+  free(workers);
+  workers = NULL;
+  for (size_t i = 0; i < nblocks; i++) {
+    free(blocks[i].events);
+    free(blocks[i].text);
+  }
+  free(blocks);
+  blocks = NULL;
+}